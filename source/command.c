@@ -22,6 +22,20 @@
 char* textline;
 size_t textline_capacity;
 uint16_t attribute = 0x70;
+int origin = 0; // the row of the screen buffer displayed at the top of the screen
+
+
+uint16_t* textrow( int y ) {
+	return ((uint16_t*)screenbuffer()) + screenwidth() * ( ( origin + y ) % screenheight() );
+}
+
+
+// Rather than moving all the text up, the top row is cleared and the viewport moved down to show it as the bottom row
+void scrollup( void ) {
+	memset( textrow( 0 ), 0, screenwidth() * sizeof( uint16_t ) );
+	origin = ( origin + 1 ) % screenheight();
+	setviewport( 0, origin );
+}
 
 
 int getnum( const char** str ) {
@@ -53,12 +67,11 @@ int print( const char* format, ... ) {
 			gotoxy( 0, wherey() +  1 ); 
 		}
 		while( wherey() >= screenheight() ) {
-			memmove( ((uint16_t*)screenbuffer()), ((uint16_t*)screenbuffer()) + screenwidth(), screenwidth() * ( screenheight() - 1 ) * sizeof( uint16_t ) );
-			memset( ((uint16_t*)screenbuffer()) + screenwidth() * ( screenheight() - 1 ), 0, screenwidth() * sizeof( uint16_t ) );
+			scrollup();
 			gotoxy( wherex(), wherey() - 1 );
 		}
 		if( (unsigned) *str >= ' ' ) {
-			((uint16_t*)screenbuffer())[ wherex() + screenwidth() * wherey() ] = ( ( attribute & 0xf0 ) << 4 ) | ( ( attribute & 0x0f ) << 12 ) | (unsigned char) *str;
+			textrow( wherey() )[ wherex() ] = ( ( attribute & 0xf0 ) << 4 ) | ( ( attribute & 0x0f ) << 12 ) | (unsigned char) *str;
             gotoxy( wherex() + 1, wherey() );
 		} else if( (unsigned) *str == 0x1b && (unsigned) *( str + 1) == '[' ) { // ANSI escape sequence
 			const char* ansi = str + 2;
@@ -140,8 +153,7 @@ int print( const char* format, ... ) {
         gotoxy( 0, wherey() + 1 );
 	}
 	while( wherey() >= screenheight() ) {
-		memmove( ((uint16_t*)screenbuffer()), ((uint16_t*)screenbuffer()) + screenwidth(), screenwidth() * ( screenheight() - 1 ) * sizeof( uint16_t ) );
-		memset( ((uint16_t*)screenbuffer()) + screenwidth() * ( screenheight() - 1 ), 0, screenwidth() * sizeof( uint16_t ) );
+		scrollup();
         gotoxy( 0, wherey() - 1 );
 	}
 	return len;
@@ -31,17 +31,51 @@ enum videomode_t {
 };
 
 void setvideomode( enum videomode_t mode );
+int setcustomvideomode( int width, int height ); // 8-bit graphics mode of any size up to 4096x4096
 void setdoublebuffer( int enabled );
 int screenwidth( void );
 int screenheight( void );
 unsigned char* screenbuffer( void );
 unsigned char* swapbuffers( void );
+void markdirty( int x, int y, int w, int h );
 void waitvbl( void );
+
+int setvirtualsize( int width, int height ); // in characters in text modes
+void setviewport( int x, int y ); // wraps around the edges of the buffer
 void setpal( int index, int r, int g, int b );
 void getpal( int index, int* r, int* g, int* b );
+void setpalette( int first, int count, unsigned char const* rgb ); // r, g, b (0-63) for each entry
+
+void palettecycle( int first, int count, int speed ); // speed in entries per second, 0 stops it
+void palettefade( unsigned char const* target, int frames ); // target is 768 values of 0-63, or NULL for black
+
+void setrasterpal( int line, int index, int r, int g, int b ); // graphics modes only
+void setrasterscroll( int line, int dx );
+void clearraster( void );
 
 int shuttingdown( void );
 
+struct frametime_t {
+    float min;
+    float avg;
+    float p99;
+};
+
+struct framestats_t {
+    int frames; // number of recent frames the stats are based on
+    int missedvbls; // vblanks within those frames where the program did not call waitvbl in time
+    struct frametime_t user; // ms from returning from waitvbl to calling it again
+    struct frametime_t wait; // ms blocked in waitvbl
+    struct frametime_t copy; // ms the present thread spent picking up the frame, input and audio state
+    struct frametime_t expand; // ms the present thread spent converting the screen to 32-bit pixels
+    struct frametime_t present; // ms the present thread spent in the CRT emulation
+};
+
+struct framestats_t getframestats( void );
+
+int startcapture( char const* gif_filename, char const* wav_filename ); // either filename may be NULL
+void stopcapture( void );
+
 
 void cputs( char const* string );
 void textcolor( int color );
@@ -59,6 +93,35 @@ void blit( int x, int y, unsigned char* source, int width, int height, int srcx,
 void maskblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch, 
     int colorkey );
 
+struct sprite_t* makesprite( unsigned char const* pixels, int width, int height, int colorkey ); // copies the pixels
+void drawsprite( int x, int y, struct sprite_t* sprite );
+void freesprite( struct sprite_t* sprite );
+
+enum {
+    BLIT_CLIP  = 0, // source positions outside the bitmap are not drawn
+    BLIT_WRAP  = 1, // the bitmap repeats in both directions
+    BLIT_CLAMP = 2, // the edge pixels of the bitmap repeat
+};
+
+void scaleblit( int x, int y, int w, int h, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, 
+    int srch, int colorkey, int addressing ); // stretches the source area over x, y, w, h
+void rotoblit( int x, int y, int w, int h, unsigned char* source, int width, int height, float u, float v, float angle, 
+    float zoom, int colorkey, int addressing ); // angle in radians, clockwise
+
+void buildshadetable( int levels ); // level 0 is unshaded, levels - 1 is black
+unsigned char const* shadetable( int level );
+void shadeblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch,
+    int colorkey, int level );
+void shadecolumn( int x, int y, int h, unsigned char* source, int width, int height, int u, float v, float vstep,
+    int colorkey, int level );
+
+void buildblendtable( int alpha ); // opacity 0-255, 128 until built
+unsigned char const* blendtable( void ); // color a over color b is entry a * 256 + b
+void blendblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch,
+    int colorkey );
+void blendbar( int x, int y, int w, int h );
+void blendhline( int x, int y, int len, int color );
+
 void clearscreen( void );
 int getpixel( int x, int y );
 void hline( int x, int y, int len, int color );
@@ -67,6 +130,37 @@ void putpixel( int x, int y, int color );
 void setdrawtarget( unsigned char* pixels, int width, int height );
 void resetdrawtarget( void );
 
+struct bitmap_t { 
+    unsigned char* pixels; 
+    int width; 
+    int height; 
+    int pitch; // bytes from one row to the next
+};
+struct bitmap_t subbitmap( struct bitmap_t bitmap, int x, int y, int width, int height );
+struct bitmap_t screenbitmap( void );
+void setdrawbitmap( struct bitmap_t bitmap );
+void bitmapblit( int x, int y, struct bitmap_t source, int colorkey );
+void bitmapscaleblit( int x, int y, int w, int h, struct bitmap_t source, int colorkey, int addressing );
+void bitmaprotoblit( int x, int y, int w, int h, struct bitmap_t source, float u, float v, float angle, float zoom, 
+    int colorkey, int addressing );
+void bitmapshadeblit( int x, int y, struct bitmap_t source, int colorkey, int level );
+void bitmapshadecolumn( int x, int y, int h, struct bitmap_t source, int u, float v, float vstep, int colorkey, 
+    int level );
+void bitmapblendblit( int x, int y, struct bitmap_t source, int colorkey );
+struct sprite_t* bitmapsprite( struct bitmap_t bitmap, int colorkey );
+
+unsigned char* setoverlay( int layer, int x, int y, int width, int height, int colorkey ); // layer 0-7
+void updateoverlay( int layer ); // shows the changes made to the pixels
+void moveoverlay( int layer, int x, int y );
+void removeoverlay( int layer );
+
+void setdrawthreads( int threads ); // 0 draws immediately
+void flushdraw( void );
+
+struct drawctx_t* makedrawctx( void );
+void freedrawctx( struct drawctx_t* ctx );
+void setdrawctx( struct drawctx_t* ctx ); // NULL for the default context
+
 void setcolor( int color );
 int getcolor( void );
 void line( int x1, int y1, int x2, int y2 );
@@ -78,12 +172,14 @@ void ellipse( int x, int y, int rx, int ry );
 void fillellipse( int x, int y, int rx, int ry );
 void drawpoly( int* points_xy, int count );
 void fillpoly( int* points_xy, int count );
+void fillpolys( int* points_xy, int* counts, int* colors, int polycount ); // colors may be NULL
 void floodfill( int x, int y );
 void boundaryfill( int x, int y, int boundary );
 
 void outtextxy( int x, int y, char const* text ); 
 void wraptextxy( int x, int y, char const* text, int width ); 
 void centertextxy( int x, int y, char const* text, int width ); 
+void outlinetextxy( int x, int y, char const* text, int outlinecolor, int width, int centered );
 
 enum {
     DEFAULT_FONT_8X8  = 1,
@@ -193,6 +289,25 @@ int keystate( enum keycode_t key );
 enum keycode_t* readkeys( void );
 char const* readchars( void );
 
+enum inputevent_type_t {
+    inputevent_keydown, // also sent for mouse buttons, as KEY_LBUTTON, KEY_RBUTTON etc
+    inputevent_keyup,
+    inputevent_char,
+    inputevent_mousemove,
+    inputevent_mousedelta,
+};
+
+struct inputevent_t {
+    enum inputevent_type_t type;
+    unsigned long long time; // microseconds since the program started
+    enum keycode_t key; // inputevent_keydown and inputevent_keyup
+    char chr; // inputevent_char
+    int x; // inputevent_mousemove: same as mousex, inputevent_mousedelta: same as mouserelx
+    int y; // inputevent_mousemove: same as mousey, inputevent_mousedelta: same as mouserely
+};
+
+int readevents( struct inputevent_t* events, int capacity );
+
 int mousex( void );
 int mousey( void );
 int mouserelx( void );
@@ -217,6 +332,7 @@ int mouserely( void );
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "libs/app.h"
 #include "libs/crtemu_pc.h"
@@ -259,6 +375,9 @@ int mouserely( void );
 #endif
 
 bool app_has_focus( app_t* app );
+static uint64_t internals_time_us( void );
+static void internals_expand_init( void );
+static void internals_expand( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette );
 
 #include "libs/awe32rom.h"
 #include "libs/crtframe.h"
@@ -345,6 +464,147 @@ pixelfont_t* internals_build_font( uint32_t* font ) {
 }
 
 
+// The same as pixelfont_blit, but drawing to a target with rows `stride` pixels apart, which is clipped as if it spanned
+// the rows from top to bottom, while only the rows from 0 to height are drawn. A band of rows is then drawn just like
+// the same rows of the whole target.
+static void internals_pixelfont_blit( pixelfont_t const* font, int x, int y, char const* text, PIXELFONT_U8 color,
+    PIXELFONT_U8* target, int width, int height, int stride, int top, int bottom, pixelfont_align_t align, 
+    int wrap_width, int hspacing,
+    int vspacing, int limit, pixelfont_bold_t bold, pixelfont_italic_t italic, pixelfont_underline_t underline,
+    pixelfont_bounds_t* bounds ) {
+
+    int xp = x;
+    int yp = y;
+    int max_x = x;
+    int last_x_on_line = xp;
+    int count = 0;
+    char const* str = text;
+    while( *str ) {
+        int line_char_count = 0;
+        int line_width = 0;
+        int last_space_char_count = 0;
+        int last_space_width = 0;
+        char const* tstr = str;
+        while( *tstr != '\n' && *tstr != '\0' && ( wrap_width <= 0 || line_width <= wrap_width ) ) {
+            if( *tstr <= ' ' ) {
+                last_space_char_count = line_char_count;
+                last_space_width = line_width;
+            }
+            PIXELFONT_U8 const* g = font->glyphs + font->offsets[ (unsigned char) *tstr ];
+            line_width += (PIXELFONT_I8) *g++;
+            int w = *g++;
+            g += font->height * w;
+            line_width += (PIXELFONT_I8) *g++;
+            line_width += hspacing + ( bold ? 1 : 0 );
+            ++tstr;
+            int kern = *g++;
+            for( int k = 0; k < kern; ++k ) {
+                if( *g++ == *tstr ) { 
+                    line_width += (PIXELFONT_I8) *g++; 
+                    break; 
+                } 
+                ++g;
+            }
+            ++line_char_count;
+        }
+
+        int skip_space = 0;
+        if( wrap_width > 0 && line_width > wrap_width ) {
+            if( last_space_char_count > 0 ) line_char_count = last_space_char_count;
+            line_width = last_space_width;
+            skip_space = 1;
+        }
+
+        if( wrap_width > 0 ) {
+            if( align == PIXELFONT_ALIGN_RIGHT ) x += wrap_width - line_width;
+            if( align == PIXELFONT_ALIGN_CENTER ) x += ( wrap_width - line_width ) / 2;
+        } else {
+            if( align == PIXELFONT_ALIGN_RIGHT ) x -= line_width;
+            if( align == PIXELFONT_ALIGN_CENTER ) x -= line_width / 2;
+        }
+
+        for( int c = 0; c < line_char_count; ++c ) {
+            PIXELFONT_U8 const* g = font->glyphs + font->offsets[ (unsigned char) *str ];
+            x += (PIXELFONT_I8) *g++;
+            int w = *g++;
+            int h = font->height;
+            for( int iy = y; iy < y + h; ++iy ) {
+                int xs = x + ( italic ? ( h - ( iy - y ) ) / 2 - 1 : 0 );
+                for( int ix = xs; ix < xs + w; ++ix ) {
+                    int col = *g++;
+                    if( !col || !target || ( limit >= 0 && count >= limit ) ) continue;
+                    if( ix >= 0 && iy >= top && ix < width && iy < bottom ) {
+                        last_x_on_line = ix >= last_x_on_line ? ix + ( bold ? 1 : 0 ) : last_x_on_line;
+                        if( iy >= 0 && iy < height ) {
+                            target[ ix + iy * stride ] = (PIXELFONT_U8)( color + col - 1 );
+                            if( bold && ix + 1 < width ) {
+                                target[ ix + 1 + iy * stride ] = (PIXELFONT_U8)( color + col - 1 );
+                            }
+                        }
+                    }
+                }
+            }
+
+            x += (PIXELFONT_I8) *g++;
+            x += hspacing + ( bold ? 1 : 0 );
+            ++str;
+            ++count;
+
+            int kern = *g++;
+            for( int k = 0; k < kern; ++k ) {
+                if( *g++ == *str ) { 
+                    x += (PIXELFONT_I8) *g++; 
+                    break; 
+                } 
+                ++g;
+            }
+        }
+
+        int underline_y = y + font->baseline + 1;
+        if( underline && target && underline_y >= 0 && underline_y < height && last_x_on_line > xp ) {
+            for( int ix = xp; ix <= last_x_on_line; ++ix ) {
+                if( ix >= 0 && ix < width ) {
+                    target[ ix + underline_y * stride ] = color;
+                }
+            }
+        }
+        last_x_on_line = xp;
+        max_x = x > max_x ? x : max_x;
+        x = xp;
+        y += font->line_spacing + vspacing;
+        if( *str == '\n' ) ++str;
+        if( *str && skip_space && *str <= ' ' ) ++str;
+    }
+
+    if( bounds ) {
+        bounds->width = wrap_width > 0 ? wrap_width : ( max_x - xp );
+        bounds->height = y - yp;
+    }
+}
+
+
+// Expands each glyph of a packed font to one byte per pixel (1 for set, 0 for clear), stored one glyph after another
+static void internals_build_glyphs( uint8_t* glyphs, uint32_t const* font ) {
+	uint32_t const* data = font; 
+    int chr_width = (int)*data++;
+    int chr_height = (int)*data++;
+    data++; // baseline
+    int chr_mod = 256 / chr_width;
+    for( int c = 0; c < 256; ++c ) {
+		int sx = ( c % chr_mod ) * chr_width; 
+		int sy = ( c / chr_mod ) * chr_height; 
+		for( int y = 0; y < chr_height; ++y ) { 
+			for( int x = 0; x < chr_width; ++x ) { 
+				int v = ( sx + x ) / 32; 
+				int u = ( sx + x ) - ( v * 32 ); 
+				uint32_t b = data[ v + ( sy + y ) * 8 ]; 
+                *glyphs++ = ( b & ( 1u << u ) ) ? 1 : 0;
+			} 
+		} 
+    }
+}
+
+
 #define DEFAULT_SOUNDBANK_NONE 0
 
 
@@ -374,6 +634,331 @@ enum soundbank_type_t {
 };
 
 
+// Input events are written to a ring by the present thread as they arrive, and read by the user thread. The present 
+// thread never waits: if the ring is full, the oldest events are overwritten, and skipped by the reader.
+#define INTERNALS_EVENTS_COUNT 1024
+
+
+// Rolling window of frame timings, in milliseconds
+#define INTERNALS_FRAMESTATS_COUNT 120
+
+struct internals_stats_t {
+    uint64_t wait_end_us;
+    int user_count;
+    int user_index;
+    float user[ INTERNALS_FRAMESTATS_COUNT ];
+    float wait[ INTERNALS_FRAMESTATS_COUNT ];
+    int present_count;
+    int present_index;
+    float copy[ INTERNALS_FRAMESTATS_COUNT ];
+    float expand[ INTERNALS_FRAMESTATS_COUNT ];
+    float present[ INTERNALS_FRAMESTATS_COUNT ];
+    uint8_t missed[ INTERNALS_FRAMESTATS_COUNT ];
+};
+
+
+// Per line palette overrides and scroll offsets, applied by the present thread. The changes are sorted by line and
+// index, and scroll holds the offsets of the lines above scroll_lines.
+#define INTERNALS_RASTER_LINES 4096
+#define INTERNALS_RASTER_CHANGES 4096
+
+struct internals_raster_change_t {
+    uint16_t line;
+    uint8_t index;
+    uint32_t color;
+};
+
+struct internals_raster_t {
+    int stamp; // incremented on every change
+    int changes_count;
+    struct internals_raster_change_t changes[ INTERNALS_RASTER_CHANGES ];
+    int scroll_lines;
+    int scroll[ INTERNALS_RASTER_LINES ];
+};
+
+
+// An overlay layer. The program draws to pixels, which are copied to shown by updateoverlay, under the lock, for the 
+// present thread to take its own copy of whenever the stamp changes.
+#define INTERNALS_OVERLAY_LAYERS 8
+
+struct internals_overlay_t {
+    int stamp;
+    bool visible;
+    int x;
+    int y;
+    int width;
+    int height;
+    int colorkey;
+    uint8_t* pixels;
+    uint8_t* shown;
+};
+
+
+// Draws the overlays covering line y of the screen on top of that line once it has been expanded
+static void internals_draw_overlays( APP_U32* dst, int y, int width, uint32_t const* palette, 
+    struct internals_overlay_t const* overlays ) {
+
+    for( int i = 0; i < INTERNALS_OVERLAY_LAYERS; ++i ) {
+        struct internals_overlay_t const* overlay = &overlays[ i ];
+        if( !overlay->visible || y < overlay->y || y >= overlay->y + overlay->height ) {
+            continue;
+        }
+        int x0 = overlay->x < 0 ? 0 : overlay->x;
+        int x1 = overlay->x + overlay->width < width ? overlay->x + overlay->width : width;
+        uint8_t const* src = overlay->pixels + ( y - overlay->y ) * overlay->width + ( x0 - overlay->x );
+        for( int x = x0; x < x1; ++x, ++src ) {
+            if( *src != overlay->colorkey ) {
+                dst[ x ] = palette[ *src ];
+            }
+        }
+    }
+}
+
+
+// A completed frame handed from the user thread to the present thread, along with the mode and palette it was drawn with
+struct internals_frame_t {
+    uint8_t* buffer;
+    int width;
+    int height;
+    uint32_t* font;
+    int virtual_width;
+    int virtual_height;
+    int view_x;
+    int view_y;
+    uint32_t palette[ 256 ];
+    int palette_stamp;
+    int palette_steps;
+    struct internals_raster_t raster;
+};
+
+
+// A range of palette entries rotated by the present thread
+#define INTERNALS_PALETTE_CYCLES 16
+
+struct internals_palette_cycle_t {
+    int first;
+    int count;
+    int speed; // entries per second
+    int phase; // sixtieths of an entry, accumulated towards the next step
+};
+
+
+// Frames and sound for a capture are passed to the encoder thread through fixed pools of slots, recycled through the 
+// `free_` queues. The producers never wait for a slot: frames and sound are dropped if the encoder has fallen behind.
+#define INTERNALS_CAPTURE_FRAMES 4
+#define INTERNALS_CAPTURE_CHUNKS 32
+#define INTERNALS_CAPTURE_CHUNK_SIZE 1024 // sample pairs
+
+struct internals_capture_frame_t {
+    int number; // counted in displayed frames, at 60 per second
+    int width;
+    int height;
+    uint32_t const* font;
+    int curs_x;
+    int curs_y;
+    uint32_t palette[ 256 ];
+    uint8_t* pixels; // grown by the present thread when needed
+    size_t capacity;
+};
+
+struct internals_capture_chunk_t {
+    int count;
+    APP_S16 samples[ INTERNALS_CAPTURE_CHUNK_SIZE * 2 ];
+};
+
+struct internals_capture_t {
+    thread_ptr_t thread;
+    thread_signal_t wake; // raised when stopping
+    thread_atomic_int_t exit_flag;
+    int frame_number;
+    int dropped_frames;
+    int dropped_chunks;
+
+    thread_queue_t frames;
+    thread_queue_t free_frames;
+    void* frames_values[ INTERNALS_CAPTURE_FRAMES ];
+    void* free_frames_values[ INTERNALS_CAPTURE_FRAMES ];
+    struct internals_capture_frame_t frame_slots[ INTERNALS_CAPTURE_FRAMES ];
+
+    thread_queue_t chunks;
+    thread_queue_t free_chunks;
+    void* chunks_values[ INTERNALS_CAPTURE_CHUNKS ];
+    void* free_chunks_values[ INTERNALS_CAPTURE_CHUNKS ];
+    struct internals_capture_chunk_t chunk_slots[ INTERNALS_CAPTURE_CHUNKS ];
+
+    bool wav_open;
+    drwav wav;
+
+    // Only touched by the encoder thread
+    FILE* gif;
+    int gif_width;
+    int gif_height;
+    uint8_t* shown; // the image as it appears in the file so far
+    uint8_t* pending; // the most recent image, not yet written as its duration is not yet known
+    uint8_t* next;
+    int frames_written;
+    uint32_t gif_palette[ 256 ]; // the global palette of the file, from the first frame
+    uint32_t shown_palette[ 256 ];
+    uint32_t pending_palette[ 256 ];
+    bool has_pending;
+    int pending_time; // in hundredths of a second
+    int last_time;
+    uint32_t const* glyphs_font;
+    uint8_t glyphs[ 256 * 9 * 16 ];
+    uint16_t* lzw; // 4096 codes times 256 pixel values, holding the code of each prefix + pixel value sequence
+};
+
+
+struct sprite_t {
+    int width;
+    int height;
+    int uniform; // the value of every stored pixel if they are all the same, otherwise -1
+    uint32_t* rows; // offset into data of the runs of each row, with one extra entry marking the end of the last row
+    uint8_t* data; // for each run: count of transparent pixels to skip, count of opaque pixels, then the opaque pixels
+};
+
+
+// Text laid out and rendered once, to be drawn again from the glyph masks while it stays in the cache
+struct internals_textcache_entry_t {
+    uint32_t hash;
+    char* text; // NULL for an unused entry
+    pixelfont_t const* font;
+    int bold;
+    int italic;
+    int align;
+    int wrap_width;
+    int left; // position of the mask relative to where the text is drawn
+    int top;
+    struct sprite_t* mask; // glyph values, NULL if the text has no visible pixels
+    struct sprite_t* outlined; // glyph values with the outline around them stored as 0, made on first use
+    bool rendered; // the mask is only made when the same text is drawn a second time
+    unsigned int used;
+};
+
+#define INTERNALS_TEXTCACHE_SETS 64
+#define INTERNALS_TEXTCACHE_WAYS 4
+
+
+// Polygon edge, clipped to the draw target and stepped from scanline to scanline
+struct internals_poly_edge_t {
+    int64_t x; // 16.16 fixed point x where the edge crosses the center of the current scanline
+    int64_t dx; // 16.16 fixed point change in x per scanline
+    int y0; // first scanline
+    int y1; // scanline after the last
+};
+
+
+// Polygon edges and the active edge table, kept between polygons, and grown as needed
+struct internals_poly_scratch_t {
+    struct internals_poly_edge_t* edges;
+    struct internals_poly_edge_t** active;
+    int capacity;
+};
+
+
+// Filled horizontal segment of scanline y for xl <= x <= xr, whose parent segment was on line y - dy
+struct internals_fill_segment_t { 
+    int y, xl, xr, dy; 
+};
+
+
+struct internals_draw_t {
+    uint8_t* buffer;
+    int width;
+    int height;
+    int pitch; // from the start of one row to the next
+};
+
+
+// What drawing needs besides the shared fonts and tables: the target, the color and text style, and scratch memory
+struct drawctx_t {
+    struct internals_draw_t draw;
+    int color;
+    int current_font;
+    int bold;
+    int italic;
+    int underline;
+    struct internals_fill_segment_t* fill_stack; // kept between fills, and grown as needed
+    int fill_capacity;
+    struct internals_poly_scratch_t poly;
+};
+
+
+enum draw_command_type_t {
+    DRAW_COMMAND_BLIT,
+    DRAW_COMMAND_MASKBLIT,
+    DRAW_COMMAND_BAR,
+    DRAW_COMMAND_POLY,
+    DRAW_COMMAND_SPRITE,
+    DRAW_COMMAND_TEXT,
+};
+
+
+// A recorded drawing command, clipped to the draw target. Points and text are stored in the data of the command list.
+struct draw_command_t {
+    enum draw_command_type_t type;
+    int top; // first row drawn to
+    int bottom; // row after the last
+    int x;
+    int y;
+    int color;
+    int key; // maskblit colorkey, or outline color of sprites and text
+    void const* source; // blit source, sprite or font
+    int width;
+    int height;
+    int pitch;
+    int srcx;
+    int srcy;
+    int srcw; // also the width of a bar, or the wrap width of text
+    int srch; // also the height of a bar, or the alignment of text
+    size_t data; // offset of the points or text
+    int count; // number of points, or the text style
+};
+
+
+#define INTERNALS_DRAW_THREADS_MAX 64
+#define INTERNALS_DRAW_BANDS_PER_THREAD 4
+
+// Commands touching a band of rows, as indices into the command list
+struct internals_draw_bin_t {
+    int* commands;
+    int count;
+    int capacity;
+};
+
+struct internals_draw_worker_t {
+    thread_ptr_t thread; // the first worker is the user thread, and has no thread of its own
+    thread_signal_t start;
+    struct internals_poly_scratch_t poly;
+};
+
+
+// Commands are recorded by the user thread, and drawn by flushdraw, which wakes the workers and waits for them to finish.
+// The workers each take the next band of rows not yet drawn, until all of them are done.
+struct internals_deferred_t {
+    int threads; // 0 when drawing immediately
+    struct draw_command_t* commands;
+    int count;
+    int capacity;
+    uint8_t* data;
+    size_t data_size;
+    size_t data_capacity;
+    int band_height;
+    int bands;
+    struct internals_draw_bin_t bins[ INTERNALS_DRAW_THREADS_MAX * INTERNALS_DRAW_BANDS_PER_THREAD ];
+    int top; // rows touched by the recorded commands
+    int bottom;
+    struct sprite_t** retired; // text cache masks replaced while commands still refer to them
+    int retired_count;
+    int retired_capacity;
+    struct internals_draw_worker_t workers[ INTERNALS_DRAW_THREADS_MAX ];
+    thread_atomic_int_t next_band;
+    thread_atomic_int_t busy; // workers still drawing
+    thread_atomic_int_t exit_flag;
+    thread_signal_t done;
+};
+
+
 struct internals_t {
     thread_mutex_t mutex;
     thread_atomic_int_t exit_flag;
@@ -381,6 +966,10 @@ struct internals_t {
     struct {
         thread_signal_t signal;
         thread_atomic_int_t count;
+        bool headless;
+        bool waited;
+        thread_signal_t wait_signal;
+        thread_atomic_int_t wait_count;
     } vbl;
 
     struct {
@@ -390,29 +979,59 @@ struct internals_t {
         uint32_t* font;
         int cellwidth;
         int cellheight;
+        int virtual_width; // the size of the buffer, which is at least the size of the screen
+        int virtual_height;
+        int view_x; // the top left of the displayed part of the buffer
+        int view_y;
         bool doublebuffer;
         uint8_t* buffer;
-        uint8_t buffer0[ 1024 * 1024 ];
-        uint8_t buffer1[ 1024 * 1024 ];
+        uint8_t* memory; // the buffers of the three frames and the dirty flags, sized for the current mode
+        size_t buffer_size;
+        uint8_t* retired; // the memory of a previous mode, freed by the present thread once it is done with it
+        struct internals_frame_t frames[ 3 ];
+        struct internals_frame_t* back; // the frame the user thread draws to when double buffering
+        struct internals_frame_t* front; // the frame being displayed, only touched by the present thread
+        thread_atomic_ptr_t latest; // the most recently completed frame, with the lowest bit set until it is displayed
         uint32_t palette[ 256 ];
+        int palette_stamp; // incremented on every palette change
+        int palette_steps; // incremented on every palette change made by the present thread
+        struct internals_palette_cycle_t cycles[ INTERNALS_PALETTE_CYCLES ];
+        int cycles_count;
+        uint32_t fade_from[ 256 ];
+        uint32_t fade_to[ 256 ];
+        int fade_frame; // a fade is in progress while below fade_frames
+        int fade_frames;
+        struct internals_raster_t raster;
+        uint8_t* dirty; // one flag per row (pixel rows in graphics modes, character rows in text modes)
+        int dirty_top; // the rows from dirty_top to dirty_bottom were marked since the last swapbuffers
+        int dirty_bottom;
+        bool raw_access;
+        bool explicit_dirty;
+        struct internals_overlay_t overlays[ INTERNALS_OVERLAY_LAYERS ];
     } screen;
 
+    struct drawctx_t drawctx; // used by threads which have not set a context of their own
+    thread_tls_t drawctx_tls;
+
+    struct internals_deferred_t deferred; // drawing commands recorded to be drawn in parallel
+
+    struct internals_stats_t stats; // guarded by the mutex, as both threads add samples
+
     struct {
-        uint8_t* buffer;
-        int width;
-        int height;
-    } draw;
+        thread_mutex_t mutex; // held while passing data to the capture, so it can't be stopped halfway through
+        struct internals_capture_t* current;
+    } capture;
     
     struct {
-        int color; 
-
         pixelfont_t* fonts[ 256 ];
         int fonts_count;
 
-        int current_font;
-        int bold;
-        int italic;
-        int underline;
+        struct internals_textcache_entry_t textcache[ INTERNALS_TEXTCACHE_SETS * INTERNALS_TEXTCACHE_WAYS ];
+        unsigned int textcache_tick;
+
+        uint8_t* shades; // 256 entries per level
+        int shade_levels;
+        uint8_t* blend; // 256 * 256 entries
     } graphics;
 
     struct {
@@ -425,12 +1044,14 @@ struct internals_t {
 
     struct {
         bool keystate[ KEYCOUNT ];
-        enum keycode_t* keybuffer;
-        enum keycode_t keybuffer0[ 256 ];
-        enum keycode_t keybuffer1[ 256 ];
-        char* charbuffer;
-        char charbuffer0[ 256 ];
-        char charbuffer1[ 256 ];
+        uint64_t start_us;
+        thread_atomic_int_t events_head; // total number of events written to the ring
+        struct inputevent_t events[ INTERNALS_EVENTS_COUNT ];
+        int events_read; // number of events read through readevents
+        int keys_read; // number of events read through readkeys
+        int chars_read; // number of events read through readchars
+        enum keycode_t keybuffer[ 256 ];
+        char charbuffer[ 256 ];
         int mouse_x;
         int mouse_y;
         int mouse_relx;
@@ -469,44 +1090,63 @@ struct internals_t {
         int swap_counts;
         int read_counts;
         WaCoro user_coro;
+        struct drawctx_t* drawctx; // there are no other threads, so no need for thread local storage
     } wasm;
     #endif
 
 }* internals;
 
 
+// Allocates memory starting on a 64 byte cache line, to be released with internals_free_aligned
+static void* internals_alloc_aligned( size_t size ) {
+    uint8_t* memory = (uint8_t*) malloc( size + 64 + sizeof( void* ) );
+    if( !memory ) {
+        return NULL;
+    }
+    uintptr_t aligned = ( (uintptr_t)( memory + sizeof( void* ) ) + 63 ) & ~(uintptr_t) 63;
+    ( (void**) aligned )[ -1 ] = memory;
+    return (void*) aligned;
+}
+
+
+static void internals_free_aligned( void* ptr ) {
+    if( ptr ) {
+        free( ( (void**) ptr )[ -1 ] );
+    }
+}
+
+
 static void internals_create( int sound_buffer_size ) {
     (void) sound_buffer_size;
     internals = (struct internals_t*) malloc( sizeof( struct internals_t ) );
     memset( internals, 0, sizeof( *internals ) );
 
     thread_mutex_init( &internals->mutex );
+    thread_mutex_init( &internals->capture.mutex );
 
     thread_signal_init( &internals->vbl.signal );
     thread_atomic_int_store( &internals->vbl.count, 0 );
+    thread_signal_init( &internals->vbl.wait_signal );
+    thread_atomic_int_store( &internals->vbl.wait_count, 0 );
+    thread_signal_init( &internals->deferred.done );
+    internals->drawctx_tls = thread_tls_create();
 
-    internals->screen.mode = videomode_80x25_9x16;
-    internals->screen.width = 80;
-    internals->screen.height = 25;
-    internals->screen.font = font9x16;
-    internals->screen.cellwidth = 9;
-    internals->screen.cellheight = 16;
-    internals->screen.buffer = internals->screen.buffer0;
-    memcpy( internals->screen.palette, default_palette, 1024 );
-
-    internals->draw.buffer = internals->screen.buffer;
-    internals->draw.width = internals->screen.width;
-    internals->draw.height = internals->screen.height;
+    for( int i = 0; i < 3; ++i ) {
+        memcpy( internals->screen.frames[ i ].palette, default_palette, 1024 );
+    }
+    internals->screen.back = &internals->screen.frames[ 0 ];
+    thread_atomic_ptr_store( &internals->screen.latest, &internals->screen.frames[ 1 ] );
+    internals->screen.front = &internals->screen.frames[ 2 ];
+    setvideomode( videomode_80x25_9x16 );
 
-    internals->graphics.color = 15;
+    internals->drawctx.color = 15;
     internals->graphics.fonts_count = 4;
-    internals->graphics.current_font = 1;
+    internals->drawctx.current_font = 1;
 
     internals->conio.fg = 7;
     internals->conio.curs = true;
 
-    internals->input.keybuffer = internals->input.keybuffer0;
-    internals->input.charbuffer = internals->input.charbuffer0;
+    internals->input.start_us = internals_time_us();
 
     internals->graphics.fonts[ DEFAULT_FONT_8X8 ] = internals_build_font( font8x8 );
     internals->graphics.fonts[ DEFAULT_FONT_8X16 ] = internals_build_font( font8x16 );
@@ -527,12 +1167,43 @@ static void internals_create( int sound_buffer_size ) {
 }
 
 
+static void internals_stop_draw_threads( void );
+
+
 static void internals_destroy( void ) {
+    stopcapture();
+    internals_stop_draw_threads();
+    struct internals_deferred_t* deferred = &internals->deferred;
+    free( deferred->commands );
+    free( deferred->data );
+    for( int i = 0; i < INTERNALS_DRAW_THREADS_MAX * INTERNALS_DRAW_BANDS_PER_THREAD; ++i ) {
+        free( deferred->bins[ i ].commands );
+    }
+    for( int i = 0; i < deferred->retired_count; ++i ) {
+        free( deferred->retired[ i ] );
+    }
+    free( deferred->retired );
+    for( int i = 0; i < INTERNALS_DRAW_THREADS_MAX; ++i ) {
+        free( deferred->workers[ i ].poly.edges );
+        free( deferred->workers[ i ].poly.active );
+    }
+    thread_signal_term( &deferred->done );
     for( int i = 1; i < internals->graphics.fonts_count; ++i ) {
         if( internals->graphics.fonts[ i ] ) {
             free( internals->graphics.fonts[ i ] );
         }
     }
+    free( internals->drawctx.fill_stack );
+    for( int i = 0; i < INTERNALS_TEXTCACHE_SETS * INTERNALS_TEXTCACHE_WAYS; ++i ) {
+        free( internals->graphics.textcache[ i ].text );
+        free( internals->graphics.textcache[ i ].mask );
+        free( internals->graphics.textcache[ i ].outlined );
+    }
+    free( internals->drawctx.poly.edges );
+    free( internals->drawctx.poly.active );
+    thread_tls_destroy( internals->drawctx_tls );
+    free( internals->graphics.shades );
+    free( internals->graphics.blend );
     for( int i = 1; i < internals->audio.soundbanks_count; ++i ) {
         if( internals->audio.soundbanks[ i ].data ) {
             free( internals->audio.soundbanks[ i ].data );
@@ -540,485 +1211,2836 @@ static void internals_destroy( void ) {
             tsf_close( internals->audio.soundbanks[ i ].sf2 );
         }
     }
+    thread_signal_term( &internals->vbl.wait_signal );
     thread_signal_term( &internals->vbl.signal );
+    internals_free_aligned( internals->screen.retired );
+    internals_free_aligned( internals->screen.memory );
+    for( int i = 0; i < INTERNALS_OVERLAY_LAYERS; ++i ) {
+        free( internals->screen.overlays[ i ].pixels );
+        free( internals->screen.overlays[ i ].shown );
+    }
+    thread_mutex_term( &internals->capture.mutex );
     thread_mutex_term( &internals->mutex );
     free( internals );
     internals = NULL;
 }
 
 
-int shuttingdown( void ) {
-
-    return thread_atomic_int_load( &internals->exit_flag );
+static bool internals_in_buffer( uint8_t const* pointer, uint8_t const* buffer, size_t size ) {
+    return buffer && (uintptr_t) pointer >= (uintptr_t) buffer && (uintptr_t) pointer < (uintptr_t) buffer + size;
 }
 
 
-void setvideomode( enum videomode_t mode ) {
-    thread_mutex_lock( &internals->mutex );
-    internals->screen.mode = mode;
-    memcpy( internals->screen.palette, default_palette, 1024 );
-    internals->conio.curs = true;
-    switch( mode ) {
-        case videomode_40x25_8x8:
-            internals->screen.width = 40;
-            internals->screen.height = 25;
-            internals->screen.font = font8x8;
-            internals->screen.cellwidth = 8;
-            internals->screen.cellheight = 8;
-            break;
-        case videomode_40x25_9x16:
-            internals->screen.width = 40;
-            internals->screen.height = 25;
-            internals->screen.font = font9x16;
-            internals->screen.cellwidth = 9;
-            internals->screen.cellheight = 16;
-            break;
-        case videomode_80x25_8x8:
-            internals->screen.width = 80;
-            internals->screen.height = 25;
-            internals->screen.font = font8x8;
-            internals->screen.cellwidth = 8;
-            internals->screen.cellheight = 8;
-            break;
-        case videomode_80x25_8x16:
-            internals->screen.width = 80;
-            internals->screen.height = 25;
-            internals->screen.font = font8x16;
-            internals->screen.cellwidth = 8;
-            internals->screen.cellheight = 16;
-            break;
-        case videomode_80x25_9x16:
-            internals->screen.width = 80;
-            internals->screen.height = 25;
-            internals->screen.font = font9x16;
-            internals->screen.cellwidth = 9;
-            internals->screen.cellheight = 16;
-            break;
-        case videomode_80x43_8x8:
-            internals->screen.width = 80;
-            internals->screen.height = 43;
-            internals->screen.font = font8x8;
-            internals->screen.cellwidth = 8;
-            internals->screen.cellheight = 8;
-            break;
-        case videomode_80x50_8x8:
-            internals->screen.width = 80;
-            internals->screen.height = 50;
-            internals->screen.font = font8x8;
-            internals->screen.cellwidth = 8;
-            internals->screen.cellheight = 8;
-            break;
-        case videomode_320x200:
-            internals->screen.width = 320;
-            internals->screen.height = 200;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        case videomode_320x240:
-            internals->screen.width = 320;
-            internals->screen.height = 240;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        case videomode_320x400:
-            internals->screen.width = 320;
-            internals->screen.height = 400;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        case videomode_640x200:
-            internals->screen.width = 640;
-            internals->screen.height = 200;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        case videomode_640x350:
-            internals->screen.width = 640;
-            internals->screen.height = 350;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        case videomode_640x400:
-            internals->screen.width = 640;
-            internals->screen.height = 400;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        case videomode_640x480:
-            internals->screen.width = 640;
-            internals->screen.height = 480;
-            internals->screen.font = NULL;
-            internals->screen.cellwidth = 1;
-            internals->screen.cellheight = 1;
-            break;
-        default: {
-            uint32_t custom_mode = (uint32_t)mode;
-            internals->screen.width = ( ( custom_mode & 0xffc00 ) >> 10 ) + 1;
-            internals->screen.height = ( custom_mode & 0x003ff ) + 1;
-            if( custom_mode & 0x100000 ) {
-                if( custom_mode & 0x200000 ) {
-                    internals->screen.font = font9x16;
-                    internals->screen.cellwidth = 9;
-                    internals->screen.cellheight = 16;
-                } else {
-                    internals->screen.font = font8x8;
-                    internals->screen.cellwidth = 8;
-                    internals->screen.cellheight = 8;
-                }
-            } else {
-                internals->screen.font = NULL;
-                internals->screen.cellwidth = 1;
-                internals->screen.cellheight = 1;
-            }
+static void internals_dirty( uint8_t const* buffer, int y, int h ) {
+    // A bitmap inside the screen starts some rows into one of the frames
+    uint8_t const* frame = NULL;
+    for( int i = 0; i < 3; ++i ) {
+        if( internals_in_buffer( buffer, internals->screen.frames[ i ].buffer, internals->screen.buffer_size ) ) {
+            frame = internals->screen.frames[ i ].buffer;
         }
-
     }
-    memset( internals->screen.buffer0, 0, internals->screen.width * internals->screen.height * ( internals->screen.font ? 2 : 1 ) );
-    memset( internals->screen.buffer1, 0, internals->screen.width * internals->screen.height * ( internals->screen.font ? 2 : 1 ) );
-    resetdrawtarget();
-    thread_mutex_unlock( &internals->mutex );
-};
+    if( !frame ) {
+        return;
+    }
+    y += (int)( (size_t)( buffer - frame ) / ( internals->screen.buffer_size / internals->screen.virtual_height ) );
+    if( y < 0 ) {
+        h += y;
+        y = 0;
+    }
+    if( y + h > internals->screen.virtual_height ) {
+        h = internals->screen.virtual_height - y;
+    }
+    if( h > 0 ) {
+        memset( internals->screen.dirty + y, 1, h );
+        internals->screen.dirty_top = y < internals->screen.dirty_top ? y : internals->screen.dirty_top;
+        internals->screen.dirty_bottom = y + h > internals->screen.dirty_bottom ? y + h : internals->screen.dirty_bottom;
+    }
+}
 
 
-int screenwidth( void ) {
-    return internals->screen.width;
+// The context set on the calling thread, or the default one if it has not set any
+static struct drawctx_t* internals_drawctx( void ) {
+    #ifdef __wasm__
+        struct drawctx_t* ctx = internals->wasm.drawctx;
+    #else
+        struct drawctx_t* ctx = (struct drawctx_t*) thread_tls_get( internals->drawctx_tls );
+    #endif
+    return ctx ? ctx : &internals->drawctx;
 }
 
 
-int screenheight( void ) {
+// There is only the one list of recorded commands, so drawing is only recorded with the default context, and only it
+// needs to draw them before drawing immediately
+static bool internals_deferring( struct drawctx_t const* ctx ) {
+    return internals->deferred.threads > 0 && ctx == &internals->drawctx;
+}
+
+
+
+static void internals_flush( void );
+
+
+static void internals_flushdraw( struct drawctx_t const* ctx ) {
+    if( ctx == &internals->drawctx ) {
+        internals_flush();
+    }
+}
+
+
+int shuttingdown( void ) {
+
+    return thread_atomic_int_load( &internals->exit_flag );
+}
+
+
+// Switches to a mode, with the screen buffers allocated to its size. The present thread might still be copying from the
+// old buffers, so instead of being freed here they are retired, and freed by the present thread when it next takes the
+// lock. If the present thread has not done so since the last mode change, it has never seen the current buffers, and
+// they can be freed right away.
+// Replaces the three frames and the dirty flags with ones for a buffer of the given size, all cleared, and points the 
+// screen and the draw target at it. If the size is unchanged the memory is kept, and so is the frame the present thread
+// is displaying, which is returned through kept so the caller can leave it alone as well. Called with the lock held.
+static bool internals_alloc_screen( int width, int height, int cell_size, struct internals_frame_t const** kept ) {
+    size_t buffer_size = (size_t) width * (size_t) height * (size_t) cell_size;
+    size_t stride = ( buffer_size + 63 ) & ~(size_t) 63;
+    uint8_t* memory = internals->screen.memory;
+    struct internals_frame_t const* front = internals->screen.doublebuffer ? internals->screen.front : NULL;
+    // The dirty flags follow the frames, so the same buffer size with a different height needs new memory too
+    if( !memory || buffer_size != internals->screen.buffer_size || height != internals->screen.virtual_height ) {
+        memory = (uint8_t*) internals_alloc_aligned( stride * 3 + (size_t) height );
+        if( !memory ) {
+            return false;
+        }
+        if( internals->screen.retired ) {
+            internals_free_aligned( internals->screen.memory );
+        } else {
+            internals->screen.retired = internals->screen.memory;
+        }
+        internals->screen.memory = memory;
+        internals->screen.buffer_size = buffer_size;
+        front = NULL;
+    }
+
+    // Keep drawing to the same one of the three frames, now all cleared and of the new size
+    int current = 0;
+    for( int i = 0; i < 3; ++i ) {
+        if( internals->screen.frames[ i ].buffer == internals->screen.buffer ) {
+            current = i;
+        }
+    }
+    for( int i = 0; i < 3; ++i ) {
+        struct internals_frame_t* frame = &internals->screen.frames[ i ];
+        if( frame == front ) {
+            continue;
+        }
+        frame->buffer = memory + stride * i;
+        frame->virtual_width = width;
+        frame->virtual_height = height;
+        frame->view_x = 0;
+        frame->view_y = 0;
+        memset( frame->buffer, 0, stride );
+    }
+    internals->screen.virtual_width = width;
+    internals->screen.virtual_height = height;
+    internals->screen.view_x = 0;
+    internals->screen.view_y = 0;
+    internals->screen.buffer = internals->screen.frames[ current ].buffer;
+    internals->screen.dirty = memory + stride * 3;
+    memset( internals->screen.dirty, 1, (size_t) height );
+    internals->screen.dirty_top = 0;
+    internals->screen.dirty_bottom = height;
+    internals->drawctx.draw.buffer = internals->screen.buffer;
+    internals->drawctx.draw.width = width;
+    internals->drawctx.draw.height = height;
+    internals->drawctx.draw.pitch = width;
+    if( kept ) {
+        *kept = front;
+    }
+    return true;
+}
+
+
+static bool internals_setmode( enum videomode_t mode, int width, int height, uint32_t* font, int cellwidth, 
+    int cellheight ) {
+
+    internals_flush();
+
+    thread_mutex_lock( &internals->mutex );
+    struct internals_frame_t const* kept = NULL;
+    if( !internals_alloc_screen( width, height, font ? 2 : 1, &kept ) ) {
+        thread_mutex_unlock( &internals->mutex );
+        return false;
+    }
+
+    internals->screen.mode = mode;
+    internals->screen.width = width;
+    internals->screen.height = height;
+    internals->screen.font = font;
+    internals->screen.cellwidth = cellwidth;
+    internals->screen.cellheight = cellheight;
+    memcpy( internals->screen.palette, default_palette, 1024 );
+    ++internals->screen.palette_stamp;
+    internals->screen.cycles_count = 0;
+    internals->screen.fade_frames = 0;
+    if( internals->screen.raster.changes_count > 0 || internals->screen.raster.scroll_lines > 0 ) {
+        internals->screen.raster.changes_count = 0;
+        internals->screen.raster.scroll_lines = 0;
+        ++internals->screen.raster.stamp;
+    }
+    internals->conio.curs = true;
+    for( int i = 0; i < 3; ++i ) {
+        struct internals_frame_t* frame = &internals->screen.frames[ i ];
+        if( frame == kept ) {
+            continue;
+        }
+        frame->width = width;
+        frame->height = height;
+        frame->font = font;
+    }
+    thread_mutex_unlock( &internals->mutex );
+    return true;
+}
+
+
+void setvideomode( enum videomode_t mode ) {
+    int width = 0;
+    int height = 0;
+    uint32_t* font = NULL;
+    int cellwidth = 1;
+    int cellheight = 1;
+    switch( mode ) {
+        case videomode_40x25_8x8:
+            width = 40;
+            height = 25;
+            font = font8x8;
+            cellwidth = 8;
+            cellheight = 8;
+            break;
+        case videomode_40x25_9x16:
+            width = 40;
+            height = 25;
+            font = font9x16;
+            cellwidth = 9;
+            cellheight = 16;
+            break;
+        case videomode_80x25_8x8:
+            width = 80;
+            height = 25;
+            font = font8x8;
+            cellwidth = 8;
+            cellheight = 8;
+            break;
+        case videomode_80x25_8x16:
+            width = 80;
+            height = 25;
+            font = font8x16;
+            cellwidth = 8;
+            cellheight = 16;
+            break;
+        case videomode_80x25_9x16:
+            width = 80;
+            height = 25;
+            font = font9x16;
+            cellwidth = 9;
+            cellheight = 16;
+            break;
+        case videomode_80x43_8x8:
+            width = 80;
+            height = 43;
+            font = font8x8;
+            cellwidth = 8;
+            cellheight = 8;
+            break;
+        case videomode_80x50_8x8:
+            width = 80;
+            height = 50;
+            font = font8x8;
+            cellwidth = 8;
+            cellheight = 8;
+            break;
+        case videomode_320x200:
+            width = 320;
+            height = 200;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        case videomode_320x240:
+            width = 320;
+            height = 240;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        case videomode_320x400:
+            width = 320;
+            height = 400;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        case videomode_640x200:
+            width = 640;
+            height = 200;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        case videomode_640x350:
+            width = 640;
+            height = 350;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        case videomode_640x400:
+            width = 640;
+            height = 400;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        case videomode_640x480:
+            width = 640;
+            height = 480;
+            font = NULL;
+            cellwidth = 1;
+            cellheight = 1;
+            break;
+        default: {
+            uint32_t custom_mode = (uint32_t)mode;
+            width = ( ( custom_mode & 0xffc00 ) >> 10 ) + 1;
+            height = ( custom_mode & 0x003ff ) + 1;
+            if( custom_mode & 0x100000 ) {
+                if( custom_mode & 0x200000 ) {
+                    font = font9x16;
+                    cellwidth = 9;
+                    cellheight = 16;
+                } else {
+                    font = font8x8;
+                    cellwidth = 8;
+                    cellheight = 8;
+                }
+            } else {
+                font = NULL;
+                cellwidth = 1;
+                cellheight = 1;
+            }
+        }
+
+    }
+    internals_setmode( mode, width, height, font, cellwidth, cellheight );
+}
+
+
+#define INTERNALS_CUSTOM_VIDEOMODE 0x400000
+
+int setcustomvideomode( int width, int height ) {
+    if( width < 1 || height < 1 || width > 4096 || height > 4096 ) {
+        return 0;
+    }
+    // Custom modes have a flag bit of their own, so they can't be mistaken for any of the named modes. Sizes which fit 
+    // are also encoded the way setvideomode decodes them.
+    uint32_t mode = INTERNALS_CUSTOM_VIDEOMODE;
+    if( width <= 1024 && height <= 1024 ) {
+        mode |= (uint32_t)( ( ( width - 1 ) << 10 ) | ( height - 1 ) );
+    }
+    return internals_setmode( (enum videomode_t) mode, width, height, NULL, 1, 1 ) ? 1 : 0;
+}
+
+
+int setvirtualsize( int width, int height ) {
+    if( width < internals->screen.width || height < internals->screen.height || width > 4096 || height > 4096 ) {
+        return 0;
+    }
+
+    internals_flush();
+    thread_mutex_lock( &internals->mutex );
+    bool result = internals_alloc_screen( width, height, internals->screen.font ? 2 : 1, NULL );
+    thread_mutex_unlock( &internals->mutex );
+    return result ? 1 : 0;
+}
+
+
+void setviewport( int x, int y ) {
+    int width = internals->screen.virtual_width;
+    int height = internals->screen.virtual_height;
+    thread_mutex_lock( &internals->mutex );
+    internals->screen.view_x = ( ( x % width ) + width ) % width;
+    internals->screen.view_y = ( ( y % height ) + height ) % height;
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+int screenwidth( void ) {
+    return internals->screen.width;
+}
+
+
+int screenheight( void ) {
     return internals->screen.height;
 }
 
 
-unsigned char* screenbuffer( void ) {
-    return internals->screen.buffer;
+unsigned char* screenbuffer( void ) {
+    internals_flush();
+    // Until the program starts calling markdirty for its own writes, we can't know which rows it changes through the 
+    // returned pointer, so all rows will be checked for changes
+    internals->screen.raw_access = true;
+    return internals->screen.buffer;
+}
+
+
+void markdirty( int x, int y, int w, int h ) {
+    (void) x, (void) w;
+    internals->screen.explicit_dirty = true;
+    internals_dirty( internals->screen.buffer, y, h );
+}
+
+
+void setdoublebuffer( int enabled ) {
+    internals->screen.doublebuffer = ( enabled != 0 );
+}
+
+
+// Only the parts of the tables in use are copied
+static void internals_copy_raster( struct internals_raster_t* dst, struct internals_raster_t const* src ) {
+    dst->stamp = src->stamp;
+    dst->changes_count = src->changes_count;
+    memcpy( dst->changes, src->changes, src->changes_count * sizeof( struct internals_raster_change_t ) );
+    dst->scroll_lines = src->scroll_lines;
+    memcpy( dst->scroll, src->scroll, src->scroll_lines * sizeof( int ) );
+}
+
+
+unsigned char* swapbuffers( void ) {
+    internals_flush();
+    #ifdef __wasm__
+    if (internals->wasm.swap_counts++ > 2) {
+        // In WebAssembly without real threads, if a dos-like application never calls waitvbl
+        // by itself, we force a call to it every few calls to swapbuffer
+        waitvbl();
+    }
+    #endif
+    if( internals->vbl.headless ) {
+        // In headless mode, frames are only pumped when the user thread waits for them, so a program which never calls
+        // waitvbl by itself gets one forced on every swap
+        if( !internals->vbl.waited ) {
+            waitvbl();
+        }
+        internals->vbl.waited = false;
+    }
+    if( internals->screen.doublebuffer ) {
+        // Publish the completed frame together with the mode and palette it was drawn with, and continue drawing to
+        // whichever frame the present thread is not displaying. Neither thread ever waits for the other.
+        struct internals_frame_t* back = internals->screen.back;
+        back->width = internals->screen.width;
+        back->height = internals->screen.height;
+        back->font = internals->screen.font;
+        back->virtual_width = internals->screen.virtual_width;
+        back->virtual_height = internals->screen.virtual_height;
+        thread_mutex_lock( &internals->mutex );
+        back->view_x = internals->screen.view_x;
+        back->view_y = internals->screen.view_y;
+        memcpy( back->palette, internals->screen.palette, 1024 );
+        back->palette_stamp = internals->screen.palette_stamp;
+        back->palette_steps = internals->screen.palette_steps;
+        thread_mutex_unlock( &internals->mutex );
+        if( back->raster.stamp != internals->screen.raster.stamp ) {
+            internals_copy_raster( &back->raster, &internals->screen.raster );
+        }
+        uintptr_t prev = (uintptr_t) thread_atomic_ptr_swap( &internals->screen.latest, (void*)( (uintptr_t) back | 1 ) );
+        back = (struct internals_frame_t*)( prev & ~(uintptr_t) 1 );
+        internals->screen.back = back;
+        uint8_t* front = internals->screen.buffer;
+        if( internals_in_buffer( internals->drawctx.draw.buffer, front, internals->screen.buffer_size ) ) {
+            internals->drawctx.draw.buffer = back->buffer + ( internals->drawctx.draw.buffer - front );
+        }
+        internals->screen.buffer = back->buffer;
+
+        // The present thread checks every row of a frame it has not displayed before, so the rows marked while drawing
+        // the frame just handed off don't need checking against the one being displayed until then
+        int top = internals->screen.dirty_top;
+        int bottom = internals->screen.dirty_bottom;
+        if( bottom > top ) {
+            memset( internals->screen.dirty + top, 0, (size_t)( bottom - top ) );
+        }
+        internals->screen.dirty_top = internals->screen.virtual_height;
+        internals->screen.dirty_bottom = 0;
+    }
+    return internals->screen.buffer;
+}
+
+
+static uint32_t internals_rgb( int r, int g, int b ) {
+    r = ( r & 63 ) << 2;
+    g = ( g & 63 ) << 2;
+    b = ( b & 63 ) << 2;
+    return (uint32_t)( ( b << 16 ) | ( g << 8 ) | ( r ) );
+}
+
+
+void setpal( int index, int r, int g, int b ) {
+    if( index < 0 || index >= 256 ) {
+        return;
+    }
+
+    thread_mutex_lock( &internals->mutex );
+    internals->screen.palette[ index ] = internals_rgb( r, g, b );
+    internals->screen.fade_frames = 0;
+    ++internals->screen.palette_stamp;
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void setpalette( int first, int count, unsigned char const* rgb ) {
+    if( !rgb ) {
+        return;
+    }
+    if( first < 0 ) {
+        rgb += -first * 3;
+        count += first;
+        first = 0;
+    }
+    if( count > 256 - first ) {
+        count = 256 - first;
+    }
+    if( count <= 0 ) {
+        return;
+    }
+
+    // All entries are changed under the lock, so the present thread never shows a palette which is only half updated
+    thread_mutex_lock( &internals->mutex );
+    for( int i = 0; i < count; ++i ) {
+        internals->screen.palette[ first + i ] = internals_rgb( rgb[ i * 3 + 0 ], rgb[ i * 3 + 1 ], rgb[ i * 3 + 2 ] );
+    }
+    internals->screen.fade_frames = 0;
+    ++internals->screen.palette_stamp;
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void palettecycle( int first, int count, int speed ) {
+    if( first < 0 ) {
+        count += first;
+        first = 0;
+    }
+    if( count > 256 - first ) {
+        count = 256 - first;
+    }
+
+    thread_mutex_lock( &internals->mutex );
+    struct internals_palette_cycle_t* cycles = internals->screen.cycles;
+    int index = 0;
+    while( index < internals->screen.cycles_count && ( cycles[ index ].first != first || cycles[ index ].count != count ) ) {
+        ++index;
+    }
+    if( speed == 0 || count < 2 ) {
+        if( index < internals->screen.cycles_count ) {
+            --internals->screen.cycles_count;
+            memmove( cycles + index, cycles + index + 1, 
+                ( internals->screen.cycles_count - index ) * sizeof( struct internals_palette_cycle_t ) );
+        }
+    } else if( index < INTERNALS_PALETTE_CYCLES ) {
+        if( index == internals->screen.cycles_count ) {
+            ++internals->screen.cycles_count;
+            cycles[ index ].phase = 0;
+        }
+        cycles[ index ].first = first;
+        cycles[ index ].count = count;
+        cycles[ index ].speed = speed;
+    }
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void palettefade( unsigned char const* target, int frames ) {
+    thread_mutex_lock( &internals->mutex );
+    for( int i = 0; i < 256; ++i ) {
+        internals->screen.fade_to[ i ] = target ? internals_rgb( target[ i * 3 + 0 ], target[ i * 3 + 1 ], 
+            target[ i * 3 + 2 ] ) : 0;
+    }
+    if( frames > 0 ) {
+        memcpy( internals->screen.fade_from, internals->screen.palette, 1024 );
+        internals->screen.fade_frame = 0;
+        internals->screen.fade_frames = frames;
+    } else {
+        memcpy( internals->screen.palette, internals->screen.fade_to, 1024 );
+        internals->screen.fade_frames = 0;
+        ++internals->screen.palette_stamp;
+    }
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+// Called by the present thread on every vblank, with the lock held
+static void internals_animate_palette( void ) {
+    bool changed = false;
+    bool fading = internals->screen.fade_frame < internals->screen.fade_frames;
+    for( int i = 0; i < internals->screen.cycles_count; ++i ) {
+        struct internals_palette_cycle_t* cycle = &internals->screen.cycles[ i ];
+        cycle->phase += cycle->speed;
+        int steps = cycle->phase / 60;
+        cycle->phase -= steps * 60;
+        steps = ( ( steps % cycle->count ) + cycle->count ) % cycle->count;
+        if( steps == 0 ) {
+            continue;
+        }
+
+        // Entry first + n takes the color of entry first + n + steps, wrapping around within the range. The start and
+        // target of a fade are rotated along with it, so the cycle carries on through the fade.
+        uint32_t* ranges[ 3 ] = { internals->screen.palette, internals->screen.fade_from, internals->screen.fade_to };
+        for( int j = 0; j < ( fading ? 3 : 1 ); ++j ) {
+            uint32_t* entries = ranges[ j ] + cycle->first;
+            uint32_t rotated[ 256 ];
+            memcpy( rotated, entries + steps, ( cycle->count - steps ) * sizeof( uint32_t ) );
+            memcpy( rotated + cycle->count - steps, entries, steps * sizeof( uint32_t ) );
+            memcpy( entries, rotated, cycle->count * sizeof( uint32_t ) );
+        }
+        changed = true;
+    }
+
+    if( fading ) {
+        int frame = ++internals->screen.fade_frame;
+        int frames = internals->screen.fade_frames;
+        for( int i = 0; i < 256; ++i ) {
+            uint32_t from = internals->screen.fade_from[ i ];
+            uint32_t to = internals->screen.fade_to[ i ];
+            uint32_t c = 0;
+            for( int shift = 0; shift < 24; shift += 8 ) {
+                int a = (int)( ( from >> shift ) & 0xff );
+                int b = (int)( ( to >> shift ) & 0xff );
+                c |= (uint32_t)( a + ( b - a ) * frame / frames ) << shift;
+            }
+            internals->screen.palette[ i ] = c;
+        }
+        changed = true;
+    }
+
+    if( changed ) {
+        ++internals->screen.palette_stamp;
+        ++internals->screen.palette_steps;
+    }
+}
+
+
+void setrasterpal( int line, int index, int r, int g, int b ) {
+    if( line < 0 || line >= INTERNALS_RASTER_LINES || index < 0 || index >= 256 ) {
+        return;
+    }
+
+    uint32_t color = internals_rgb( r, g, b );
+    thread_mutex_lock( &internals->mutex );
+    struct internals_raster_t* raster = &internals->screen.raster;
+    struct internals_raster_change_t* changes = raster->changes;
+    int key = line * 256 + index;
+    int lo = 0;
+    int hi = raster->changes_count;
+    while( lo < hi ) {
+        int mid = ( lo + hi ) / 2;
+        if( changes[ mid ].line * 256 + changes[ mid ].index < key ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if( lo < raster->changes_count && changes[ lo ].line == line && changes[ lo ].index == index ) {
+        if( changes[ lo ].color != color ) {
+            changes[ lo ].color = color;
+            ++raster->stamp;
+        }
+    } else if( raster->changes_count < INTERNALS_RASTER_CHANGES ) {
+        memmove( changes + lo + 1, changes + lo, 
+            ( raster->changes_count - lo ) * sizeof( struct internals_raster_change_t ) );
+        changes[ lo ].line = (uint16_t) line;
+        changes[ lo ].index = (uint8_t) index;
+        changes[ lo ].color = color;
+        ++raster->changes_count;
+        ++raster->stamp;
+    }
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void setrasterscroll( int line, int dx ) {
+    if( line < 0 || line >= INTERNALS_RASTER_LINES ) {
+        return;
+    }
+
+    thread_mutex_lock( &internals->mutex );
+    struct internals_raster_t* raster = &internals->screen.raster;
+    if( line >= raster->scroll_lines ) {
+        if( dx != 0 ) {
+            memset( raster->scroll + raster->scroll_lines, 0, ( line - raster->scroll_lines ) * sizeof( int ) );
+            raster->scroll[ line ] = dx;
+            raster->scroll_lines = line + 1;
+            ++raster->stamp;
+        }
+    } else if( raster->scroll[ line ] != dx ) {
+        raster->scroll[ line ] = dx;
+        ++raster->stamp;
+    }
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void clearraster( void ) {
+    thread_mutex_lock( &internals->mutex );
+    struct internals_raster_t* raster = &internals->screen.raster;
+    if( raster->changes_count > 0 || raster->scroll_lines > 0 ) {
+        raster->changes_count = 0;
+        raster->scroll_lines = 0;
+        ++raster->stamp;
+    }
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void getpal( int index, int* r, int* g, int* b ) {
+    if( index < 0 || index >= 256 ) {
+        return;
+    }
+
+    thread_mutex_lock( &internals->mutex );
+    uint32_t c = internals->screen.palette[ index ];
+    thread_mutex_unlock( &internals->mutex );
+    uint32_t cr = ( c ) & 0xff;
+    uint32_t cg = ( c >> 8 ) & 0xff;
+    uint32_t cb = ( c >> 16 ) & 0xff;
+    if( r ) {
+        *r = cr >> 2;
+    }
+    if( g ) {
+        *g = cg >> 2;
+    }
+    if( b ) {
+        *b = cb >> 2;
+    }   
+}
+
+
+int getpixel( int x, int y ) {
+    if( internals->screen.font ) return 0;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    if( x >= 0 && y >= 0 && x < ctx->draw.width && y < ctx->draw.height ) {
+        return ctx->draw.buffer[ x + ctx->draw.pitch * y ];
+    } else {
+        return 0;
+    }
+}
+
+
+void putpixel( int x, int y, int color ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    if( x >= 0 && y >= 0 && x < ctx->draw.width && y < ctx->draw.height ) {
+        ctx->draw.buffer[ x + ctx->draw.pitch * y ] = (uint8_t)color;
+        internals_dirty( ctx->draw.buffer, y, 1 );
+    }
+}
+
+
+void setdrawtarget( unsigned char* pixels, int width, int height ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    ctx->draw.buffer = pixels;
+    ctx->draw.width = width;
+    ctx->draw.height = height;
+    ctx->draw.pitch = width;
+}
+
+
+void resetdrawtarget( void ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    ctx->draw.buffer = internals->screen.buffer;
+    ctx->draw.width = internals->screen.virtual_width;
+    ctx->draw.height = internals->screen.virtual_height;
+    ctx->draw.pitch = internals->screen.virtual_width;
+}
+
+
+struct bitmap_t subbitmap( struct bitmap_t bitmap, int x, int y, int width, int height ) {
+    if( x < 0 ) {
+        width += x;
+        x = 0;
+    }
+    if( y < 0 ) {
+        height += y;
+        y = 0;
+    }
+    if( width > bitmap.width - x ) {
+        width = bitmap.width - x;
+    }
+    if( height > bitmap.height - y ) {
+        height = bitmap.height - y;
+    }
+    struct bitmap_t sub;
+    sub.pitch = bitmap.pitch;
+    if( !bitmap.pixels || width <= 0 || height <= 0 ) {
+        sub.pixels = NULL;
+        sub.width = 0;
+        sub.height = 0;
+        return sub;
+    }
+    sub.pixels = bitmap.pixels + x + y * bitmap.pitch;
+    sub.width = width;
+    sub.height = height;
+    return sub;
+}
+
+
+struct bitmap_t screenbitmap( void ) {
+    struct bitmap_t bitmap;
+    bitmap.pixels = internals->screen.font ? NULL : screenbuffer();
+    bitmap.width = bitmap.pixels ? internals->screen.virtual_width : 0;
+    bitmap.height = bitmap.pixels ? internals->screen.virtual_height : 0;
+    bitmap.pitch = internals->screen.virtual_width;
+    return bitmap;
+}
+
+
+void setdrawbitmap( struct bitmap_t bitmap ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    ctx->draw.buffer = bitmap.pixels;
+    ctx->draw.width = bitmap.pixels ? bitmap.width : 0;
+    ctx->draw.height = bitmap.pixels ? bitmap.height : 0;
+    ctx->draw.pitch = bitmap.pitch;
+}
+
+
+unsigned char* setoverlay( int layer, int x, int y, int width, int height, int colorkey ) {
+    struct drawctx_t* ctx = internals_drawctx();
+    if( layer < 0 || layer >= INTERNALS_OVERLAY_LAYERS || width < 1 || height < 1 || width > 4096 || height > 4096 ) {
+        return NULL;
+    }
+
+    internals_flush();
+    struct internals_overlay_t* overlay = &internals->screen.overlays[ layer ];
+    if( !overlay->pixels || width != overlay->width || height != overlay->height ) {
+        size_t size = (size_t) width * (size_t) height;
+        if( !overlay->pixels || width * height != overlay->width * overlay->height ) {
+            uint8_t* pixels = (uint8_t*) malloc( size );
+            uint8_t* shown = (uint8_t*) malloc( size );
+            if( !pixels || !shown ) {
+                free( pixels );
+                free( shown );
+                return NULL;
+            }
+            if( internals_in_buffer( ctx->draw.buffer, overlay->pixels, 
+                (size_t) overlay->width * (size_t) overlay->height ) ) {
+                resetdrawtarget();
+            }
+            thread_mutex_lock( &internals->mutex );
+            free( overlay->pixels );
+            free( overlay->shown );
+            overlay->pixels = pixels;
+            overlay->shown = shown;
+            thread_mutex_unlock( &internals->mutex );
+        }
+        memset( overlay->pixels, colorkey, size );
+    }
+
+    thread_mutex_lock( &internals->mutex );
+    overlay->x = x;
+    overlay->y = y;
+    overlay->width = width;
+    overlay->height = height;
+    overlay->colorkey = colorkey;
+    memcpy( overlay->shown, overlay->pixels, (size_t) width * (size_t) height );
+    overlay->visible = true;
+    ++overlay->stamp;
+    thread_mutex_unlock( &internals->mutex );
+    return overlay->pixels;
+}
+
+
+void updateoverlay( int layer ) {
+    if( layer < 0 || layer >= INTERNALS_OVERLAY_LAYERS || !internals->screen.overlays[ layer ].pixels ) {
+        return;
+    }
+
+    internals_flush();
+    struct internals_overlay_t* overlay = &internals->screen.overlays[ layer ];
+    thread_mutex_lock( &internals->mutex );
+    memcpy( overlay->shown, overlay->pixels, (size_t) overlay->width * (size_t) overlay->height );
+    ++overlay->stamp;
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void moveoverlay( int layer, int x, int y ) {
+    if( layer < 0 || layer >= INTERNALS_OVERLAY_LAYERS || !internals->screen.overlays[ layer ].pixels ) {
+        return;
+    }
+
+    struct internals_overlay_t* overlay = &internals->screen.overlays[ layer ];
+    thread_mutex_lock( &internals->mutex );
+    if( x != overlay->x || y != overlay->y ) {
+        overlay->x = x;
+        overlay->y = y;
+        ++overlay->stamp;
+    }
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+void removeoverlay( int layer ) {
+    struct drawctx_t* ctx = internals_drawctx();
+    if( layer < 0 || layer >= INTERNALS_OVERLAY_LAYERS || !internals->screen.overlays[ layer ].pixels ) {
+        return;
+    }
+
+    internals_flush();
+    struct internals_overlay_t* overlay = &internals->screen.overlays[ layer ];
+    if( internals_in_buffer( ctx->draw.buffer, overlay->pixels, 
+        (size_t) overlay->width * (size_t) overlay->height ) ) {
+        resetdrawtarget();
+    }
+    thread_mutex_lock( &internals->mutex );
+    free( overlay->pixels );
+    free( overlay->shown );
+    overlay->pixels = NULL;
+    overlay->shown = NULL;
+    overlay->visible = false;
+    ++overlay->stamp;
+    thread_mutex_unlock( &internals->mutex );
+}
+
+
+// Adds a command drawing to rows top to bottom - 1 of the draw target to the list, and to the bins of the bands it 
+// touches. Returns NULL if there was no memory for it, and the caller should flush the list and draw immediately.
+static struct draw_command_t* internals_defer( enum draw_command_type_t type, int top, int bottom ) {
+    struct internals_deferred_t* deferred = &internals->deferred;
+    int height = internals->drawctx.draw.height;
+    if( deferred->count == 0 ) {
+        // a few bands per thread, so the threads stay busy when the drawing is uneven over the rows
+        int bands = deferred->threads * INTERNALS_DRAW_BANDS_PER_THREAD;
+        deferred->band_height = ( height + bands - 1 ) / bands;
+        deferred->band_height = deferred->band_height < 16 ? 16 : deferred->band_height;
+        deferred->bands = ( height + deferred->band_height - 1 ) / deferred->band_height;
+        deferred->top = height;
+        deferred->bottom = 0;
+    }
+    top = top < 0 ? 0 : top;
+    bottom = bottom > height ? height : bottom;
+    if( deferred->count >= deferred->capacity ) {
+        int capacity = deferred->capacity ? deferred->capacity * 2 : 256;
+        struct draw_command_t* commands = (struct draw_command_t*) realloc( deferred->commands, 
+            capacity * sizeof( struct draw_command_t ) );
+        if( !commands ) return NULL;
+        deferred->commands = commands;
+        deferred->capacity = capacity;
+    }
+    int first = top / deferred->band_height;
+    int last = ( bottom - 1 ) / deferred->band_height;
+    for( int i = first; i <= last; ++i ) {
+        struct internals_draw_bin_t* bin = &deferred->bins[ i ];
+        if( bin->count >= bin->capacity ) {
+            int capacity = bin->capacity ? bin->capacity * 2 : 256;
+            int* commands = (int*) realloc( bin->commands, capacity * sizeof( int ) );
+            if( !commands ) return NULL;
+            bin->commands = commands;
+            bin->capacity = capacity;
+        }
+    }
+    for( int i = first; i <= last; ++i ) {
+        struct internals_draw_bin_t* bin = &deferred->bins[ i ];
+        bin->commands[ bin->count++ ] = deferred->count;
+    }
+    deferred->top = top < deferred->top ? top : deferred->top;
+    deferred->bottom = bottom > deferred->bottom ? bottom : deferred->bottom;
+    struct draw_command_t* command = &deferred->commands[ deferred->count++ ];
+    memset( command, 0, sizeof( *command ) );
+    command->type = type;
+    command->top = top;
+    command->bottom = bottom;
+    return command;
+}
+
+
+// Copies points or text into the data of the command list, and gives its offset
+static bool internals_defer_data( void const* data, size_t size, size_t* offset ) {
+    struct internals_deferred_t* deferred = &internals->deferred;
+    deferred->data_size = ( deferred->data_size + 7 ) & ~(size_t) 7; // keep points aligned after text
+    if( deferred->data_size + size > deferred->data_capacity ) {
+        size_t capacity = deferred->data_capacity ? deferred->data_capacity * 2 : 4096;
+        while( capacity < deferred->data_size + size ) {
+            capacity *= 2;
+        }
+        uint8_t* grown = (uint8_t*) realloc( deferred->data, capacity );
+        if( !grown ) return false;
+        deferred->data = grown;
+        deferred->data_capacity = capacity;
+    }
+    memcpy( deferred->data + deferred->data_size, data, size );
+    *offset = deferred->data_size;
+    deferred->data_size += size;
+    return true;
+}
+
+
+void setcolor( int color ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    if( color >= 0 && color <= 255 ) {
+        ctx->color = color; 
+    }
+}
+
+
+int getcolor( void ) {
+    if( internals->screen.font ) return 0;
+    struct drawctx_t* ctx = internals_drawctx();
+    return ctx->color;
+}
+
+
+int installuserfont( char const* filename ) {
+    if( internals->graphics.fonts_count >= sizeof( internals->graphics.fonts ) / sizeof( *internals->graphics.fonts ) ) {
+        return 0;
+    }
+    FILE* fp = fopen( filename, "rb" );
+    if( !fp ) return 0;
+    fseek( fp, 0, SEEK_END );
+    size_t sz = ftell( fp );
+    fseek( fp, 0, SEEK_SET );
+    uint8_t* data = (uint8_t*) malloc( sz );
+    fread( data, 1, sz, fp );
+    fclose( fp );
+    
+    internals->graphics.fonts[ internals->graphics.fonts_count ] = (pixelfont_t*) data;
+
+    return internals->graphics.fonts_count++;
+}
+
+
+void settextstyle( int font, int bold, int italic, int underline ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    if( font >= 1 && font < internals->graphics.fonts_count ) {
+        ctx->current_font = font;
+        ctx->bold = bold;
+        ctx->italic = italic;
+        ctx->underline = underline;
+    }
+}
+
+static struct sprite_t* internals_makesprite( uint8_t const* pixels, uint8_t const* opaque, int stride, int width, 
+    int height, int colorkey );
+static void internals_drawsprite( struct internals_draw_t const* draw, int x, int y, struct sprite_t const* sprite, 
+    int color, int outline );
+
+
+// Frees a sprite, or keeps it until the recorded commands have been drawn if it might be used by them
+static void internals_retire( struct sprite_t* sprite ) {
+    struct internals_deferred_t* deferred = &internals->deferred;
+    if( !sprite ) return;
+    if( deferred->count > 0 ) {
+        if( deferred->retired_count >= deferred->retired_capacity ) {
+            int capacity = deferred->retired_capacity ? deferred->retired_capacity * 2 : 64;
+            struct sprite_t** retired = (struct sprite_t**) realloc( deferred->retired, 
+                capacity * sizeof( struct sprite_t* ) );
+            if( !retired ) {
+                internals_flush();
+                free( sprite );
+                return;
+            }
+            deferred->retired = retired;
+            deferred->retired_capacity = capacity;
+        }
+        deferred->retired[ deferred->retired_count++ ] = sprite;
+    } else {
+        free( sprite );
+    }
+}
+
+
+// Draws a sprite, with glyph values translated as by internals_drawsprite, or records it when drawing is deferred
+static void internals_sprite( struct drawctx_t const* ctx, int x, int y, struct sprite_t const* sprite, int color, 
+    int outline ) {
+
+    if( internals_deferring( ctx ) ) {
+        if( y + sprite->height <= 0 || y >= ctx->draw.height ) return;
+        struct draw_command_t* command = internals_defer( DRAW_COMMAND_SPRITE, y, y + sprite->height );
+        if( command ) {
+            command->x = x;
+            command->y = y;
+            command->color = color;
+            command->key = outline;
+            command->source = sprite;
+            return;
+        }
+        internals_flush();
+    }
+    internals_drawsprite( &ctx->draw, x, y, sprite, color, outline );
+}
+
+
+// Renders text into a mask of glyph values, by drawing it with color 1 into a buffer with enough margin around it that
+// nothing is clipped, and stores it in the entry cropped to its visible pixels
+static bool internals_textmask( struct internals_textcache_entry_t* entry, char const* text ) {
+    pixelfont_bold_t bold = entry->bold ? PIXELFONT_BOLD_ON : PIXELFONT_BOLD_OFF;
+    pixelfont_italic_t italic = entry->italic ? PIXELFONT_ITALIC_ON : PIXELFONT_ITALIC_OFF;
+    pixelfont_bounds_t bounds;
+    pixelfont_blit( entry->font, 0, 0, text, 1, NULL, 0, 0, (pixelfont_align_t) entry->align, entry->wrap_width, 0, 0, 
+        -1, bold, italic, PIXELFONT_UNDERLINE_OFF, &bounds );
+    // glyphs can reach a little outside the bounds, and lines can extend to either side of the position by up to the 
+    // width of the longest line without wrapping, as words longer than the wrap width are not broken
+    pixelfont_bounds_t unwrapped;
+    pixelfont_blit( entry->font, 0, 0, text, 1, NULL, 0, 0, PIXELFONT_ALIGN_LEFT, 0, 0, 0, -1, bold, italic, 
+        PIXELFONT_UNDERLINE_OFF, &unwrapped );
+    int margin = entry->font->height + 8 + unwrapped.width;
+    for( ; ; ) {
+        int width = bounds.width + margin * 2;
+        int height = bounds.height + entry->font->height + margin * 2;
+        uint8_t* pixels = (uint8_t*) calloc( (size_t) width * height, 1 );
+        if( !pixels ) return false;
+        pixelfont_blit( entry->font, margin, margin, text, 1, pixels, width, height, 
+            (pixelfont_align_t) entry->align, entry->wrap_width, 0, 0, -1, bold, italic, PIXELFONT_UNDERLINE_OFF, NULL );
+        int minx = width;
+        int miny = height;
+        int maxx = -1;
+        int maxy = -1;
+        for( int y = 0; y < height; ++y ) {
+            for( int x = 0; x < width; ++x ) {
+                if( pixels[ x + y * width ] ) {
+                    minx = x < minx ? x : minx;
+                    maxx = x > maxx ? x : maxx;
+                    miny = y < miny ? y : miny;
+                    maxy = y;
+                }
+            }
+        }
+        if( maxx >= 0 && ( minx == 0 || miny == 0 || maxx == width - 1 || maxy == height - 1 ) ) {
+            // touched the edge, so it might have been clipped
+            free( pixels );
+            margin *= 2;
+            continue;
+        }
+        if( maxx >= 0 ) {
+            entry->left = minx - margin;
+            entry->top = miny - margin;
+            entry->mask = internals_makesprite( pixels + minx + miny * width, NULL, width, maxx - minx + 1, 
+                maxy - miny + 1, 0 );
+        }
+        free( pixels );
+        return maxx < 0 || entry->mask;
+    }
+}
+
+
+// Builds the outlined version of a mask, one pixel larger on each side, where every transparent pixel next to a glyph
+// pixel becomes an outline pixel
+static struct sprite_t* internals_textoutline( struct sprite_t const* mask ) {
+    int width = mask->width + 2;
+    int height = mask->height + 2;
+    uint8_t* pixels = (uint8_t*) calloc( (size_t) width * height, 2 );
+    if( !pixels ) return NULL;
+    uint8_t* opaque = pixels + width * height;
+    for( int y = 0; y < mask->height; ++y ) {
+        uint8_t const* run = mask->data + mask->rows[ y ];
+        uint8_t const* end = mask->data + mask->rows[ y + 1 ];
+        int x = 0;
+        while( run < end ) {
+            x += run[ 0 ];
+            for( int i = 0; i < run[ 1 ]; ++i, ++x ) {
+                pixels[ ( x + 1 ) + ( y + 1 ) * width ] = run[ 2 + i ];
+                for( int oy = 0; oy < 3; ++oy ) {
+                    memset( opaque + x + ( y + oy ) * width, 1, 3 );
+                }
+            }
+            run += 2 + run[ 1 ];
+        }
+    }
+    struct sprite_t* outlined = internals_makesprite( pixels, opaque, width, width, height, 0 );
+    free( pixels );
+    return outlined;
+}
+
+
+// Finds the laid out text in the cache. Text seen for the first time is only added to the cache, replacing the least 
+// recently used entry, and NULL is returned so it is drawn directly. If it is drawn again its mask is rendered, so text 
+// which changes every frame doesn't pay for rendering masks that will never be reused.
+static struct internals_textcache_entry_t* internals_textlayout( struct drawctx_t const* ctx, char const* text, 
+    int wrap_width, pixelfont_align_t align ) {
+
+    pixelfont_t const* font = internals->graphics.fonts[ ctx->current_font ];
+    int bold = ctx->bold ? 1 : 0;
+    int italic = ctx->italic ? 1 : 0;
+    wrap_width = wrap_width > 0 ? wrap_width : 0;
+    uint32_t hash = 2166136261u;
+    for( char const* c = text; *c; ++c ) {
+        hash = ( hash ^ (uint8_t) *c ) * 16777619u;
+    }
+    uint32_t params[] = { (uint32_t)(uintptr_t) font, (uint32_t) ( bold | italic << 1 | align << 2 ), (uint32_t) wrap_width };
+    for( int i = 0; i < 3; ++i ) {
+        hash = ( hash ^ params[ i ] ) * 16777619u;
+    }
+
+    unsigned int tick = ++internals->graphics.textcache_tick;
+    struct internals_textcache_entry_t* set = internals->graphics.textcache + ( hash % INTERNALS_TEXTCACHE_SETS ) * 
+        INTERNALS_TEXTCACHE_WAYS;
+    struct internals_textcache_entry_t* oldest = set;
+    for( int i = 0; i < INTERNALS_TEXTCACHE_WAYS; ++i ) {
+        struct internals_textcache_entry_t* entry = &set[ i ];
+        if( entry->text && entry->hash == hash && entry->font == font && entry->bold == bold && 
+            entry->italic == italic && entry->align == (int) align && entry->wrap_width == wrap_width && 
+            strcmp( entry->text, text ) == 0 ) {
+
+            entry->used = tick;
+            if( !entry->rendered ) {
+                entry->rendered = true;
+                if( !internals_textmask( entry, text ) ) {
+                    free( entry->text );
+                    entry->text = NULL;
+                    return NULL;
+                }
+            }
+            return entry;
+        }
+        if( !entry->text || ( oldest->text && tick - entry->used > tick - oldest->used ) ) {
+            oldest = entry;
+        }
+    }
+
+    struct internals_textcache_entry_t* entry = oldest;
+    free( entry->text );
+    internals_retire( entry->mask );
+    internals_retire( entry->outlined );
+    memset( entry, 0, sizeof( *entry ) );
+    size_t length = strlen( text );
+    entry->text = (char*) malloc( length + 1 );
+    if( !entry->text ) return NULL;
+    memcpy( entry->text, text, length + 1 );
+    entry->hash = hash;
+    entry->font = font;
+    entry->bold = bold;
+    entry->italic = italic;
+    entry->align = (int) align;
+    entry->wrap_width = wrap_width;
+    entry->used = tick;
+    return NULL;
+}
+
+
+// Draws text with pixelfont, with an outline unless outline is -1. The target is clipped as if it spanned the rows from
+// top to bottom, for drawing a band of rows of a larger one.
+static void internals_textblit( struct internals_draw_t const* draw, int top, int bottom, pixelfont_t const* font, 
+    int x, int y, char const* text, int color, int outline, pixelfont_align_t align, int wrap_width, int bold, 
+    int italic, int underline ) {
+
+    PIXELFONT_COLOR* target = draw->buffer;
+    int width = draw->width;
+    int height = draw->height;
+    int pitch = draw->pitch;
+    int hspacing = 0;
+	int vspacing = 0;
+    int limit = -1;
+    pixelfont_bold_t font_bold = bold ? PIXELFONT_BOLD_ON : PIXELFONT_BOLD_OFF;
+    pixelfont_italic_t font_italic = italic ? PIXELFONT_ITALIC_ON : PIXELFONT_ITALIC_OFF;
+    pixelfont_underline_t font_underline = underline ? PIXELFONT_UNDERLINE_ON : PIXELFONT_UNDERLINE_OFF;
+
+    pixelfont_bounds_t bounds;
+    if( outline >= 0 ) {
+        for( int oy = -1; oy <= 1; ++oy ) {
+            for( int ox = -1; ox <= 1; ++ox ) {
+                if( ox == 0 && oy == 0 ) continue;
+                internals_pixelfont_blit( font, x + ox, y + oy, text, (PIXELFONT_COLOR)outline, target, width, height, 
+                    pitch, top, bottom, align, wrap_width, hspacing, vspacing, limit, font_bold, font_italic, 
+                    font_underline, &bounds );
+            }
+        }
+        internals_dirty( target, y - 1, bounds.height + font->height + 2 );
+    }
+    internals_pixelfont_blit( font, x, y, text, (PIXELFONT_COLOR)color, target, width, height, pitch, top, bottom, 
+        align, wrap_width, hspacing, vspacing, limit, font_bold, font_italic, font_underline, &bounds );
+    internals_dirty( target, y, bounds.height + font->height );
+}
+
+
+// Draws text from the layout cache, with an outline unless outline is -1. Underlined text is drawn directly, as the 
+// underline length depends on which pixels were clipped, and so is text drawn with other contexts than the default, as
+// the cache is shared. So is bold text reaching past the left edge, where pixelfont leaves out the bold pixels of 
+// clipped ones.
+static void internals_text( int x, int y, char const* text, int wrap_width, pixelfont_align_t align, int outline ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    int color = ctx->color;
+    pixelfont_t* font = internals->graphics.fonts[ ctx->current_font ];
+    struct internals_textcache_entry_t* entry = NULL;
+    if( !ctx->underline && ctx == &internals->drawctx ) {
+        entry = internals_textlayout( ctx, text, wrap_width, align );
+    }
+    if( entry && ctx->bold && x + entry->left - ( outline >= 0 ? 1 : 0 ) < 0 ) {
+        entry = NULL;
+    }
+    if( entry ) {
+        if( outline >= 0 && entry->mask && !entry->outlined ) {
+            entry->outlined = internals_textoutline( entry->mask );
+        }
+        if( outline >= 0 && entry->outlined ) {
+            internals_sprite( ctx, x + entry->left - 1, y + entry->top - 1, entry->outlined, color, outline );
+            return;
+        } else if( outline < 0 ) {
+            if( entry->mask ) {
+                internals_sprite( ctx, x + entry->left, y + entry->top, entry->mask, color, 0 );
+            }
+            return;
+        }
+    }
+
+    int bold = ctx->bold ? 1 : 0;
+    int italic = ctx->italic ? 1 : 0;
+    int underline = ctx->underline ? 1 : 0;
+    if( internals_deferring( ctx ) ) {
+        pixelfont_bounds_t bounds;
+        pixelfont_blit( font, x, y, text, 0, NULL, 0, 0, align, wrap_width, 0, 0, -1, 
+            bold ? PIXELFONT_BOLD_ON : PIXELFONT_BOLD_OFF, italic ? PIXELFONT_ITALIC_ON : PIXELFONT_ITALIC_OFF, 
+            underline ? PIXELFONT_UNDERLINE_ON : PIXELFONT_UNDERLINE_OFF, &bounds );
+        int top = y - 1;
+        int bottom = y + bounds.height + font->height + 1;
+        if( bottom <= 0 || top >= ctx->draw.height ) return;
+        size_t data;
+        struct draw_command_t* command = NULL;
+        if( internals_defer_data( text, strlen( text ) + 1, &data ) ) {
+            command = internals_defer( DRAW_COMMAND_TEXT, top, bottom );
+        }
+        if( command ) {
+            command->x = x;
+            command->y = y;
+            command->color = color;
+            command->key = outline;
+            command->source = font;
+            command->srcw = wrap_width;
+            command->srch = (int) align;
+            command->data = data;
+            command->count = bold | ( italic << 1 ) | ( underline << 2 );
+            return;
+        }
+        internals_flush();
+    }
+    internals_textblit( &ctx->draw, 0, ctx->draw.height, font, x, y, text, color, outline, align, wrap_width, bold, italic, underline );
+}
+
+
+void wraptextxy( int x, int y, char const* text, int wrap_width ) {
+    internals_text( x, y, text, wrap_width, PIXELFONT_ALIGN_LEFT, -1 );
+}
+
+
+void centertextxy( int x, int y, char const* text, int wrap_width ) {
+    internals_text( x, y, text, wrap_width, PIXELFONT_ALIGN_CENTER, -1 );
+}
+
+
+void outtextxy( int x, int y, char const* text ) {
+    internals_text( x, y, text, 0, PIXELFONT_ALIGN_LEFT, -1 );
+}
+
+
+void outlinetextxy( int x, int y, char const* text, int outlinecolor, int width, int centered ) {
+    internals_text( x, y, text, width, centered ? PIXELFONT_ALIGN_CENTER : PIXELFONT_ALIGN_LEFT, (uint8_t) outlinecolor );
+}
+
+
+void waitvbl( void ) {
+    internals_flush();
+    if( thread_atomic_int_load( &internals->exit_flag ) == 0 ) {
+        uint64_t start_us = internals_time_us();
+        #ifndef __wasm__
+        int current_vbl_count = thread_atomic_int_load( &internals->vbl.count );
+        thread_atomic_int_inc( &internals->vbl.wait_count );
+        if( internals->vbl.headless ) {
+            internals->vbl.waited = true;
+            thread_signal_raise( &internals->vbl.wait_signal );
+        }
+        while( current_vbl_count == thread_atomic_int_load( &internals->vbl.count ) ) {
+            thread_signal_wait( &internals->vbl.signal, 1000 );
+        }
+        #else
+        WaCoroSwitch(0);
+        internals->wasm.swap_counts = internals->wasm.read_counts = 0;
+        #endif
+        uint64_t end_us = internals_time_us();
+
+        thread_mutex_lock( &internals->mutex );
+        if( internals->stats.wait_end_us ) {
+            int index = internals->stats.user_index;
+            internals->stats.user[ index ] = ( start_us - internals->stats.wait_end_us ) / 1000.0f;
+            internals->stats.wait[ index ] = ( end_us - start_us ) / 1000.0f;
+            internals->stats.user_index = ( index + 1 ) % INTERNALS_FRAMESTATS_COUNT;
+            if( internals->stats.user_count < INTERNALS_FRAMESTATS_COUNT ) {
+                ++internals->stats.user_count;
+            }
+        }
+        internals->stats.wait_end_us = end_us;
+        thread_mutex_unlock( &internals->mutex );
+    }
+}
+
+
+static int internals_compare_float( void const* a, void const* b ) {
+    float fa = *(float const*) a;
+    float fb = *(float const*) b;
+    return ( fa > fb ) - ( fa < fb );
+}
+
+
+static struct frametime_t internals_frametime( float const* samples, int count ) {
+    struct frametime_t result = { 0.0f, 0.0f, 0.0f };
+    if( count <= 0 ) {
+        return result;
+    }
+    float sorted[ INTERNALS_FRAMESTATS_COUNT ];
+    memcpy( sorted, samples, count * sizeof( float ) );
+    qsort( sorted, (size_t) count, sizeof( float ), internals_compare_float );
+    float total = 0.0f;
+    for( int i = 0; i < count; ++i ) {
+        total += sorted[ i ];
+    }
+    result.min = sorted[ 0 ];
+    result.avg = total / count;
+    result.p99 = sorted[ ( count * 99 + 99 ) / 100 - 1 ];
+    return result;
+}
+
+
+static struct framestats_t internals_framestats( struct internals_stats_t const* samples ) {
+    struct framestats_t stats;
+    stats.frames = samples->present_count;
+    stats.missedvbls = 0;
+    for( int i = 0; i < samples->present_count; ++i ) {
+        stats.missedvbls += samples->missed[ i ];
+    }
+    stats.user = internals_frametime( samples->user, samples->user_count );
+    stats.wait = internals_frametime( samples->wait, samples->user_count );
+    stats.copy = internals_frametime( samples->copy, samples->present_count );
+    stats.expand = internals_frametime( samples->expand, samples->present_count );
+    stats.present = internals_frametime( samples->present, samples->present_count );
+    return stats;
+}
+
+
+struct framestats_t getframestats( void ) {
+    thread_mutex_lock( &internals->mutex );
+    struct framestats_t stats = internals_framestats( &internals->stats );
+    thread_mutex_unlock( &internals->mutex );
+    return stats;
+}
+
+
+// Writes GIF image data: LZW codes of variable bit length, packed into sub-blocks of up to 255 bytes
+struct internals_gif_bits_t {
+    FILE* file;
+    uint32_t bits;
+    int count;
+    int block_size;
+    uint8_t block[ 256 ];
+};
+
+
+static void internals_gif_flush( struct internals_gif_bits_t* out ) {
+    if( out->block_size > 0 ) {
+        fputc( out->block_size, out->file );
+        fwrite( out->block, 1, (size_t) out->block_size, out->file );
+        out->block_size = 0;
+    }
+}
+
+
+static void internals_gif_code( struct internals_gif_bits_t* out, uint32_t code, int size ) {
+    out->bits |= code << out->count;
+    out->count += size;
+    while( out->count >= 8 ) {
+        out->block[ out->block_size++ ] = (uint8_t)( out->bits & 0xff );
+        out->bits >>= 8;
+        out->count -= 8;
+        if( out->block_size == 255 ) {
+            internals_gif_flush( out );
+        }
+    }
+}
+
+
+static void internals_gif_u16( FILE* file, int value ) {
+    fputc( value & 0xff, file );
+    fputc( ( value >> 8 ) & 0xff, file );
+}
+
+
+static void internals_gif_palette( FILE* file, uint32_t const* palette ) {
+    uint8_t rgb[ 256 * 3 ];
+    for( int i = 0; i < 256; ++i ) {
+        rgb[ i * 3 + 0 ] = (uint8_t)( palette[ i ] & 0xff );
+        rgb[ i * 3 + 1 ] = (uint8_t)( ( palette[ i ] >> 8 ) & 0xff );
+        rgb[ i * 3 + 2 ] = (uint8_t)( ( palette[ i ] >> 16 ) & 0xff );
+    }
+    fwrite( rgb, 1, sizeof( rgb ), file );
+}
+
+
+// Writes the rectangle of the pending image which differs from what is already shown, to be displayed for `delay` 
+// hundredths of a second. The whole image is written for the first frame, and if the palette changed, as the unchanged
+// pixels would otherwise keep their old colors.
+static void internals_gif_frame( struct internals_capture_t* capture, int delay ) {
+    int width = capture->gif_width;
+    int height = capture->gif_height;
+    bool palette_changed = memcmp( capture->shown_palette, capture->pending_palette, 1024 ) != 0;
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = width - 1;
+    int y1 = height - 1;
+    if( capture->frames_written > 0 && !palette_changed ) {
+        while( y0 <= y1 && memcmp( capture->shown + y0 * width, capture->pending + y0 * width, (size_t) width ) == 0 ) {
+            ++y0;
+        }
+        while( y1 > y0 && memcmp( capture->shown + y1 * width, capture->pending + y1 * width, (size_t) width ) == 0 ) {
+            --y1;
+        }
+        if( y0 > y1 ) {
+            // Nothing changed, but the frame is still needed for its duration
+            x1 = 0;
+            y0 = 0;
+            y1 = 0;
+        } else {
+            x0 = width;
+            x1 = 0;
+            for( int y = y0; y <= y1; ++y ) {
+                uint8_t const* a = capture->shown + y * width;
+                uint8_t const* b = capture->pending + y * width;
+                int l = 0;
+                while( l < x0 && a[ l ] == b[ l ] ) {
+                    ++l;
+                }
+                if( l < x0 ) {
+                    x0 = l;
+                }
+                int r = width - 1;
+                while( r > x1 && a[ r ] == b[ r ] ) {
+                    --r;
+                }
+                if( r > x1 ) {
+                    x1 = r;
+                }
+            }
+        }
+    }
+
+    FILE* file = capture->gif;
+    if( delay > 0xffff ) {
+        delay = 0xffff;
+    }
+    uint8_t const control[] = { 0x21, 0xf9, 0x04, 0x04 /* do not dispose */ };
+    fwrite( control, 1, sizeof( control ), file );
+    internals_gif_u16( file, delay );
+    fputc( 0, file ); // transparent color index
+    fputc( 0, file );
+
+    fputc( 0x2c, file );
+    internals_gif_u16( file, x0 );
+    internals_gif_u16( file, y0 );
+    internals_gif_u16( file, x1 - x0 + 1 );
+    internals_gif_u16( file, y1 - y0 + 1 );
+    bool local_palette = memcmp( capture->pending_palette, capture->gif_palette, 1024 ) != 0;
+    fputc( local_palette ? 0x87 : 0x00, file );
+    if( local_palette ) {
+        internals_gif_palette( file, capture->pending_palette );
+    }
+
+    // LZW compress the rectangle. Each code is a node in a tree of pixel sequences, where the children of a code are
+    // found at lzw[ code * 256 + pixel ]. Zero means no child, as no code below 258 is ever added.
+    uint32_t const clear_code = 256;
+    int const min_code_size = 8;
+    fputc( min_code_size, file );
+    struct internals_gif_bits_t out;
+    out.file = file;
+    out.bits = 0;
+    out.count = 0;
+    out.block_size = 0;
+    int code_size = min_code_size + 1;
+    uint32_t max_code = clear_code + 1;
+    memset( capture->lzw, 0, 4096 * 256 * sizeof( uint16_t ) );
+    internals_gif_code( &out, clear_code, code_size );
+    int current = -1;
+    for( int y = y0; y <= y1; ++y ) {
+        uint8_t const* row = capture->pending + y * width;
+        for( int x = x0; x <= x1; ++x ) {
+            int pixel = row[ x ];
+            if( current < 0 ) {
+                current = pixel;
+            } else if( capture->lzw[ current * 256 + pixel ] ) {
+                current = capture->lzw[ current * 256 + pixel ];
+            } else {
+                internals_gif_code( &out, (uint32_t) current, code_size );
+                capture->lzw[ current * 256 + pixel ] = (uint16_t) ++max_code;
+                if( max_code >= ( 1u << code_size ) ) {
+                    ++code_size;
+                }
+                if( max_code == 4095 ) {
+                    internals_gif_code( &out, clear_code, code_size );
+                    memset( capture->lzw, 0, 4096 * 256 * sizeof( uint16_t ) );
+                    code_size = min_code_size + 1;
+                    max_code = clear_code + 1;
+                }
+                current = pixel;
+            }
+        }
+    }
+    internals_gif_code( &out, (uint32_t) current, code_size );
+    internals_gif_code( &out, clear_code, code_size );
+    internals_gif_code( &out, clear_code + 1, min_code_size + 1 );
+    while( out.count > 0 ) {
+        internals_gif_code( &out, 0, 8 - out.count );
+    }
+    internals_gif_flush( &out );
+    fputc( 0, file );
+
+    uint8_t* shown = capture->shown;
+    capture->shown = capture->pending;
+    capture->pending = shown;
+    memcpy( capture->shown_palette, capture->pending_palette, 1024 );
+    ++capture->frames_written;
+}
+
+
+// Renders a captured frame to 8-bit pixels the size of the GIF, drawing text modes the same way as the present thread
+static void internals_capture_render( struct internals_capture_t* capture, struct internals_capture_frame_t const* frame, 
+    uint8_t* image ) {
+
+    int width = capture->gif_width;
+    int height = capture->gif_height;
+    if( !frame->font ) {
+        int w = frame->width < width ? frame->width : width;
+        int h = frame->height < height ? frame->height : height;
+        if( w < width || h < height ) {
+            memset( image, 0, (size_t)( width * height ) );
+        }
+        for( int y = 0; y < h; ++y ) {
+            memcpy( image + y * width, frame->pixels + y * frame->width, (size_t) w );
+        }
+        return;
+    }
+
+    uint32_t const* font = frame->font;
+    if( font != capture->glyphs_font ) {
+        internals_build_glyphs( capture->glyphs, font );
+        capture->glyphs_font = font;
+    }
+    int chr_width = (int) font[ 0 ];
+    int chr_height = (int) font[ 1 ];
+    memset( image, 0, (size_t)( width * height ) );
+    for( int y = 0; y < frame->height && ( y + 1 ) * chr_height <= height; ++y ) {
+        for( int x = 0; x < frame->width && ( x + 1 ) * chr_width <= width; ++x ) {
+            int i = ( x + y * frame->width ) * 2;
+            uint8_t attr = frame->pixels[ i + 1 ];
+            uint8_t colors[ 2 ] = { (uint8_t)( ( attr >> 4 ) & 0xf ), (uint8_t)( attr & 0xf ) };
+            uint8_t const* glyph = capture->glyphs + frame->pixels[ i ] * chr_width * chr_height;
+            uint8_t* out = image + x * chr_width + y * chr_height * width;
+            for( int iy = 0; iy < chr_height; ++iy ) {
+                for( int ix = 0; ix < chr_width; ++ix ) {
+                    out[ ix ] = colors[ glyph[ ix ] ];
+                }
+                glyph += chr_width;
+                out += width;
+            }
+        }
+    }
+    if( frame->curs_y >= 0 ) {
+        int xp = frame->curs_x * chr_width;
+        int yp = frame->curs_y * chr_height;
+        int cs = chr_height == 16 ? 13 : 7;
+        int ce = chr_height == 16 ? 15 : 9;
+        for( int y = cs; y < ce && y + yp < height; ++y ) {
+            for( int x = 0; x < chr_width && x + xp < width; ++x ) {
+                image[ ( x + xp ) + ( y + yp ) * width ] = 7;
+            }
+        }
+    }
+}
+
+
+// A frame is only written once the next different one arrives, as that is when its duration is known. Frames arriving
+// less than two hundredths of a second apart replace the pending one instead, as many GIF viewers slow down shorter
+// delays.
+static void internals_capture_add_frame( struct internals_capture_t* capture, 
+    struct internals_capture_frame_t const* frame ) {
+
+    int time = frame->number * 5 / 3;
+    capture->last_time = time;
+    if( !capture->shown ) {
+        int width = capture->gif_width;
+        int height = capture->gif_height;
+        capture->shown = (uint8_t*) malloc( (size_t)( width * height ) );
+        capture->pending = (uint8_t*) malloc( (size_t)( width * height ) );
+        capture->next = (uint8_t*) malloc( (size_t)( width * height ) );
+        memcpy( capture->gif_palette, frame->palette, 1024 );
+
+        FILE* file = capture->gif;
+        fwrite( "GIF89a", 1, 6, file );
+        internals_gif_u16( file, width );
+        internals_gif_u16( file, height );
+        fputc( 0xf7, file ); // 256 entry global palette
+        fputc( 0, file );
+        fputc( 0, file );
+        internals_gif_palette( file, frame->palette );
+        uint8_t const loop[] = { 0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1, 0, 0, 0 };
+        fwrite( loop, 1, sizeof( loop ), file );
+    }
+
+    internals_capture_render( capture, frame, capture->next );
+    if( capture->has_pending ) {
+        int size = capture->gif_width * capture->gif_height;
+        if( memcmp( capture->next, capture->pending, (size_t) size ) == 0 
+            && memcmp( frame->palette, capture->pending_palette, 1024 ) == 0 ) {
+            return;
+        }
+        if( time - capture->pending_time >= 2 ) {
+            internals_gif_frame( capture, time - capture->pending_time );
+            capture->pending_time = time;
+        }
+    } else {
+        capture->pending_time = time;
+        capture->has_pending = true;
+    }
+    uint8_t* pending = capture->pending;
+    capture->pending = capture->next;
+    capture->next = pending;
+    memcpy( capture->pending_palette, frame->palette, 1024 );
+}
+
+
+static int internals_capture_proc( void* user_data ) {
+    struct internals_capture_t* capture = (struct internals_capture_t*) user_data;
+    for( ; ; ) {
+        // The exit flag is read before emptying the queues, so nothing passed in before the stop is lost
+        int exiting = thread_atomic_int_load( &capture->exit_flag );
+        while( thread_queue_count( &capture->chunks ) > 0 ) {
+            struct internals_capture_chunk_t* chunk = (struct internals_capture_chunk_t*) 
+                thread_queue_consume( &capture->chunks );
+            drwav_write_pcm_frames( &capture->wav, (drwav_uint64) chunk->count, chunk->samples );
+            thread_queue_produce( &capture->free_chunks, chunk );
+        }
+        while( thread_queue_count( &capture->frames ) > 0 ) {
+            struct internals_capture_frame_t* frame = (struct internals_capture_frame_t*) 
+                thread_queue_consume( &capture->frames );
+            if( frame->pixels ) {
+                internals_capture_add_frame( capture, frame );
+            }
+            thread_queue_produce( &capture->free_frames, frame );
+        }
+        if( exiting ) {
+            break;
+        }
+        // Polled rather than woken by the producers, as waking this thread from the present thread could let it run
+        // in the middle of the present thread's frame on a single core
+        thread_signal_wait( &capture->wake, 10 );
+    }
+
+    if( capture->gif ) {
+        if( capture->has_pending ) {
+            int delay = capture->last_time + 2 - capture->pending_time;
+            internals_gif_frame( capture, delay > 2 ? delay : 2 );
+        }
+        fputc( 0x3b, capture->gif );
+        fclose( capture->gif );
+    }
+    if( capture->wav_open ) {
+        drwav_uninit( &capture->wav );
+    }
+    return 0;
+}
+
+
+int startcapture( char const* gif_filename, char const* wav_filename ) {
+    stopcapture();
+    #ifdef __wasm__
+        (void) gif_filename, (void) wav_filename;
+        return 0;
+    #else
+        struct internals_capture_t* capture = (struct internals_capture_t*) malloc( sizeof( struct internals_capture_t ) );
+        memset( capture, 0, sizeof( *capture ) );
+        // The size of the GIF is that of the current video mode, frames of a different size are cropped or padded
+        capture->gif_width = internals->screen.width * internals->screen.cellwidth;
+        capture->gif_height = internals->screen.height * internals->screen.cellheight;
+        if( gif_filename ) {
+            capture->gif = fopen( gif_filename, "wb" );
+            capture->lzw = (uint16_t*) malloc( 4096 * 256 * sizeof( uint16_t ) );
+            if( !capture->gif || !capture->lzw ) {
+                if( capture->gif ) {
+                    fclose( capture->gif );
+                }
+                free( capture->lzw );
+                free( capture );
+                return 0;
+            }
+        }
+        if( wav_filename ) {
+            drwav_data_format format;
+            format.container = drwav_container_riff;
+            format.format = DR_WAVE_FORMAT_PCM;
+            format.channels = 2;
+            format.sampleRate = 44100;
+            format.bitsPerSample = 16;
+            capture->wav_open = drwav_init_file_write( &capture->wav, wav_filename, &format, NULL ) != DRWAV_FALSE;
+            if( !capture->wav_open ) {
+                if( capture->gif ) {
+                    fclose( capture->gif );
+                }
+                free( capture->lzw );
+                free( capture );
+                return 0;
+            }
+        }
+
+        for( int i = 0; i < INTERNALS_CAPTURE_FRAMES; ++i ) {
+            capture->free_frames_values[ i ] = &capture->frame_slots[ i ];
+        }
+        for( int i = 0; i < INTERNALS_CAPTURE_CHUNKS; ++i ) {
+            capture->free_chunks_values[ i ] = &capture->chunk_slots[ i ];
+        }
+        thread_queue_init( &capture->frames, INTERNALS_CAPTURE_FRAMES, capture->frames_values, 0 );
+        thread_queue_init( &capture->free_frames, INTERNALS_CAPTURE_FRAMES, capture->free_frames_values, 
+            INTERNALS_CAPTURE_FRAMES );
+        thread_queue_init( &capture->chunks, INTERNALS_CAPTURE_CHUNKS, capture->chunks_values, 0 );
+        thread_queue_init( &capture->free_chunks, INTERNALS_CAPTURE_CHUNKS, capture->free_chunks_values, 
+            INTERNALS_CAPTURE_CHUNKS );
+        thread_signal_init( &capture->wake );
+        thread_atomic_int_store( &capture->exit_flag, 0 );
+        capture->thread = thread_create( internals_capture_proc, capture, THREAD_STACK_SIZE_DEFAULT );
+
+        thread_mutex_lock( &internals->capture.mutex );
+        internals->capture.current = capture;
+        thread_mutex_unlock( &internals->capture.mutex );
+        return 1;
+    #endif
+}
+
+
+void stopcapture( void ) {
+    thread_mutex_lock( &internals->capture.mutex );
+    struct internals_capture_t* capture = internals->capture.current;
+    internals->capture.current = NULL;
+    thread_mutex_unlock( &internals->capture.mutex );
+    if( !capture ) {
+        return;
+    }
+
+    thread_atomic_int_store( &capture->exit_flag, 1 );
+    thread_signal_raise( &capture->wake );
+    thread_join( capture->thread );
+    thread_destroy( capture->thread );
+    thread_signal_term( &capture->wake );
+    thread_queue_term( &capture->frames );
+    thread_queue_term( &capture->free_frames );
+    thread_queue_term( &capture->chunks );
+    thread_queue_term( &capture->free_chunks );
+    free( capture->shown );
+    free( capture->pending );
+    free( capture->next );
+    for( int i = 0; i < INTERNALS_CAPTURE_FRAMES; ++i ) {
+        free( capture->frame_slots[ i ].pixels );
+    }
+    free( capture->lzw );
+    free( capture );
+}
+
+
+// Called by the present thread with each displayed frame (in character cells for text modes). Only copies the frame,
+// and only if there is a free slot for it.
+static void internals_capture_frame( uint8_t const* screen, int width, int height, uint32_t const* font, 
+    uint32_t const* palette, int curs_x, int curs_y ) {
+
+    thread_mutex_lock( &internals->capture.mutex );
+    struct internals_capture_t* capture = internals->capture.current;
+    if( capture && capture->gif ) {
+        int number = capture->frame_number++;
+        if( thread_queue_count( &capture->free_frames ) > 0 ) {
+            struct internals_capture_frame_t* frame = (struct internals_capture_frame_t*) 
+                thread_queue_consume( &capture->free_frames );
+            size_t size = (size_t) width * (size_t) height * ( font ? 2 : 1 );
+            if( size > frame->capacity ) {
+                free( frame->pixels );
+                frame->pixels = (uint8_t*) malloc( size );
+                frame->capacity = frame->pixels ? size : 0;
+            }
+            frame->number = number;
+            frame->width = width;
+            frame->height = height;
+            frame->font = font;
+            frame->curs_x = curs_x;
+            frame->curs_y = curs_y;
+            memcpy( frame->palette, palette, 1024 );
+            if( frame->pixels ) {
+                memcpy( frame->pixels, screen, size );
+            }
+            thread_queue_produce( &capture->frames, frame );
+        } else {
+            ++capture->dropped_frames;
+        }
+    }
+    thread_mutex_unlock( &internals->capture.mutex );
+}
+
+
+// Called with the final mix of the sound output
+static void internals_capture_audio( APP_S16 const* sample_pairs, int sample_pairs_count ) {
+    thread_mutex_lock( &internals->capture.mutex );
+    struct internals_capture_t* capture = internals->capture.current;
+    if( capture && capture->wav_open ) {
+        while( sample_pairs_count > 0 ) {
+            if( thread_queue_count( &capture->free_chunks ) == 0 ) {
+                ++capture->dropped_chunks;
+                break;
+            }
+            struct internals_capture_chunk_t* chunk = (struct internals_capture_chunk_t*) 
+                thread_queue_consume( &capture->free_chunks );
+            int count = sample_pairs_count < INTERNALS_CAPTURE_CHUNK_SIZE ? 
+                sample_pairs_count : INTERNALS_CAPTURE_CHUNK_SIZE;
+            memcpy( chunk->samples, sample_pairs, count * 2 * sizeof( APP_S16 ) );
+            chunk->count = count;
+            thread_queue_produce( &capture->chunks, chunk );
+            sample_pairs += count * 2;
+            sample_pairs_count -= count;
+        }
+    }
+    thread_mutex_unlock( &internals->capture.mutex );
+}
+
+
+static void signalvbl( void ) {
+    thread_atomic_int_inc( &internals->vbl.count );
+    thread_signal_raise( &internals->vbl.signal );
+    #ifdef __wasm__
+    WaCoroSwitch(internals->wasm.user_coro);
+    #endif
+}
+
+
+void clearscreen( void ) {
+    internals_flush();
+    memset( internals->screen.buffer, 0, internals->screen.virtual_width * internals->screen.virtual_height * 
+        ( internals->screen.font ? 2 : 1 ) );
+    internals_dirty( internals->screen.buffer, 0, internals->screen.virtual_height );
+}
+
+
+static bool blitclip( struct internals_draw_t const* draw, int* px, int *py, int width, int height, int* psrcx, 
+    int* psrcy, int* psrcw, int* psrch ) {
+
+    int x = *px;
+    int y = *py;
+    int srcx = *psrcx;
+    int srcy = *psrcy;
+    int srcw = *psrcw;
+    int srch = *psrch;
+    if( x < 0 ) {
+        srcx -= x;
+        srcw += x;
+        x = 0;
+    }
+    if( y < 0 ) {
+        srcy -= y;
+        srch += y;
+        y = 0;
+    }
+    if( srcx < 0 ) {
+        x -= srcx;
+        srcw += srcx;
+        srcx = 0;
+    }
+    if( srcy < 0 ) {
+        y -= srcy;
+        srch += srcy;
+        srcy = 0;
+    }
+    if( srcx + srcw >= width ) {
+        srcw += ( width - ( srcx + srcw ) );
+    }
+    if( srcy + srch >= height ) {
+        srch += ( height - ( srcy + srch ) );
+    }
+    if( x + srcw >= draw->width ) {
+        srcw += ( draw->width - ( x + srcw ) );
+    }
+    if( y + srch >= draw->height ) {
+        srch += ( draw->height - ( y + srch ) );
+    }
+    if( srcw <= 0 || srch <= 0 || x + srcw < 0 || y + srch < 0 || x > draw->width || y > draw->height ) {
+        return false;
+    } else {
+        *px = x;
+        *py = y;
+        *psrcx = srcx;
+        *psrcy = srcy;
+        *psrcw = srcw;
+        *psrch = srch;
+        return true;
+    }
+}
+
+
+static void internals_blit( struct internals_draw_t const* draw, int x, int y, uint8_t const* source, int width, 
+    int height, int pitch, int srcx, int srcy, int srcw, int srch ) {
+
+    if( !blitclip( draw, &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
+        return;
+    }
+
+    uint8_t* dst = draw->buffer + x + y * draw->pitch;
+    uint8_t const* src = source + srcx + srcy * pitch;
+    for( int iy = 0; iy < srch; ++iy ) {
+        memcpy( dst, src, srcw );
+        src += pitch;
+        dst += draw->pitch;
+    }
+    internals_dirty( draw->buffer, y, srch );
+}
+
+
+static void internals_maskblit( struct internals_draw_t const* draw, int x, int y, uint8_t const* source, int width, 
+    int height, int pitch, int srcx, int srcy, int srcw, int srch, int colorkey ) {
+
+    if( !blitclip( draw, &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
+        return;
+    }
+
+    uint8_t* dst = draw->buffer + x + y * draw->pitch;
+    uint8_t const* src = source + srcx + srcy * pitch;
+    if( colorkey < 0 || colorkey > 255 ) {
+        for( int iy = 0; iy < srch; ++iy ) {
+            memcpy( dst, src, srcw );
+            src += pitch;
+            dst += draw->pitch;
+        }
+        internals_dirty( draw->buffer, y, srch );
+        return;
+    }
+
+    // Eight pixels at a time: xor with the key leaves zero bytes where the source is transparent, which are turned into
+    // a byte mask for selecting between source and destination. Fully opaque or transparent groups skip the blend.
+    uint64_t const ones = 0x0101010101010101ull;
+    uint64_t const low7 = 0x7f7f7f7f7f7f7f7full;
+    uint64_t const high = 0x8080808080808080ull;
+    uint64_t const key = ones * (uint8_t) colorkey;
+    for( int iy = 0; iy < srch; ++iy ) {
+        int ix = 0;
+        for( ; ix + 8 <= srcw; ix += 8 ) {
+            uint64_t s;
+            memcpy( &s, src + ix, 8 );
+            uint64_t k = s ^ key;
+            uint64_t opaque = ( ( ( k & low7 ) + low7 ) | k ) & high;
+            if( opaque == high ) {
+                memcpy( dst + ix, &s, 8 );
+            } else if( opaque ) {
+                uint64_t mask = ( opaque >> 7 ) * 0xff;
+                uint64_t d;
+                memcpy( &d, dst + ix, 8 );
+                d = ( s & mask ) | ( d & ~mask );
+                memcpy( dst + ix, &d, 8 );
+            }
+        }
+        for( ; ix < srcw; ++ix ) {
+            if( src[ ix ] != colorkey ) {
+                dst[ ix ] = src[ ix ];
+            }
+        }
+        src += pitch;
+        dst += draw->pitch;
+    }
+    internals_dirty( draw->buffer, y, srch );
+}
+
+
+// Records a blit or maskblit, returning false if it could not be recorded and should be drawn immediately
+static bool internals_defer_blit( enum draw_command_type_t type, int x, int y, uint8_t const* source, int width, 
+    int height, int pitch, int srcx, int srcy, int srcw, int srch, int colorkey ) {
+
+    if( !blitclip( &internals->drawctx.draw, &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
+        return true;
+    }
+    struct draw_command_t* command = internals_defer( type, y, y + srch );
+    if( !command ) {
+        internals_flush();
+        return false;
+    }
+    command->x = x;
+    command->y = y;
+    command->key = colorkey;
+    command->source = source;
+    command->width = width;
+    command->height = height;
+    command->pitch = pitch;
+    command->srcx = srcx;
+    command->srcy = srcy;
+    command->srcw = srcw;
+    command->srch = srch;
+    return true;
+}
+
+
+static void internals_blitpitch( int x, int y, uint8_t const* source, int width, int height, int pitch, int srcx, 
+    int srcy, int srcw, int srch, int colorkey ) {
+
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    enum draw_command_type_t type = colorkey < 0 ? DRAW_COMMAND_BLIT : DRAW_COMMAND_MASKBLIT;
+    if( internals_deferring( ctx ) && 
+        internals_defer_blit( type, x, y, source, width, height, pitch, srcx, srcy, srcw, srch, colorkey ) ) {
+        return;
+    }
+    if( type == DRAW_COMMAND_BLIT ) {
+        internals_blit( &ctx->draw, x, y, source, width, height, pitch, srcx, srcy, srcw, srch );
+    } else {
+        internals_maskblit( &ctx->draw, x, y, source, width, height, pitch, srcx, srcy, srcw, srch, colorkey );
+    }
+}
+
+
+void blit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch ) {
+    internals_blitpitch( x, y, source, width, height, width, srcx, srcy, srcw, srch, -1 );
+}
+
+
+void maskblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch, int colorkey ) {
+    internals_blitpitch( x, y, source, width, height, width, srcx, srcy, srcw, srch, colorkey );
+}
+
+
+void bitmapblit( int x, int y, struct bitmap_t source, int colorkey ) {
+    internals_blitpitch( x, y, source.pixels, source.width, source.height, source.pitch, 0, 0, source.width, 
+        source.height, colorkey );
+}
+
+
+// Encodes one row as runs, returning the number of bytes needed. With a NULL output, the size is only counted. Pixels
+// are opaque where they differ from colorkey, or if an opaque row is given, where that is non-zero.
+static size_t internals_sprite_row( uint8_t const* src, uint8_t const* opaque, int width, int colorkey, uint8_t* out ) {
+    size_t size = 0;
+    int x = 0;
+    while( x < width ) {
+        int skip = 0;
+        while( x < width && ( opaque ? !opaque[ x ] : src[ x ] == colorkey ) && skip < 255 ) {
+            ++x;
+            ++skip;
+        }
+        int len = 0;
+        while( x + len < width && ( opaque ? opaque[ x + len ] : src[ x + len ] != colorkey ) && len < 255 ) {
+            ++len;
+        }
+        if( len == 0 && x >= width ) {
+            break;
+        }
+        if( out ) {
+            out[ size + 0 ] = (uint8_t) skip;
+            out[ size + 1 ] = (uint8_t) len;
+            memcpy( out + size + 2, src + x, len );
+        }
+        size += 2 + len;
+        x += len;
+    }
+    return size;
+}
+
+
+static struct sprite_t* internals_makesprite( uint8_t const* pixels, uint8_t const* opaque, int stride, int width, 
+    int height, int colorkey ) {
+
+    size_t data_size = 0;
+    for( int y = 0; y < height; ++y ) {
+        data_size += internals_sprite_row( pixels + y * stride, opaque ? opaque + y * stride : NULL, width, colorkey, 
+            NULL );
+    }
+    size_t rows_size = ( height + 1 ) * sizeof( uint32_t );
+    struct sprite_t* sprite = (struct sprite_t*) malloc( sizeof( struct sprite_t ) + rows_size + data_size );
+    if( !sprite ) return NULL;
+    sprite->width = width;
+    sprite->height = height;
+    sprite->rows = (uint32_t*)( sprite + 1 );
+    sprite->data = (uint8_t*)( sprite->rows + height + 1 );
+    uint32_t offset = 0;
+    for( int y = 0; y < height; ++y ) {
+        sprite->rows[ y ] = offset;
+        offset += (uint32_t) internals_sprite_row( pixels + y * stride, opaque ? opaque + y * stride : NULL, width, 
+            colorkey, sprite->data + offset );
+    }
+    sprite->rows[ height ] = offset;
+
+    sprite->uniform = -2;
+    for( int y = 0; y < height && sprite->uniform != -1; ++y ) {
+        uint8_t const* run = sprite->data + sprite->rows[ y ];
+        uint8_t const* end = sprite->data + sprite->rows[ y + 1 ];
+        while( run < end && sprite->uniform != -1 ) {
+            for( int i = 0; i < run[ 1 ]; ++i ) {
+                if( sprite->uniform != run[ 2 + i ] ) {
+                    sprite->uniform = sprite->uniform == -2 ? run[ 2 + i ] : -1;
+                }
+            }
+            run += 2 + run[ 1 ];
+        }
+    }
+    return sprite;
+}
+
+
+struct sprite_t* makesprite( unsigned char const* pixels, int width, int height, int colorkey ) {
+    if( !pixels || width <= 0 || height <= 0 ) return NULL;
+    return internals_makesprite( pixels, NULL, width, width, height, colorkey );
+}
+
+
+struct sprite_t* bitmapsprite( struct bitmap_t bitmap, int colorkey ) {
+    if( !bitmap.pixels || bitmap.width <= 0 || bitmap.height <= 0 ) return NULL;
+    return internals_makesprite( bitmap.pixels, NULL, bitmap.pitch, bitmap.width, bitmap.height, colorkey );
+}
+
+
+// Draws the runs of a sprite, clipped to the draw target. With a color of -1 the pixels are copied. Otherwise they are 
+// glyph values, where a value v is drawn as color + v - 1, and a value of 0 as outline.
+static void internals_drawsprite( struct internals_draw_t const* draw, int x, int y, struct sprite_t const* sprite, 
+    int color, int outline ) {
+
+    int x0 = x < 0 ? -x : 0;
+    int y0 = y < 0 ? -y : 0;
+    int x1 = draw->width - x < sprite->width ? draw->width - x : sprite->width;
+    int y1 = draw->height - y < sprite->height ? draw->height - y : sprite->height;
+    if( x0 >= x1 || y0 >= y1 ) return;
+
+    // a run of a single value can be filled rather than copied or translated
+    int fill = -1;
+    if( sprite->uniform >= 0 ) {
+        fill = color < 0 ? sprite->uniform : sprite->uniform ? (uint8_t)( color + sprite->uniform - 1 ) : outline;
+    }
+    uint8_t* dst = draw->buffer + x + ( y + y0 ) * draw->pitch;
+    for( int iy = y0; iy < y1; ++iy ) {
+        uint8_t const* run = sprite->data + sprite->rows[ iy ];
+        uint8_t const* end = sprite->data + sprite->rows[ iy + 1 ];
+        int sx = 0;
+        while( run < end && sx < x1 ) {
+            sx += run[ 0 ];
+            int len = run[ 1 ];
+            uint8_t const* src = run + 2;
+            run = src + len;
+            int a = sx > x0 ? sx : x0;
+            int b = sx + len < x1 ? sx + len : x1;
+            if( a < b ) {
+                if( fill >= 0 ) {
+                    memset( dst + a, fill, b - a );
+                } else if( color < 0 ) {
+                    memcpy( dst + a, src + ( a - sx ), b - a );
+                } else {
+                    for( int i = a; i < b; ++i ) {
+                        uint8_t v = src[ i - sx ];
+                        dst[ i ] = v ? (uint8_t)( color + v - 1 ) : (uint8_t) outline;
+                    }
+                }
+            }
+            sx += len;
+        }
+        dst += draw->pitch;
+    }
+    internals_dirty( draw->buffer, y + y0, y1 - y0 );
+}
+
+
+void drawsprite( int x, int y, struct sprite_t* sprite ) {
+    if( internals->screen.font || !sprite ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_sprite( ctx, x, y, sprite, -1, 0 );
 }
 
 
-void setdoublebuffer( int enabled ) {
-    internals->screen.doublebuffer = ( enabled != 0 );
+void freesprite( struct sprite_t* sprite ) {
+    internals_retire( sprite );
 }
 
 
-unsigned char* swapbuffers( void ) {
-    #ifdef __wasm__
-    if (internals->wasm.swap_counts++ > 2) {
-        // In WebAssembly without real threads, if a dos-like application never calls waitvbl
-        // by itself, we force a call to it every few calls to swapbuffer
-        waitvbl();
+// Range of steps i for which 0 <= pos + i * step < limit, all in 16.16 fixed point
+static void internals_step_range( int64_t pos, int64_t step, int64_t limit, int* first, int* last ) {
+    if( step == 0 ) {
+        if( pos < 0 || pos >= limit ) {
+            *last = *first;
+        }
+        return;
     }
-    #endif
-    if( internals->screen.doublebuffer ) {
-        thread_mutex_lock( &internals->mutex );
-        if( internals->screen.buffer == internals->screen.buffer0 ) {
-            if( internals->draw.buffer == internals->screen.buffer ) {
-                internals->draw.buffer = internals->screen.buffer1;
+    int64_t lo, hi;
+    if( step > 0 ) {
+        lo = pos >= 0 ? 0 : ( -pos + step - 1 ) / step;
+        hi = pos >= limit ? 0 : ( limit - pos + step - 1 ) / step;
+    } else {
+        lo = pos < limit ? 0 : ( pos - limit ) / -step + 1;
+        hi = pos < 0 ? 0 : pos / -step + 1;
+    }
+    if( lo > *first ) *first = (int) ( lo < *last ? lo : *last );
+    if( hi < *last ) *last = (int) ( hi > *first ? hi : *first );
+}
+
+
+static int32_t internals_wrap_fixed( int64_t value, int64_t limit ) {
+    value %= limit;
+    return (int32_t)( value < 0 ? value + limit : value );
+}
+
+
+// Fills a rectangle of the draw target from the source, where the center of the top left pixel samples the source at u, 
+// v, and each step right or down moves that by dux, dvx or duy, dvy, all in 16.16 fixed point. The rectangle is clipped 
+// once, and with BLIT_CLIP the span of each row that falls inside the source is found up front, so the inner loops
+// only step and copy.
+static void internals_affineblit( int x, int y, int w, int h, uint8_t const* source, int width, int height, int pitch, 
+    int64_t u, int64_t v, int64_t dux, int64_t dvx, int64_t duy, int64_t dvy, int colorkey, int addressing ) {
+
+    if( internals->screen.font || !source || width <= 0 || height <= 0 || width > 32767 || height > 32767 ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    if( x < 0 ) {
+        u -= x * dux;
+        v -= x * dvx;
+        w += x;
+        x = 0;
+    }
+    if( y < 0 ) {
+        u -= y * duy;
+        v -= y * dvy;
+        h += y;
+        y = 0;
+    }
+    if( x + w > ctx->draw.width ) w = ctx->draw.width - x;
+    if( y + h > ctx->draw.height ) h = ctx->draw.height - y;
+    if( w <= 0 || h <= 0 ) return;
+
+    int64_t const ulimit = (int64_t) width * 65536;
+    int64_t const vlimit = (int64_t) height * 65536;
+    if( addressing == BLIT_WRAP ) {
+        dux = internals_wrap_fixed( dux, ulimit );
+        dvx = internals_wrap_fixed( dvx, vlimit );
+    }
+    int const key = colorkey < 0 || colorkey > 255 ? -1 : colorkey;
+    int miny = h;
+    int maxy = -1;
+    for( int iy = 0; iy < h; ++iy ) {
+        uint8_t* dst = ctx->draw.buffer + x + ( y + iy ) * ctx->draw.pitch;
+        int64_t ru = u + iy * duy;
+        int64_t rv = v + iy * dvy;
+        int first = 0;
+        int last = w;
+        if( addressing == BLIT_CLIP ) {
+            internals_step_range( ru, dux, ulimit, &first, &last );
+            internals_step_range( rv, dvx, vlimit, &first, &last );
+            if( first >= last ) continue;
+            ru += first * dux;
+            rv += first * dvx;
+        }
+        miny = iy < miny ? iy : miny;
+        maxy = iy;
+        int32_t cu = (int32_t) dux;
+        int32_t cv = (int32_t) dvx;
+        if( addressing == BLIT_WRAP ) {
+            // unsigned, as position plus step can go past 2^31 for the widest bitmaps
+            uint32_t pu = (uint32_t) internals_wrap_fixed( ru, ulimit );
+            uint32_t pv = (uint32_t) internals_wrap_fixed( rv, vlimit );
+            uint32_t const ul = (uint32_t) ulimit;
+            uint32_t const vl = (uint32_t) vlimit;
+            for( int ix = first; ix < last; ++ix ) {
+                uint8_t c = source[ ( pu >> 16 ) + ( pv >> 16 ) * pitch ];
+                if( c != key ) dst[ ix ] = c;
+                pu += (uint32_t) cu;
+                if( pu >= ul ) pu -= ul;
+                pv += (uint32_t) cv;
+                if( pv >= vl ) pv -= vl;
+            }
+        } else if( addressing == BLIT_CLAMP ) {
+            int64_t pu = ru;
+            int64_t pv = rv;
+            for( int ix = first; ix < last; ++ix ) {
+                int su = pu < 0 ? 0 : pu >= ulimit ? width - 1 : (int)( pu >> 16 );
+                int sv = pv < 0 ? 0 : pv >= vlimit ? height - 1 : (int)( pv >> 16 );
+                uint8_t c = source[ su + sv * pitch ];
+                if( c != key ) dst[ ix ] = c;
+                pu += dux;
+                pv += dvx;
+            }
+        } else if( cv == 0 ) {
+            uint8_t const* src = source + ( rv >> 16 ) * pitch;
+            int32_t pu = (int32_t) ru;
+            for( int ix = first; ix < last; ++ix ) {
+                uint8_t c = src[ pu >> 16 ];
+                if( c != key ) dst[ ix ] = c;
+                pu += cu;
             }
-            internals->screen.buffer = internals->screen.buffer1;
         } else {
-            if( internals->draw.buffer == internals->screen.buffer ) {
-                internals->draw.buffer = internals->screen.buffer0;
+            int32_t pu = (int32_t) ru;
+            int32_t pv = (int32_t) rv;
+            for( int ix = first; ix < last; ++ix ) {
+                uint8_t c = source[ ( pu >> 16 ) + ( pv >> 16 ) * pitch ];
+                if( c != key ) dst[ ix ] = c;
+                pu += cu;
+                pv += cv;
             }
-            internals->screen.buffer = internals->screen.buffer0;
         }
-        thread_mutex_unlock( &internals->mutex );
     }
-    return internals->screen.buffer;
+    if( maxy >= miny ) {
+        internals_dirty( ctx->draw.buffer, y + miny, maxy - miny + 1 );
+    }
 }
 
 
-void setpal( int index, int r, int g, int b ) {
-    if( index < 0 || index >= 256 ) {
-        return;
+static void internals_scaleblit( int x, int y, int w, int h, uint8_t const* source, int width, int height, int pitch, 
+    int srcx, int srcy, int srcw, int srch, int colorkey, int addressing ) {
+
+    if( w <= 0 || h <= 0 ) return;
+    int64_t du = (int64_t) srcw * 65536 / w;
+    int64_t dv = (int64_t) srch * 65536 / h;
+    internals_affineblit( x, y, w, h, source, width, height, pitch, (int64_t) srcx * 65536 + du / 2, 
+        (int64_t) srcy * 65536 + dv / 2, du, 0, 0, dv, colorkey, addressing );
+}
+
+
+void scaleblit( int x, int y, int w, int h, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, 
+    int srch, int colorkey, int addressing ) {
+
+    internals_scaleblit( x, y, w, h, source, width, height, width, srcx, srcy, srcw, srch, colorkey, addressing );
+}
+
+
+void bitmapscaleblit( int x, int y, int w, int h, struct bitmap_t source, int colorkey, int addressing ) {
+    internals_scaleblit( x, y, w, h, source.pixels, source.width, source.height, source.pitch, 0, 0, source.width, 
+        source.height, colorkey, addressing );
+}
+
+
+static void internals_rotoblit( int x, int y, int w, int h, uint8_t const* source, int width, int height, int pitch, 
+    float u, float v, float angle, float zoom, int colorkey, int addressing ) {
+
+    if( w <= 0 || h <= 0 || !( zoom > 0.0f ) ) return;
+    double c = cos( angle ) / zoom;
+    double s = sin( angle ) / zoom;
+    // offset of the top left pixel center from the middle of the rectangle
+    double ox = 0.5 - w * 0.5;
+    double oy = 0.5 - h * 0.5;
+    double su = u + c * ox + s * oy;
+    double sv = v - s * ox + c * oy;
+    internals_affineblit( x, y, w, h, source, width, height, pitch, (int64_t) floor( su * 65536.0 ), 
+        (int64_t) floor( sv * 65536.0 ), (int64_t)( c * 65536.0 ), (int64_t)( -s * 65536.0 ), (int64_t)( s * 65536.0 ), 
+        (int64_t)( c * 65536.0 ), colorkey, addressing );
+}
+
+
+void rotoblit( int x, int y, int w, int h, unsigned char* source, int width, int height, float u, float v, float angle, 
+    float zoom, int colorkey, int addressing ) {
+
+    internals_rotoblit( x, y, w, h, source, width, height, width, u, v, angle, zoom, colorkey, addressing );
+}
+
+
+void bitmaprotoblit( int x, int y, int w, int h, struct bitmap_t source, float u, float v, float angle, float zoom, 
+    int colorkey, int addressing ) {
+
+    internals_rotoblit( x, y, w, h, source.pixels, source.width, source.height, source.pitch, u, v, angle, zoom, 
+        colorkey, addressing );
+}
+
+
+// Finds the nearest palette color for building remap tables. The color cube is split into 8x8x8 cells, and each cell
+// lists only the palette colors which can be the nearest to some point inside it: those no further from the cell than
+// the furthest corner of the cell is from the color nearest to that corner. The lists are sorted by how close to the
+// cell each color is, so a search can stop at the first color which can't be nearer than the best match so far. Of
+// equally near colors, the lowest index is picked, the same as when searching all of them in order.
+struct internals_nearest_t {
+    int rgb[ 256 ][ 3 ];
+    int first[ 8 * 8 * 8 + 1 ]; // each cell's candidates start at candidates + first[ cell ]
+    uint8_t* candidates;
+    uint16_t* bounds; // a quarter of the shortest distance from each candidate to the cell, rounded down
+};
+
+
+static bool internals_nearest_init( struct internals_nearest_t* nearest, uint32_t const* palette ) {
+    // The distances along each axis from every color to every row of cells are only needed while building the lists
+    size_t lists_size = 8 * 8 * 8 * 256 * ( sizeof( uint8_t ) + sizeof( uint16_t ) );
+    nearest->candidates = (uint8_t*) malloc( lists_size + 2 * 3 * 8 * 256 * sizeof( int ) );
+    if( !nearest->candidates ) return false;
+    nearest->bounds = (uint16_t*)( nearest->candidates + 8 * 8 * 8 * 256 );
+    int (*near_axis)[ 8 ][ 256 ] = (int (*)[ 8 ][ 256 ])( nearest->candidates + lists_size );
+    int (*far_axis)[ 8 ][ 256 ] = near_axis + 3;
+    for( int i = 0; i < 256; ++i ) {
+        for( int c = 0; c < 3; ++c ) {
+            nearest->rgb[ i ][ c ] = (int)( ( palette[ i ] >> ( c * 8 ) ) & 0xff );
+        }
     }
 
-    r = ( r & 63 ) << 2;
-    g = ( g & 63 ) << 2;
-    b = ( b & 63 ) << 2;
-    internals->screen.palette[ index ] = ( b << 16 ) | ( g << 8 ) | ( r );
+    for( int c = 0; c < 3; ++c ) {
+        for( int cell = 0; cell < 8; ++cell ) {
+            int lo = cell * 32;
+            int hi = lo + 31;
+            for( int i = 0; i < 256; ++i ) {
+                int v = nearest->rgb[ i ][ c ];
+                int d = v < lo ? lo - v : v > hi ? v - hi : 0;
+                int f = v - lo > hi - v ? v - lo : hi - v;
+                near_axis[ c ][ cell ][ i ] = d * d;
+                far_axis[ c ][ cell ][ i ] = f * f;
+            }
+        }
+    }
+
+    int count = 0;
+    for( int cell = 0; cell < 8 * 8 * 8; ++cell ) {
+        int const* near_r = near_axis[ 0 ][ cell & 7 ];
+        int const* near_g = near_axis[ 1 ][ ( cell >> 3 ) & 7 ];
+        int const* near_b = near_axis[ 2 ][ cell >> 6 ];
+        int const* far_r = far_axis[ 0 ][ cell & 7 ];
+        int const* far_g = far_axis[ 1 ][ ( cell >> 3 ) & 7 ];
+        int const* far_b = far_axis[ 2 ][ cell >> 6 ];
+        int limit = 3 * 256 * 256; // more than any distance
+        for( int i = 0; i < 256; ++i ) {
+            int far_dist = far_r[ i ] + far_g[ i ] + far_b[ i ];
+            limit = far_dist < limit ? far_dist : limit;
+        }
+        nearest->first[ cell ] = count;
+        for( int i = 0; i < 256; ++i ) {
+            int near_dist = near_r[ i ] + near_g[ i ] + near_b[ i ];
+            if( near_dist <= limit ) {
+                // insertion sorted, after any equally near colors so those stay in palette order
+                uint16_t bound = (uint16_t)( near_dist >> 2 );
+                int j = count++;
+                while( j > nearest->first[ cell ] && nearest->bounds[ j - 1 ] > bound ) {
+                    nearest->candidates[ j ] = nearest->candidates[ j - 1 ];
+                    nearest->bounds[ j ] = nearest->bounds[ j - 1 ];
+                    --j;
+                }
+                nearest->candidates[ j ] = (uint8_t) i;
+                nearest->bounds[ j ] = bound;
+            }
+        }
+    }
+    nearest->first[ 8 * 8 * 8 ] = count;
+    return true;
 }
 
 
-void getpal( int index, int* r, int* g, int* b ) {
-    if( index < 0 || index >= 256 ) {
+static void internals_nearest_term( struct internals_nearest_t* nearest ) {
+    free( nearest->candidates );
+}
+
+
+static uint8_t internals_nearest( struct internals_nearest_t const* nearest, int r, int g, int b ) {
+    int cell = ( r >> 5 ) + ( ( g >> 5 ) << 3 ) + ( ( b >> 5 ) << 6 );
+    int end = nearest->first[ cell + 1 ];
+    int best = 0;
+    int best_dist = 3 * 256 * 256;
+    for( int i = nearest->first[ cell ]; i < end && ( (int) nearest->bounds[ i ] << 2 ) <= best_dist; ++i ) {
+        int candidate = nearest->candidates[ i ];
+        int const* rgb = nearest->rgb[ candidate ];
+        int dr = rgb[ 0 ] - r;
+        int dg = rgb[ 1 ] - g;
+        int db = rgb[ 2 ] - b;
+        int dist = dr * dr + dg * dg + db * db;
+        if( dist < best_dist || ( dist == best_dist && candidate < best ) ) {
+            best = candidate;
+            best_dist = dist;
+        }
+    }
+    return (uint8_t) best;
+}
+
+
+void buildshadetable( int levels ) {
+    levels = levels < 1 ? 1 : levels > 256 ? 256 : levels;
+    uint32_t palette[ 256 ];
+    thread_mutex_lock( &internals->mutex );
+    memcpy( palette, internals->screen.palette, 1024 );
+    thread_mutex_unlock( &internals->mutex );
+    struct internals_nearest_t nearest;
+    if( !internals_nearest_init( &nearest, palette ) ) return;
+    uint8_t* shades = (uint8_t*) realloc( internals->graphics.shades, (size_t) levels * 256 );
+    if( !shades ) {
+        internals_nearest_term( &nearest );
         return;
     }
+    internals->graphics.shades = shades;
+    internals->graphics.shade_levels = levels;
 
-    uint32_t c = internals->screen.palette[ index ];
-    uint32_t cr = ( c ) & 0xff;
-    uint32_t cg = ( c >> 8 ) & 0xff;
-    uint32_t cb = ( c >> 16 ) & 0xff;
-    if( r ) {
-        *r = cr >> 2;
+    // Level 0 is left exactly as it is, rather than mapping colors which appear twice in the palette to the first one
+    for( int i = 0; i < 256; ++i ) {
+        shades[ i ] = (uint8_t) i;
     }
-    if( g ) {
-        *g = cg >> 2;
+    for( int level = 1; level < levels; ++level ) {
+        int scale = levels - 1 - level;
+        uint8_t* shade = shades + level * 256;
+        for( int i = 0; i < 256; ++i ) {
+            int r = (int)( palette[ i ] & 0xff ) * scale / ( levels - 1 );
+            int g = (int)( ( palette[ i ] >> 8 ) & 0xff ) * scale / ( levels - 1 );
+            int b = (int)( ( palette[ i ] >> 16 ) & 0xff ) * scale / ( levels - 1 );
+            shade[ i ] = internals_nearest( &nearest, r, g, b );
+        }
     }
-    if( b ) {
-        *b = cb >> 2;
-    }   
+    internals_nearest_term( &nearest );
 }
 
 
-int getpixel( int x, int y ) {
-    if( internals->screen.font ) return 0;
-    if( x >= 0 && y >= 0 && x < internals->draw.width && y < internals->draw.height ) {
-        return internals->draw.buffer[ x + internals->draw.width * y ];
-    } else {
-        return 0;
+unsigned char const* shadetable( int level ) {
+    // Other contexts may be drawing on other threads, which must not see the table being built
+    if( !internals->graphics.shades && internals_drawctx() == &internals->drawctx ) {
+        buildshadetable( 1 );
+        if( !internals->graphics.shades ) return NULL;
     }
+    int levels = internals->graphics.shade_levels;
+    level = level < 0 ? 0 : level >= levels ? levels - 1 : level;
+    return internals->graphics.shades + level * 256;
 }
 
 
-void putpixel( int x, int y, int color ) {
+static void internals_shadeblit( int x, int y, uint8_t const* source, int width, int height, int pitch, int srcx, 
+    int srcy, int srcw, int srch, int colorkey, int level ) {
+
     if( internals->screen.font ) return;
-    if( x >= 0 && y >= 0 && x < internals->draw.width && y < internals->draw.height ) {
-        internals->draw.buffer[ x + internals->draw.width * y ] = (uint8_t)color;
+    struct drawctx_t* ctx = internals_drawctx();
+    uint8_t const* shade = shadetable( level );
+    if( !shade ) return;
+    internals_flushdraw( ctx );
+    struct internals_draw_t const* draw = &ctx->draw;
+    if( !blitclip( draw, &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
+        return;
+    }
+
+    int const key = colorkey < 0 || colorkey > 255 ? -1 : colorkey;
+    uint8_t* dst = draw->buffer + x + y * draw->pitch;
+    uint8_t const* src = source + srcx + srcy * pitch;
+    for( int iy = 0; iy < srch; ++iy ) {
+        for( int ix = 0; ix < srcw; ++ix ) {
+            uint8_t c = src[ ix ];
+            if( c != key ) dst[ ix ] = shade[ c ];
+        }
+        src += pitch;
+        dst += draw->pitch;
     }
+    internals_dirty( draw->buffer, y, srch );
 }
 
 
-void setdrawtarget( unsigned char* pixels, int width, int height ) {
-    if( internals->screen.font ) return;
-    internals->draw.buffer = pixels;
-    internals->draw.width = width;
-    internals->draw.height = height;
+void shadeblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch,
+    int colorkey, int level ) {
+
+    internals_shadeblit( x, y, source, width, height, width, srcx, srcy, srcw, srch, colorkey, level );
 }
 
 
-void resetdrawtarget( void ) {
-    if( internals->screen.font ) return;
-    internals->draw.buffer = internals->screen.buffer;
-    internals->draw.width = internals->screen.width;
-    internals->draw.height = internals->screen.height;
+void bitmapshadeblit( int x, int y, struct bitmap_t source, int colorkey, int level ) {
+    internals_shadeblit( x, y, source.pixels, source.width, source.height, source.pitch, 0, 0, source.width, 
+        source.height, colorkey, level );
 }
 
 
-void setcolor( int color ) {
-    if( internals->screen.font ) return;
-    if( color >= 0 && color <= 255 ) {
-        internals->graphics.color = color; 
+static void internals_shadecolumn( int x, int y, int h, uint8_t const* source, int width, int height, int pitch, int u, 
+    float v, float vstep, int colorkey, int level ) {
+
+    if( internals->screen.font || !source || width <= 0 || height <= 0 || height > 32767 ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    if( x < 0 || x >= ctx->draw.width || u < 0 || u >= width ) return;
+    uint8_t const* shade = shadetable( level );
+    if( !shade ) return;
+    internals_flushdraw( ctx );
+    int64_t pv = (int64_t) floor( v * 65536.0 );
+    int64_t dv = (int64_t)( vstep * 65536.0 );
+    if( y < 0 ) {
+        pv -= y * dv;
+        h += y;
+        y = 0;
+    }
+    if( y + h > ctx->draw.height ) h = ctx->draw.height - y;
+    if( h <= 0 ) return;
+
+    // Both the position and the step are wrapped into the source, so stepping needs at most one subtraction
+    int64_t const vlimit = (int64_t) height * 65536;
+    uint32_t const vl = (uint32_t) vlimit;
+    uint32_t p = (uint32_t) internals_wrap_fixed( pv, vlimit );
+    uint32_t const step = (uint32_t) internals_wrap_fixed( dv, vlimit );
+    int const key = colorkey < 0 || colorkey > 255 ? -1 : colorkey;
+    uint8_t const* src = source + u;
+    uint8_t* dst = ctx->draw.buffer + x + y * ctx->draw.pitch;
+    for( int i = 0; i < h; ++i ) {
+        uint8_t c = src[ ( p >> 16 ) * pitch ];
+        if( c != key ) *dst = shade[ c ];
+        dst += ctx->draw.pitch;
+        p += step;
+        if( p >= vl ) p -= vl;
     }
+    internals_dirty( ctx->draw.buffer, y, h );
 }
 
 
-int getcolor( void ) {
-    if( internals->screen.font ) return 0;
-    return internals->graphics.color;
+void shadecolumn( int x, int y, int h, unsigned char* source, int width, int height, int u, float v, float vstep,
+    int colorkey, int level ) {
+
+    internals_shadecolumn( x, y, h, source, width, height, width, u, v, vstep, colorkey, level );
 }
 
 
-int installuserfont( char const* filename ) {
-    if( internals->graphics.fonts_count >= sizeof( internals->graphics.fonts ) / sizeof( *internals->graphics.fonts ) ) {
-        return 0;
-    }
-    FILE* fp = fopen( filename, "rb" );
-    if( !fp ) return 0;
-    fseek( fp, 0, SEEK_END );
-    size_t sz = ftell( fp );
-    fseek( fp, 0, SEEK_SET );
-    uint8_t* data = (uint8_t*) malloc( sz );
-    fread( data, 1, sz, fp );
-    fclose( fp );
-    
-    internals->graphics.fonts[ internals->graphics.fonts_count ] = (pixelfont_t*) data;
+void bitmapshadecolumn( int x, int y, int h, struct bitmap_t source, int u, float v, float vstep, int colorkey, 
+    int level ) {
 
-    return internals->graphics.fonts_count++;
+    internals_shadecolumn( x, y, h, source.pixels, source.width, source.height, source.pitch, u, v, vstep, colorkey, 
+        level );
 }
 
 
-void settextstyle( int font, int bold, int italic, int underline ) {
-    if( internals->screen.font ) return;
-    if( font >= 1 && font < internals->graphics.fonts_count ) {
-        internals->graphics.current_font = font;
-        internals->graphics.bold = bold;
-        internals->graphics.italic = italic;
-        internals->graphics.underline = underline;
+void buildblendtable( int alpha ) {
+    alpha = alpha < 0 ? 0 : alpha > 255 ? 255 : alpha;
+    uint32_t palette[ 256 ];
+    thread_mutex_lock( &internals->mutex );
+    memcpy( palette, internals->screen.palette, 1024 );
+    thread_mutex_unlock( &internals->mutex );
+    struct internals_nearest_t nearest;
+    if( !internals_nearest_init( &nearest, palette ) ) return;
+    if( !internals->graphics.blend ) {
+        internals->graphics.blend = (uint8_t*) malloc( 256 * 256 );
+        if( !internals->graphics.blend ) {
+            internals_nearest_term( &nearest );
+            return;
+        }
+    }
+    uint8_t* blend = internals->graphics.blend;
+
+    // Where the blend is exactly one of the two colors (drawing a color over itself, or at an opacity of 0 or 255), 
+    // that color is used as it is, rather than an identical color earlier in the palette
+    for( int a = 0; a < 256; ++a ) {
+        for( int b = 0; b < 256; ++b ) {
+            uint32_t c = 0;
+            for( int shift = 0; shift < 24; shift += 8 ) {
+                int ca = (int)( ( palette[ a ] >> shift ) & 0xff );
+                int cb = (int)( ( palette[ b ] >> shift ) & 0xff );
+                c |= (uint32_t)( ( ca * alpha + cb * ( 255 - alpha ) + 127 ) / 255 ) << shift;
+            }
+            if( c == palette[ a ] ) {
+                blend[ a * 256 + b ] = (uint8_t) a;
+            } else if( c == palette[ b ] ) {
+                blend[ a * 256 + b ] = (uint8_t) b;
+            } else {
+                blend[ a * 256 + b ] = internals_nearest( &nearest, (int)( c & 0xff ), (int)( ( c >> 8 ) & 0xff ), 
+                    (int)( ( c >> 16 ) & 0xff ) );
+            }
+        }
     }
+    internals_nearest_term( &nearest );
 }
 
-void wraptextxy( int x, int y, char const* text, int wrap_width ) {
-    if( internals->screen.font ) return;
-    int color = internals->graphics.color;
-    pixelfont_t* font = internals->graphics.fonts[ internals->graphics.current_font ];
-    PIXELFONT_COLOR* target = internals->draw.buffer;
-    int width = internals->draw.width;
-    int height = internals->draw.height;
-    pixelfont_align_t align = PIXELFONT_ALIGN_LEFT;
-    int hspacing = 0;
-	int vspacing = 0;
-    int limit = -1;
-    pixelfont_bold_t bold = internals->graphics.bold ? PIXELFONT_BOLD_ON : PIXELFONT_BOLD_OFF;
-    pixelfont_italic_t italic = internals->graphics.italic ? PIXELFONT_ITALIC_ON : PIXELFONT_ITALIC_OFF;
-    pixelfont_underline_t underline = internals->graphics.underline ? PIXELFONT_UNDERLINE_ON : PIXELFONT_UNDERLINE_OFF;
 
-    pixelfont_blit( font, x, y, text, (PIXELFONT_COLOR)color, target, width, height, align, wrap_width, hspacing, vspacing, limit, bold, 
-        italic, underline, NULL );
+unsigned char const* blendtable( void ) {
+    if( !internals->graphics.blend && internals_drawctx() == &internals->drawctx ) {
+        buildblendtable( 128 );
+    }
+    return internals->graphics.blend;
 }
 
 
-void centertextxy( int x, int y, char const* text, int wrap_width ) {
-    if( internals->screen.font ) return;
-    int color = internals->graphics.color;
-    pixelfont_t* font = internals->graphics.fonts[ internals->graphics.current_font ];
-    PIXELFONT_COLOR* target = internals->draw.buffer;
-    int width = internals->draw.width;
-    int height = internals->draw.height;
-    pixelfont_align_t align = PIXELFONT_ALIGN_CENTER;
-    int hspacing = 0;
-	int vspacing = 0;
-    int limit = -1;
-    pixelfont_bold_t bold = internals->graphics.bold ? PIXELFONT_BOLD_ON : PIXELFONT_BOLD_OFF;
-    pixelfont_italic_t italic = internals->graphics.italic ? PIXELFONT_ITALIC_ON : PIXELFONT_ITALIC_OFF;
-    pixelfont_underline_t underline = internals->graphics.underline ? PIXELFONT_UNDERLINE_ON : PIXELFONT_UNDERLINE_OFF;
-
-    pixelfont_blit( font, x, y, text, (PIXELFONT_COLOR)color, target, width, height, align, wrap_width, hspacing, vspacing, limit, bold, 
-        italic, underline, NULL );
+static void internals_blendspan( uint8_t* dst, uint8_t const* src, int len, int colorkey, uint8_t const* blend ) {
+    for( int i = 0; i < len; ++i ) {
+        uint8_t c = src[ i ];
+        if( c != colorkey ) dst[ i ] = blend[ c * 256 + dst[ i ] ];
+    }
 }
 
 
-void outtextxy( int x, int y, char const* text ) {
-    if( internals->screen.font ) return;
-    int color = internals->graphics.color;
-    pixelfont_t* font = internals->graphics.fonts[ internals->graphics.current_font ];
-    PIXELFONT_COLOR* target = internals->draw.buffer;
-    int width = internals->draw.width;
-    int height = internals->draw.height;
-    pixelfont_align_t align = PIXELFONT_ALIGN_LEFT;
-    int wrap_width = 0;
-    int hspacing = 0;
-	int vspacing = 0;
-    int limit = -1;
-    pixelfont_bold_t bold = internals->graphics.bold ? PIXELFONT_BOLD_ON : PIXELFONT_BOLD_OFF;
-    pixelfont_italic_t italic = internals->graphics.italic ? PIXELFONT_ITALIC_ON : PIXELFONT_ITALIC_OFF;
-    pixelfont_underline_t underline = internals->graphics.underline ? PIXELFONT_UNDERLINE_ON : PIXELFONT_UNDERLINE_OFF;
-
-    pixelfont_blit( font, x, y, text, (PIXELFONT_COLOR)color, target, width, height, align, wrap_width, hspacing, vspacing, limit, bold, 
-        italic, underline, NULL );
-}
+static void internals_blendblit( int x, int y, uint8_t const* source, int width, int height, int pitch, int srcx, 
+    int srcy, int srcw, int srch, int colorkey ) {
 
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    uint8_t const* blend = blendtable();
+    if( !blend ) return;
+    internals_flushdraw( ctx );
+    struct internals_draw_t const* draw = &ctx->draw;
+    if( !blitclip( draw, &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
+        return;
+    }
 
-void waitvbl( void ) {
-    if( thread_atomic_int_load( &internals->exit_flag ) == 0 ) {
-        #ifndef __wasm__
-        int current_vbl_count = thread_atomic_int_load( &internals->vbl.count );
-        while( current_vbl_count == thread_atomic_int_load( &internals->vbl.count ) ) {
-            thread_signal_wait( &internals->vbl.signal, 1000 );
-        }
-        #else
-        WaCoroSwitch(0);
-        internals->wasm.swap_counts = internals->wasm.read_counts = 0;
-        #endif
+    int const key = colorkey < 0 || colorkey > 255 ? -1 : colorkey;
+    uint8_t* dst = draw->buffer + x + y * draw->pitch;
+    uint8_t const* src = source + srcx + srcy * pitch;
+    for( int iy = 0; iy < srch; ++iy ) {
+        internals_blendspan( dst, src, srcw, key, blend );
+        src += pitch;
+        dst += draw->pitch;
     }
+    internals_dirty( draw->buffer, y, srch );
 }
 
 
-static void signalvbl( void ) {
-    thread_atomic_int_inc( &internals->vbl.count );
-    thread_signal_raise( &internals->vbl.signal );
-    #ifdef __wasm__
-    WaCoroSwitch(internals->wasm.user_coro);
-    #endif
+void blendblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch,
+    int colorkey ) {
+
+    internals_blendblit( x, y, source, width, height, width, srcx, srcy, srcw, srch, colorkey );
 }
 
 
-void clearscreen( void ) {
-    memset( internals->screen.buffer, 0, internals->screen.width * internals->screen.height * ( internals->screen.font ? 2 : 1 ) );
+void bitmapblendblit( int x, int y, struct bitmap_t source, int colorkey ) {
+    internals_blendblit( x, y, source.pixels, source.width, source.height, source.pitch, 0, 0, source.width, 
+        source.height, colorkey );
 }
 
 
-static bool blitclip( int* px, int *py, int width, int height, int* psrcx, int* psrcy, int* psrcw, int* psrch ) {
-    int x = *px;
-    int y = *py;
-    int srcx = *psrcx;
-    int srcy = *psrcy;
-    int srcw = *psrcw;
-    int srch = *psrch;
+void blendbar( int x, int y, int w, int h ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    uint8_t const* blend = blendtable();
+    if( !blend ) return;
+    internals_flushdraw( ctx );
+    struct internals_draw_t const* draw = &ctx->draw;
     if( x < 0 ) {
-        srcx -= x;
-        srcw += x;
+        w += x;
         x = 0;
     }
     if( y < 0 ) {
-        srcy -= y;
-        srch += y;
+        h += y;
         y = 0;
     }
-    if( srcx < 0 ) {
-        x += srcx;
-        srcw += srcx;
-        srcx = 0;
-    }
-    if( srcy < 0 ) {
-        y += srcy;
-        srch += srcy;
-        srcy = 0;
-    }
-    if( srcx + srcw >= width ) {
-        srcw += ( width - ( srcx + srcw ) );
-    }
-    if( srcy + srch >= height ) {
-        srch += ( height - ( srcy + srch ) );
-    }
-    if( x + srcw >= internals->draw.width ) {
-        srcw += ( internals->draw.width - ( x + srcw ) );
+    if( w > draw->width - x ) {
+        w = draw->width - x;
     }
-    if( y + srch >= internals->draw.height ) {
-        srch += ( internals->draw.height - ( y + srch ) );
+    if( h > draw->height - y ) {
+        h = draw->height - y;
     }
-    if( srcw <= 0 || srch <= 0 || x + srcw < 0 || y + srch < 0 || x > internals->draw.width || y > internals->draw.height ) {
-        return false;
-    } else {
-        *px = x;
-        *py = y;
-        *psrcx = srcx;
-        *psrcy = srcy;
-        *psrcw = srcw;
-        *psrch = srch;
-        return true;
+    if( w <= 0 || h <= 0 ) return;
+
+    // Drawing a single color only needs its own row of the table
+    uint8_t const* over = blend + ctx->color * 256;
+    uint8_t* row = draw->buffer + x + y * draw->pitch;
+    for( int iy = 0; iy < h; ++iy ) {
+        for( int ix = 0; ix < w; ++ix ) {
+            row[ ix ] = over[ row[ ix ] ];
+        }
+        row += draw->pitch;
     }
+    internals_dirty( draw->buffer, y, h );
 }
 
 
-void blit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch ) {
+void blendhline( int x, int y, int len, int color ) {
     if( internals->screen.font ) return;
-    if( !blitclip( &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
+    struct drawctx_t* ctx = internals_drawctx();
+    uint8_t const* blend = blendtable();
+    if( !blend ) return;
+    internals_flushdraw( ctx );
+    if( y < 0 || y >= ctx->draw.height ) {
         return;
     }
-
-    uint8_t* dst = internals->draw.buffer + x + y * internals->draw.width;
-    uint8_t* src = source + srcx + srcy * width;
-    for( int iy = 0; iy < srch; ++iy ) {
-        memcpy( dst, src, srcw );
-        src += width;
-        dst += internals->draw.width;
+    if( x < 0 ) { 
+        len += x; 
+        x = 0; 
     }
-}
-
-
-void maskblit( int x, int y, unsigned char* source, int width, int height, int srcx, int srcy, int srcw, int srch, int colorkey ) {
-    if( internals->screen.font ) return;
-    if( !blitclip( &x, &y, width, height, &srcx, &srcy, &srcw, &srch ) ) {
-        return;
+    if( len > ctx->draw.width - x ) {
+        len = ctx->draw.width - x;
     }
-
-    uint8_t* dst = internals->draw.buffer + x + y * internals->draw.width;
-    uint8_t* src = source + srcx + srcy * width;
-    for( int iy = 0; iy < srch; ++iy ) {
-        for( int ix = 0; ix < srcw; ++ix ) {
-            if( src[ ix ] != colorkey ) {
-                dst[ ix ] = src[ ix ];
-            }
-        }
-        src += width;
-        dst += internals->draw.width;
+    uint8_t const* over = blend + (uint8_t) color * 256;
+    uint8_t* dst = ctx->draw.buffer + x + y * ctx->draw.pitch;
+    for( int i = 0; i < len; ++i ) {
+        dst[ i ] = over[ dst[ i ] ];
     }
+    internals_dirty( ctx->draw.buffer, y, 1 );
 }
 
 
@@ -1095,26 +4117,76 @@ unsigned char* loadgif( char const* filename, int* width, int* height, int* palc
 }
 
 
-void hline( int x, int y, int len, int color ) {
-    if( internals->screen.font ) return;
-	if( y < 0 || y >= internals->draw.height ) {
+// Fills part of a row, clipped to the draw target, without marking it dirty
+static void internals_hspan( struct internals_draw_t const* draw, int x, int y, int len, uint8_t color ) {
+    if( y < 0 || y >= draw->height ) {
         return;
     }
-	if( x < 0 ) { 
-        len += x; x = 0; 
+    if( x < 0 ) { 
+        len += x; 
+        x = 0; 
+    }
+    if( len > draw->width - x ) {
+        len = draw->width - x;
+    }
+    if( len > 0 ) {
+        memset( draw->buffer + y * draw->pitch + x, color, len );
+    }
+}
+
+
+// Marks the rows from y - r to y + r dirty, and returns false if the box x - r, y - r to x + r, y + r is entirely 
+// outside the draw target. If it is entirely inside, inside is set, so the shape can be drawn without bounds checks.
+static bool internals_shape_bounds( struct internals_draw_t const* draw, int x, int y, int rx, int ry, bool* inside ) {
+    rx = rx < 0 ? -rx : rx;
+    ry = ry < 0 ? -ry : ry;
+    int width = draw->width;
+    int height = draw->height;
+    if( x + rx < 0 || y + ry < 0 || x - rx >= width || y - ry >= height ) {
+        return false;
+    }
+    *inside = x - rx >= 0 && y - ry >= 0 && x + rx < width && y + ry < height;
+    internals_dirty( draw->buffer, y - ry, ry * 2 + 1 );
+    return true;
+}
+
+
+static void internals_plot( struct internals_draw_t const* draw, int x, int y, uint8_t color, bool clip ) {
+    if( !clip || ( (unsigned) x < (unsigned) draw->width && (unsigned) y < (unsigned) draw->height ) ) {
+        draw->buffer[ x + y * draw->pitch ] = color;
     }
-	if( x + len > internals->draw.width ) {
-        len = internals->draw.width - x;
+}
+
+
+// An ellipse with a zero radius is a point, or a line along the other axis, which the midpoint loops can't step along.
+static void internals_flat_ellipse( struct internals_draw_t const* draw, int x, int y, int rx, int ry, uint8_t color ) {
+    int y0 = y - ry < 0 ? 0 : y - ry;
+    int y1 = y + ry >= draw->height ? draw->height - 1 : y + ry;
+    for( int iy = y0; iy <= y1; ++iy ) {
+        internals_hspan( draw, x - rx, iy, rx * 2 + 1, color );
     }
-	uint8_t* scr = internals->draw.buffer + y * internals->draw.width + x;
-	uint8_t* end = scr + len;
-	while( scr < end ) *scr++ = (uint8_t)color;
+}
+
+
+void hline( int x, int y, int len, int color ) {
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    internals_hspan( &ctx->draw, x, y, len, (uint8_t) color );
+    internals_dirty( ctx->draw.buffer, y, 1 );
+}
+
+
+static int64_t internals_floor_div( int64_t a, int64_t b ) {
+    return a >= 0 ? a / b : -( ( -a + b - 1 ) / b );
 }
 
 
 void line( int x1, int y1, int x2, int y2 ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    uint8_t color = (uint8_t) ctx->color;
 	int dx = x2 - x1;
 	dx = dx < 0 ? -dx : dx;
 	int sx = x1 < x2 ? 1 : -1;
@@ -1122,27 +4194,74 @@ void line( int x1, int y1, int x2, int y2 ) {
 	dy = dy < 0 ? -dy : dy;
 	int sy = y1 < y2 ? 1 : -1; 
 	int err = ( dx > dy ? dx : -dy ) / 2;	 
-	int x = x1;
-	int y = y1;
-	while( x != x2 || y != y2 ) {
-		putpixel( x, y, color );		
+    if( dx == 0 && dy == 0 ) {
+        putpixel( x1, y1, color );
+        return;
+    }
+
+    // The major axis moves on every step, and after k steps the minor axis has moved m = ceil( ( k * minor - e ) / major ) 
+    // times, where e is the starting error measured along the major axis. Solving that for the edges of the draw target 
+    // gives the range of steps which are inside it, and the state to start stepping from, so the part of the line outside 
+    // is never walked and the loop needs no bounds checks.
+    bool xmajor = dx > dy;
+    int64_t major = xmajor ? dx : dy;
+    int64_t minor = xmajor ? dy : dx;
+    int64_t e0 = xmajor ? err : -err;
+    int64_t mpos = xmajor ? x1 : y1;
+    int64_t msize = xmajor ? ctx->draw.width : ctx->draw.height;
+    int64_t npos = xmajor ? y1 : x1;
+    int64_t nsize = xmajor ? ctx->draw.height : ctx->draw.width;
+    bool mforward = ( xmajor ? sx : sy ) > 0;
+    bool nforward = ( xmajor ? sy : sx ) > 0;
+
+    int64_t k0 = 0;
+    int64_t k1 = major;
+    int64_t lo = mforward ? -mpos : mpos - ( msize - 1 );
+    int64_t hi = mforward ? msize - 1 - mpos : mpos;
+    k0 = lo > k0 ? lo : k0;
+    k1 = hi < k1 ? hi : k1;
+    lo = nforward ? -npos : npos - ( nsize - 1 );
+    hi = nforward ? nsize - 1 - npos : npos;
+    if( minor == 0 ) {
+        if( lo > 0 || hi < 0 ) return;
+    } else {
+        int64_t first = internals_floor_div( ( lo - 1 ) * major + e0, minor ) + 1;
+        int64_t last = internals_floor_div( hi * major + e0, minor );
+        k0 = first > k0 ? first : k0;
+        k1 = last < k1 ? last : k1;
+    }
+    if( k0 > k1 ) return;
+
+    int64_t m = -internals_floor_div( e0 - k0 * minor, major );
+    int64_t e = e0 - k0 * minor + m * major;
+    err = (int)( xmajor ? e : -e );
+    int x = (int)( xmajor ? x1 + sx * k0 : x1 + sx * m );
+    int y = (int)( xmajor ? y1 + sy * m : y1 + sy * k0 );
+    int const pitch = ctx->draw.pitch;
+    int ystart = y;
+    uint8_t* p = ctx->draw.buffer + x + y * pitch;
+    for( int64_t k = k0; ; ++k ) {
+        *p = color;
+        if( k == k1 ) break;
 		int e2 = err;
 		if( e2 > -dx ) { 
             err -= dy; 
-            x += sx; 
+            p += sx; 
         }
 		if( e2 < dy ) { 
             err += dx; 
-            y += sy; 
+            p += sy * pitch;
+            y += sy;
         }
 	}
-	putpixel( x, y, color );
+    internals_dirty( ctx->draw.buffer, ystart < y ? ystart : y, ( ystart < y ? y - ystart : ystart - y ) + 1 );
 }
 
 
 void rectangle( int x, int y, int w, int h ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
+    struct drawctx_t* ctx = internals_drawctx();
+    int color = ctx->color;
 	hline( x, y, w, color );
 	hline( x, y + h, w, color );
 	line( x, y, x, y + h );
@@ -1150,30 +4269,80 @@ void rectangle( int x, int y, int w, int h ) {
 }
 
 
+static void internals_bar( struct internals_draw_t const* draw, int x, int y, int w, int h, uint8_t color ) {
+    if( x < 0 ) {
+        w += x;
+        x = 0;
+    }
+    if( y < 0 ) {
+        h += y;
+        y = 0;
+    }
+    if( w > draw->width - x ) {
+        w = draw->width - x;
+    }
+    if( h > draw->height - y ) {
+        h = draw->height - y;
+    }
+    if( w <= 0 || h <= 0 ) return;
+    uint8_t* row = draw->buffer + x + y * draw->pitch;
+	for( int i = 0; i < h; ++i ) {
+		memset( row, color, w );
+        row += draw->pitch;
+	}
+    internals_dirty( draw->buffer, y, h );
+}
+
+
 void bar( int x, int y, int w, int h ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
-	for( int i = y; i < y + h; ++i ) {
-		hline( x, i, w, color );
-	}
+    struct drawctx_t* ctx = internals_drawctx();
+    uint8_t color = (uint8_t) ctx->color;
+    if( internals_deferring( ctx ) ) {
+        if( w <= 0 || h <= 0 || x >= ctx->draw.width || x + w <= 0 || y >= ctx->draw.height || y + h <= 0 ) {
+            return;
+        }
+        struct draw_command_t* command = internals_defer( DRAW_COMMAND_BAR, y, y + h );
+        if( command ) {
+            command->x = x;
+            command->y = y;
+            command->srcw = w;
+            command->srch = h;
+            command->color = color;
+            return;
+        }
+        internals_flush();
+    }
+    internals_bar( &ctx->draw, x, y, w, h, color );
 }
 
 
 void circle( int x, int y, int r ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    bool inside = false;
+    if( !internals_shape_bounds( &ctx->draw, x, y, r, r, &inside ) ) return;
+    bool clip = !inside;
+    uint8_t color = (uint8_t) ctx->color;
 	int f = 1 - r;
 	int dx = 0;
 	int dy = -2 * r;
 	int ix = 0;
 	int iy = r;
  
-	putpixel( x, y + r, color );
-	putpixel( x, y - r, color );
-	putpixel( x + r, y, color );
-	putpixel( x - r, y, color );
+	internals_plot( &ctx->draw, x, y + r, color, clip );
+	internals_plot( &ctx->draw, x, y - r, color, clip );
+	internals_plot( &ctx->draw, x + r, y, color, clip );
+	internals_plot( &ctx->draw, x - r, y, color, clip );
  
-	while( ix < iy )  {
+    // each octant has ix along one axis, so past this, none of them can be inside the draw target
+    int width = ctx->draw.width;
+    int height = ctx->draw.height;
+    int limit = x > width - 1 - x ? x : width - 1 - x;
+    limit = y > limit ? y : limit;
+    limit = height - 1 - y > limit ? height - 1 - y : limit;
+	while( ix < iy && ix <= limit )  {
 		if( f >= 0 ) {
 			--iy;
 			dy += 2;
@@ -1183,21 +4352,25 @@ void circle( int x, int y, int r ) {
 		dx += 2;
 		f += dx + 1;    
 
-		putpixel( x + ix, y + iy, color );
-		putpixel( x - ix, y + iy, color );
-		putpixel( x + ix, y - iy, color );
-		putpixel( x - ix, y - iy, color );
-		putpixel( x + iy, y + ix, color );
-		putpixel( x - iy, y + ix, color );
-		putpixel( x + iy, y - ix, color );
-		putpixel( x - iy, y - ix, color );
+		internals_plot( &ctx->draw, x + ix, y + iy, color, clip );
+		internals_plot( &ctx->draw, x - ix, y + iy, color, clip );
+		internals_plot( &ctx->draw, x + ix, y - iy, color, clip );
+		internals_plot( &ctx->draw, x - ix, y - iy, color, clip );
+		internals_plot( &ctx->draw, x + iy, y + ix, color, clip );
+		internals_plot( &ctx->draw, x - iy, y + ix, color, clip );
+		internals_plot( &ctx->draw, x + iy, y - ix, color, clip );
+		internals_plot( &ctx->draw, x - iy, y - ix, color, clip );
 	}
 }
 
 
 void fillcircle( int x, int y, int r ) {       
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    bool inside = false;
+    if( !internals_shape_bounds( &ctx->draw, x, y, r, r, &inside ) ) return;
+    uint8_t color = (uint8_t) ctx->color;
 	int f = 1 - r;
 	int dx = 0;
 	int dy = -2 * r;
@@ -1205,11 +4378,11 @@ void fillcircle( int x, int y, int r ) {
 	int iy = r;
  
 	while( ix <= iy )  {
-		hline( x - iy, y + ix, 2 * iy, color );
-		hline( x - iy, y - ix, 2 * iy, color );
+		internals_hspan( &ctx->draw, x - iy, y + ix, 2 * iy, color );
+		internals_hspan( &ctx->draw, x - iy, y - ix, 2 * iy, color );
 		if( f >= 0 ) {
-			hline( x - ix, y + iy, 2 * ix, color );
-			hline( x - ix, y - iy, 2 * ix, color );
+			internals_hspan( &ctx->draw, x - ix, y + iy, 2 * ix, color );
+			internals_hspan( &ctx->draw, x - ix, y - iy, 2 * ix, color );
 
 			--iy;
 			dy += 2;
@@ -1225,12 +4398,32 @@ void fillcircle( int x, int y, int r ) {
 
 void ellipse( int x, int y, int rx, int ry ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    bool inside = false;
+    rx = rx < 0 ? -rx : rx;
+    ry = ry < 0 ? -ry : ry;
+    if( !internals_shape_bounds( &ctx->draw, x, y, rx, ry, &inside ) ) return;
+    bool clip = !inside;
+    uint8_t color = (uint8_t) ctx->color;
+    if( rx == 0 || ry == 0 ) {
+        internals_flat_ellipse( &ctx->draw, x, y, rx, ry, color );
+        return;
+    }
 	int asq = rx * rx;
 	int bsq = ry * ry;
 
-	putpixel( x, y + ry, color );
-	putpixel( x, y - ry, color );
+	internals_plot( &ctx->draw, x, y + ry, color, clip );
+	internals_plot( &ctx->draw, x, y - ry, color, clip );
+
+    // the first half steps along x and the second along y, never past the radius, and past these limits all four 
+    // points are outside
+    int width = ctx->draw.width;
+    int height = ctx->draw.height;
+    int xlimit = x > width - 1 - x ? x : width - 1 - x;
+    int ylimit = y > height - 1 - y ? y : height - 1 - y;
+    xlimit = xlimit < rx ? xlimit : rx;
+    ylimit = ylimit < ry ? ylimit : ry;
 
 	int wx = 0;
 	int wy = ry;
@@ -1250,18 +4443,18 @@ void ellipse( int x, int y, int rx, int ry ) {
 		xa += bsq * 2;
 		++wx;
 
-		if( xa >= ya ) {
+		if( xa >= ya || wx > xlimit ) {
             break;
         }
 
-		putpixel( x + wx, y - wy, color );
-		putpixel( x - wx, y - wy, color );
-		putpixel( x + wx, y + wy, color );
-		putpixel( x - wx, y + wy, color );
+		internals_plot( &ctx->draw, x + wx, y - wy, color, clip );
+		internals_plot( &ctx->draw, x - wx, y - wy, color, clip );
+		internals_plot( &ctx->draw, x + wx, y + wy, color, clip );
+		internals_plot( &ctx->draw, x - wx, y + wy, color, clip );
 	}
 
-	putpixel( x + rx, y, color );
-	putpixel( x - rx, y, color );
+	internals_plot( &ctx->draw, x + rx, y, color, clip );
+	internals_plot( &ctx->draw, x - rx, y, color, clip );
 
 	wx = rx;
 	wy = 0;
@@ -1282,14 +4475,14 @@ void ellipse( int x, int y, int rx, int ry ) {
 		ya += asq * 2;
 		++wy;
 
-		if( ya > xa ) {
+		if( ya > xa || wy > ylimit ) {
             break;
         }
 
-		putpixel( x + wx, y - wy, color );
-		putpixel( x - wx, y - wy, color );
-		putpixel( x + wx, y + wy, color );
-		putpixel( x - wx, y + wy, color );
+		internals_plot( &ctx->draw, x + wx, y - wy, color, clip );
+		internals_plot( &ctx->draw, x - wx, y - wy, color, clip );
+		internals_plot( &ctx->draw, x + wx, y + wy, color, clip );
+		internals_plot( &ctx->draw, x - wx, y + wy, color, clip );
 	}
 }
 
@@ -1297,7 +4490,17 @@ void ellipse( int x, int y, int rx, int ry ) {
 
 void fillellipse( int x, int y, int rx, int ry ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    bool inside = false;
+    rx = rx < 0 ? -rx : rx;
+    ry = ry < 0 ? -ry : ry;
+    if( !internals_shape_bounds( &ctx->draw, x, y, rx, ry, &inside ) ) return;
+    uint8_t color = (uint8_t) ctx->color;
+    if( rx == 0 || ry == 0 ) {
+        internals_flat_ellipse( &ctx->draw, x, y, rx, ry, color );
+        return;
+    }
 	int asq = rx * rx;
 	int bsq = ry * ry;
 
@@ -1313,19 +4516,19 @@ void fillellipse( int x, int y, int rx, int ry ) {
 		if( thresh >= 0 )  {
 			ya -= asq * 2;
 			thresh -= ya;
-			hline( x - wx, y - wy, wx * 2, color );
-			hline( x - wx, y + wy, wx * 2, color );
+			internals_hspan( &ctx->draw, x - wx, y - wy, wx * 2, color );
+			internals_hspan( &ctx->draw, x - wx, y + wy, wx * 2, color );
 			--wy;
 		}
 
 		xa += bsq * 2;
 		++wx;
-		if( xa >= ya ) {
+		if( xa >= ya || wx > rx ) {
             break;
         }
 	}
 
-	hline( x - rx, y, rx * 2, color );
+	internals_hspan( &ctx->draw, x - rx, y, rx * 2, color );
 
 	wx = rx;
 	wy = 0;
@@ -1346,12 +4549,12 @@ void fillellipse( int x, int y, int rx, int ry ) {
 		ya += asq * 2;
 		++wy;
 
-		if( ya > xa ) {
+		if( ya > xa || wy > ry ) {
             break;
         }
 
-		hline( x - wx, y - wy, wx * 2, color );
-		hline( x - wx, y + wy, wx * 2, color );
+		internals_hspan( &ctx->draw, x - wx, y - wy, wx * 2, color );
+		internals_hspan( &ctx->draw, x - wx, y + wy, wx * 2, color );
 	}
 }
 
@@ -1365,59 +4568,421 @@ void drawpoly( int* points_xy, int count ) {
 }
 
 
+static bool internals_poly_reserve( struct internals_poly_scratch_t* poly, int count ) {
+    if( count <= poly->capacity ) {
+        return true;
+    }
+    int capacity = poly->capacity ? poly->capacity : 256;
+    while( capacity < count ) {
+        capacity *= 2;
+    }
+    struct internals_poly_edge_t* edges = (struct internals_poly_edge_t*) realloc( poly->edges, 
+        capacity * sizeof( struct internals_poly_edge_t ) );
+    if( !edges ) {
+        return false;
+    }
+    poly->edges = edges;
+    struct internals_poly_edge_t** active = (struct internals_poly_edge_t**) realloc( poly->active, 
+        capacity * sizeof( struct internals_poly_edge_t* ) );
+    if( !active ) {
+        return false;
+    }
+    poly->active = active;
+    poly->capacity = capacity;
+    return true;
+}
+
+
+static int internals_poly_edge_compare( void const* a, void const* b ) {
+    int ya = ( (struct internals_poly_edge_t const*) a )->y0;
+    int yb = ( (struct internals_poly_edge_t const*) b )->y0;
+    return ( ya > yb ) - ( ya < yb );
+}
+
+
+// Fills a polygon with the even-odd rule, using an active edge table. Pixels are filled when their center is inside, and
+// a center exactly on an edge counts as inside for left edges and outside for right edges, so polygons sharing an edge
+// neither overlap nor leave gaps. Edges are clipped vertically to the draw target before stepping, and spans 
+// horizontally. The points are moved up by dy rows, and the range of rows written to is added to miny, maxy.
+static void internals_fillpoly( struct internals_draw_t const* draw, struct internals_poly_scratch_t* poly, 
+    int const* points_xy, int count, int dy, int color, int* miny, int* maxy ) {
+
+    if( count < 3 || !internals_poly_reserve( poly, count ) ) return;
+    int const width = draw->width;
+    int const height = draw->height;
+    struct internals_poly_edge_t* edges = poly->edges;
+    int edge_count = 0;
+    for( int i = 0, j = count - 1; i < count; j = i++ ) {
+        // in 64 bits, as the differences between any two int coordinates need 33 bits, and 16 more in fixed point
+        int64_t xa = points_xy[ j * 2 + 0 ];
+        int64_t ya = (int64_t) points_xy[ j * 2 + 1 ] - dy;
+        int64_t xb = points_xy[ i * 2 + 0 ];
+        int64_t yb = (int64_t) points_xy[ i * 2 + 1 ] - dy;
+        if( ya == yb ) continue;
+        // always step downwards, so an edge shared by two polygons gives the same x on every scanline for both
+        if( ya > yb ) {
+            int64_t t = xa; xa = xb; xb = t;
+            t = ya; ya = yb; yb = t;
+        }
+        if( yb <= 0 || ya >= height ) continue;
+        struct internals_poly_edge_t* edge = &edges[ edge_count++ ];
+        edge->dx = ( ( xb - xa ) * 65536 ) / ( yb - ya );
+        edge->y0 = ya < 0 ? 0 : (int) ya;
+        edge->y1 = yb > height ? height : (int) yb;
+        edge->x = xa * 65536 + edge->dx / 2 + ( edge->y0 - ya ) * edge->dx;
+    }
+    if( edge_count < 2 ) return;
+    qsort( edges, (size_t) edge_count, sizeof( struct internals_poly_edge_t ), internals_poly_edge_compare );
+
+    struct internals_poly_edge_t** active = poly->active;
+    int active_count = 0;
+    int next = 0;
+    int64_t const right = (int64_t) width * 65536;
+    for( int y = edges[ 0 ].y0; y < height; ++y ) {
+        // drop the edges which ended above this scanline, and add the ones starting on it
+        int kept = 0;
+        for( int i = 0; i < active_count; ++i ) {
+            if( active[ i ]->y1 > y ) active[ kept++ ] = active[ i ];
+        }
+        active_count = kept;
+        if( active_count == 0 ) {
+            if( next >= edge_count ) break;
+            y = edges[ next ].y0;
+        }
+        while( next < edge_count && edges[ next ].y0 == y ) {
+            active[ active_count++ ] = &edges[ next++ ];
+        }
+
+        // the order along x changes little from one scanline to the next, so insertion sort is close to linear
+        for( int i = 1; i < active_count; ++i ) {
+            struct internals_poly_edge_t* edge = active[ i ];
+            int j = i;
+            while( j > 0 && active[ j - 1 ]->x > edge->x ) {
+                active[ j ] = active[ j - 1 ];
+                --j;
+            }
+            active[ j ] = edge;
+        }
+
+        uint8_t* row = draw->buffer + y * draw->pitch;
+        for( int i = 0; i + 1 < active_count; i += 2 ) {
+            int64_t xl = active[ i ]->x < 0 ? 0 : active[ i ]->x > right ? right : active[ i ]->x;
+            int64_t xr = active[ i + 1 ]->x < 0 ? 0 : active[ i + 1 ]->x > right ? right : active[ i + 1 ]->x;
+            // first and one past the last pixel whose center is at or right of the edge
+            int start = (int)( ( xl + 0x7fff ) >> 16 );
+            int end = (int)( ( xr + 0x7fff ) >> 16 );
+            if( end > start ) {
+                memset( row + start, color, end - start );
+                *miny = y < *miny ? y : *miny;
+                *maxy = y > *maxy ? y : *maxy;
+            }
+        }
+        for( int i = 0; i < active_count; ++i ) {
+            active[ i ]->x += active[ i ]->dx;
+        }
+    }
+}
+
+
+// Records a polygon, returning false if it could not be recorded and should be drawn immediately
+static bool internals_defer_poly( int const* points_xy, int count, int color ) {
+    if( count < 3 ) return true;
+    int top = points_xy[ 1 ];
+    int bottom = points_xy[ 1 ];
+    for( int i = 1; i < count; ++i ) {
+        int y = points_xy[ i * 2 + 1 ];
+        top = y < top ? y : top;
+        bottom = y > bottom ? y : bottom;
+    }
+    // the last scanline filled is the one above the lowest point
+    if( bottom <= 0 || top >= internals->drawctx.draw.height || top == bottom ) return true;
+    size_t data;
+    struct draw_command_t* command = NULL;
+    if( internals_defer_data( points_xy, count * 2 * sizeof( int ), &data ) ) {
+        command = internals_defer( DRAW_COMMAND_POLY, top, bottom );
+    }
+    if( !command ) {
+        internals_flush();
+        return false;
+    }
+    command->color = color;
+    command->data = data;
+    command->count = count;
+    return true;
+}
+
+
 void fillpoly( int* points_xy, int count ) {
-    #define MAX_POLYGON_POINTS 256
-	static int node_x[ MAX_POLYGON_POINTS ];
+    if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    if( internals_deferring( ctx ) && internals_defer_poly( points_xy, count, ctx->color ) ) return;
+    int miny = ctx->draw.height;
+    int maxy = -1;
+    internals_fillpoly( &ctx->draw, &ctx->poly, points_xy, count, 0, 
+        (uint8_t) ctx->color, &miny, &maxy );
+    if( maxy >= miny ) {
+        internals_dirty( ctx->draw.buffer, miny, maxy - miny + 1 );
+    }
+}
+
 
+void fillpolys( int* points_xy, int* counts, int* colors, int polycount ) {
     if( internals->screen.font ) return;
+    struct drawctx_t* ctx = internals_drawctx();
+    int miny = ctx->draw.height;
+    int maxy = -1;
+    for( int i = 0; i < polycount; ++i ) {
+        if( counts[ i ] <= 0 ) continue;
+        int color = colors ? colors[ i ] : ctx->color;
+        if( !internals_deferring( ctx ) || !internals_defer_poly( points_xy, counts[ i ], (uint8_t) color ) ) {
+            internals_fillpoly( &ctx->draw, &ctx->poly, points_xy, counts[ i ], 0, (uint8_t) color, 
+                &miny, &maxy );
+        }
+        points_xy += counts[ i ] * 2;
+    }
+    if( maxy >= miny ) {
+        internals_dirty( ctx->draw.buffer, miny, maxy - miny + 1 );
+    }
+}
+
+
+// Draws the commands touching one band of rows, in the order they were recorded, to a draw target covering only that
+// band, so nothing outside of it is touched
+static void internals_draw_band( struct internals_draw_worker_t* worker, int band ) {
+    struct internals_deferred_t* deferred = &internals->deferred;
+    struct internals_draw_bin_t const* bin = &deferred->bins[ band ];
+    int top = band * deferred->band_height;
+    int bottom = top + deferred->band_height;
+    bottom = bottom > internals->drawctx.draw.height ? internals->drawctx.draw.height : bottom;
+    struct internals_draw_t draw;
+    draw.buffer = internals->drawctx.draw.buffer + top * internals->drawctx.draw.pitch;
+    draw.width = internals->drawctx.draw.width;
+    draw.height = bottom - top;
+    draw.pitch = internals->drawctx.draw.pitch;
+    for( int i = 0; i < bin->count; ++i ) {
+        struct draw_command_t const* command = &deferred->commands[ bin->commands[ i ] ];
+        switch( command->type ) {
+            case DRAW_COMMAND_BLIT: {
+                internals_blit( &draw, command->x, command->y - top, (uint8_t const*) command->source, command->width, 
+                    command->height, command->pitch, command->srcx, command->srcy, command->srcw, command->srch );
+            } break;
+            case DRAW_COMMAND_MASKBLIT: {
+                internals_maskblit( &draw, command->x, command->y - top, (uint8_t const*) command->source, 
+                    command->width, command->height, command->pitch, command->srcx, command->srcy, command->srcw, 
+                    command->srch, command->key );
+            } break;
+            case DRAW_COMMAND_BAR: {
+                internals_bar( &draw, command->x, command->y - top, command->srcw, command->srch, 
+                    (uint8_t) command->color );
+            } break;
+            case DRAW_COMMAND_POLY: {
+                int miny = draw.height;
+                int maxy = -1;
+                internals_fillpoly( &draw, &worker->poly, (int const*)( deferred->data + command->data ), 
+                    command->count, top, command->color, &miny, &maxy );
+            } break;
+            case DRAW_COMMAND_SPRITE: {
+                internals_drawsprite( &draw, command->x, command->y - top, (struct sprite_t const*) command->source, 
+                    command->color, command->key );
+            } break;
+            case DRAW_COMMAND_TEXT: {
+                internals_textblit( &draw, -top, internals->drawctx.draw.height - top, 
+                    (pixelfont_t const*) command->source, command->x, command->y - top, 
+                    (char const*)( deferred->data + command->data ), command->color, command->key, 
+                    (pixelfont_align_t) command->srch, command->srcw, command->count & 1, ( command->count >> 1 ) & 1, 
+                    ( command->count >> 2 ) & 1 );
+            } break;
+        }
+    }
+}
+
+
+static void internals_draw_bands( struct internals_draw_worker_t* worker ) {
+    for( ; ; ) {
+        int band = thread_atomic_int_inc( &internals->deferred.next_band );
+        if( band >= internals->deferred.bands ) {
+            break;
+        }
+        if( internals->deferred.bins[ band ].count > 0 ) {
+            internals_draw_band( worker, band );
+        }
+    }
+}
 
-    if( count <= 0 || count > MAX_POLYGON_POINTS ) {
+
+static int internals_draw_worker_proc( void* user_data ) {
+    struct internals_draw_worker_t* worker = (struct internals_draw_worker_t*) user_data;
+    for( ; ; ) {
+        thread_signal_wait( &worker->start, -1 );
+        if( thread_atomic_int_load( &internals->deferred.exit_flag ) ) {
+            break;
+        }
+        internals_draw_bands( worker );
+        if( thread_atomic_int_dec( &internals->deferred.busy ) == 1 ) {
+            thread_signal_raise( &internals->deferred.done );
+        }
+    }
+    return 0;
+}
+
+
+// Draws the recorded commands. The functions working on the whole screen call this whichever context is set, as they
+// are meant for the thread drawing with the default context.
+static void internals_flush( void ) {
+    struct internals_deferred_t* deferred = &internals->deferred;
+    if( deferred->count == 0 ) {
         return;
     }
 
-    int color = internals->graphics.color;
+    // Only as many workers are woken as there are bands to draw, besides the one drawn by this thread
+    int bands = 0;
+    for( int i = 0; i < deferred->bands; ++i ) {
+        bands += deferred->bins[ i ].count > 0 ? 1 : 0;
+    }
+    int helpers = bands - 1 < deferred->threads - 1 ? bands - 1 : deferred->threads - 1;
+    thread_atomic_int_store( &deferred->next_band, 0 );
+    thread_atomic_int_store( &deferred->busy, helpers );
+    for( int i = 1; i <= helpers; ++i ) {
+        thread_signal_raise( &deferred->workers[ i ].start );
+    }
+    internals_draw_bands( &deferred->workers[ 0 ] );
+    while( thread_atomic_int_load( &deferred->busy ) > 0 ) {
+        thread_signal_wait( &deferred->done, 1000 );
+    }
 
-    int min_y = points_xy[ 0 + 1 ];
-	int max_y = min_y;
+    // Rows are only marked dirty once drawn, so they can't be picked up for display before that
+    internals_dirty( internals->drawctx.draw.buffer, deferred->top, deferred->bottom - deferred->top );
+    for( int i = 0; i < deferred->bands; ++i ) {
+        deferred->bins[ i ].count = 0;
+    }
+    deferred->count = 0;
+    deferred->data_size = 0;
+    for( int i = 0; i < deferred->retired_count; ++i ) {
+        free( deferred->retired[ i ] );
+    }
+    deferred->retired_count = 0;
+}
 
-	// find extents
-	for( int i = 1; i < count; ++i ) {
-		if( points_xy[ i * 2 + 1 ] < min_y ) min_y = points_xy[ i * 2 + 1 ];
-		if( points_xy[ i * 2 + 1 ] > max_y ) max_y = points_xy[ i * 2 + 1 ];
-	}
+void flushdraw( void ) {
+    internals_flushdraw( internals_drawctx() );
+}
 
-	for( int y = min_y; y < max_y; ++y )  {
-		//  find intersection points_xy
-		int nodes = 0; 
-		int j = count - 1;
-		for( int i = 0; i < count; ++i ) {
-			if( ( points_xy[ i * 2 + 1 ] <= y && points_xy[ j * 2 + 1 ] > y ) || 
-				( points_xy[ j * 2 + 1 ] <= y && points_xy[ i * 2 + 1 ] > y ) ) {
-			
-                int dx = points_xy[ j * 2 + 0 ] - points_xy[ i * 2 + 0 ];
-				int dy = points_xy[ j * 2 + 1 ] - points_xy[ i * 2 + 1 ];
-				node_x[ nodes++ ] = points_xy[ i * 2 + 0 ] + ( ( y - points_xy[ i * 2 + 1 ] ) * dx ) / dy ; 
-			}
-			j = i; 
-		}
 
-		// sort by x
-		int xi = 0;
-		while( xi < nodes - 1 )  {
-			if( node_x[ xi ] > node_x[ xi + 1 ] ) {
-				int swap = node_x[ xi ]; 
-				node_x[ xi ] = node_x[ xi + 1 ]; 
-				node_x[ xi + 1 ] = swap; 
-				if( xi ) --xi; 
-			} else {
-				++xi; 
-			}
-		}
 
-		for( int i = 0; i < nodes; i += 2 ) {
-			hline( node_x[ i ], y, node_x[ i + 1 ] - node_x[ i ], color );
+static void internals_stop_draw_threads( void ) {
+    struct internals_deferred_t* deferred = &internals->deferred;
+    thread_atomic_int_store( &deferred->exit_flag, 1 );
+    for( int i = 1; i < deferred->threads; ++i ) {
+        thread_signal_raise( &deferred->workers[ i ].start );
+    }
+    for( int i = 1; i < deferred->threads; ++i ) {
+        thread_join( deferred->workers[ i ].thread );
+        thread_destroy( deferred->workers[ i ].thread );
+        thread_signal_term( &deferred->workers[ i ].start );
+        deferred->workers[ i ].thread = NULL;
+    }
+    thread_atomic_int_store( &deferred->exit_flag, 0 );
+    deferred->threads = 0;
+}
+
+
+void setdrawthreads( int threads ) {
+    internals_flush();
+    internals_stop_draw_threads();
+    threads = threads < 0 ? 0 : threads > INTERNALS_DRAW_THREADS_MAX ? INTERNALS_DRAW_THREADS_MAX : threads;
+    #ifdef __wasm__
+        // without threads, the commands are still recorded, but drawn by the user thread alone
+        threads = threads > 1 ? 1 : threads;
+    #endif
+    struct internals_deferred_t* deferred = &internals->deferred;
+    deferred->threads = threads > 0 ? 1 : 0;
+    for( int i = 1; i < threads; ++i ) {
+        struct internals_draw_worker_t* worker = &deferred->workers[ i ];
+        thread_signal_init( &worker->start );
+        worker->thread = thread_create( internals_draw_worker_proc, worker, THREAD_STACK_SIZE_DEFAULT );
+        if( !worker->thread ) {
+            thread_signal_term( &worker->start );
+            break;
         }
-	}
+        deferred->threads = i + 1;
+    }
+}
+
+
+struct drawctx_t* makedrawctx( void ) {
+    struct drawctx_t* ctx = (struct drawctx_t*) malloc( sizeof( struct drawctx_t ) );
+    if( !ctx ) return NULL;
+    memset( ctx, 0, sizeof( *ctx ) );
+    ctx->color = 15;
+    ctx->current_font = DEFAULT_FONT_8X8;
+    return ctx;
+}
+
+
+void freedrawctx( struct drawctx_t* ctx ) {
+    if( !ctx || ctx == &internals->drawctx ) return;
+    if( internals_drawctx() == ctx ) {
+        setdrawctx( NULL );
+    }
+    free( ctx->fill_stack );
+    free( ctx->poly.edges );
+    free( ctx->poly.active );
+    free( ctx );
+}
+
+
+void setdrawctx( struct drawctx_t* ctx ) {
+    ctx = ctx == &internals->drawctx ? NULL : ctx;
+    #ifdef __wasm__
+        internals->wasm.drawctx = ctx;
+    #else
+        thread_tls_set( internals->drawctx_tls, ctx );
+    #endif
+}
+
+
+// Whether a pixel stops the fill: for a flood fill any pixel other than the seed value, for a boundary fill the boundary
+// or the fill color itself
+static bool internals_fill_stop( uint8_t pixel, int value, int color, bool flood ) {
+    return flood ? pixel != value : ( pixel == value || pixel == color );
+}
+
+
+// Same test for eight pixels at once, true if any of them stops the fill
+static bool internals_fill_stop8( uint8_t const* pixels, uint64_t value, uint64_t color, bool flood ) {
+    uint64_t const ones = 0x0101010101010101ull;
+    uint64_t const high = 0x8080808080808080ull;
+    uint64_t p;
+    memcpy( &p, pixels, 8 );
+    if( flood ) {
+        return ( p ^ value ) != 0;
+    }
+    uint64_t a = p ^ value;
+    uint64_t b = p ^ color;
+    return ( ( ( ( a - ones ) & ~a ) | ( ( b - ones ) & ~b ) ) & high ) != 0;
+}
+
+
+// If the stack can't grow, the segment is dropped and the fill is left incomplete, same as running out of stack before
+static void internals_fill_push( struct drawctx_t* ctx, int* count, int y, int xl, int xr, int dy ) {
+    if( y + dy < 0 || y + dy >= ctx->draw.height ) {
+        return;
+    }
+    if( *count >= ctx->fill_capacity ) {
+        int capacity = ctx->fill_capacity ? ctx->fill_capacity * 2 : 1024;
+        struct internals_fill_segment_t* stack = (struct internals_fill_segment_t*) realloc( 
+            ctx->fill_stack, capacity * sizeof( struct internals_fill_segment_t ) );
+        if( !stack ) {
+            return;
+        }
+        ctx->fill_stack = stack;
+        ctx->fill_capacity = capacity;
+    }
+    struct internals_fill_segment_t* segment = &ctx->fill_stack[ ( *count )++ ];
+    segment->y = y;
+    segment->xl = xl;
+    segment->xr = xr;
+    segment->dy = dy;
 }
 
 
@@ -1437,6 +5002,9 @@ void fillpoly( int* points_xy, int count ) {
  * with the same pixel value to the new pixel value nv.
  * A 4-connected neighbor is a pixel above, below, left, or right of a pixel.
  *
+ * Adapted to read the rows of the draw target directly, scan for the edges of each span eight pixels at a time, fill 
+ * spans with memset, and keep the segment stack on the heap so large fills are never cut short.
+ *
  * LICENSE
  * The Graphics Gems code is copyright-protected. In other words, you cannot 
  * claim the text of the code as your own and resell it. Using the code is 
@@ -1447,120 +5015,70 @@ void fillpoly( int* points_xy, int count ) {
  * held responsible. Basically, don't be a jerk, and remember that anything 
  * free comes with no guarantee.
  */
-
-void floodfill( int x, int y ) {
-	#define FILLMAX 10000		/* FILLMAX depth of stack */
-
-	#define FILLPUSH( Y, XL, XR, DY )	/* FILLPUSH new segment on stack */ \
-		if( sp < stack + FILLMAX && Y + ( DY ) >= 0 && Y + ( DY ) < internals->draw.height ) \
-		    { sp->y = Y; sp->xl = XL; sp->xr = XR; sp->dy = DY; ++sp; }
-
-	#define FILLPOP( Y, XL, XR, DY )	/* FILLPOP segment off stack */ \
-		{ --sp; Y = sp->y + ( DY = sp->dy ); XL = sp->xl; XR = sp->xr; }
-
+static void internals_fill( int x, int y, int boundary, bool flood ) {
     if( internals->screen.font ) return;
-    int color = internals->graphics.color;
-
-    /*
-	 * Filled horizontal segment of scanline y for xl<=x<=xr.
-	 * Parent segment was on line y-dy.  dy=1 or -1
-	 */
-	struct segment_t { int y, xl, xr, dy; };
-
-	int l, x1, x2, dy;
-	int ov;	/* old pixel value */
-	struct segment_t stack[ FILLMAX ], *sp = stack;	/* stack of filled segments */
-
-	ov = getpixel( x, y );		/* read pv at seed point */
-	if( ov == color || x < 0 || x >= internals->draw.width || y < 0 || y >= internals->draw.height ) return;
-	FILLPUSH( y, x, x, 1 );			/* needed in some cases */
-	FILLPUSH( y + 1, x, x, -1 );		/* seed segment (FILLPOPped 1st) */
-
-	while( sp > stack ) {
-		/* FILLPOP segment off stack and fill a neighboring scan line */
-		FILLPOP( y, x1, x2, dy );
-		/*
-		 * segment of scan line y-dy for x1<=x<=x2 was previously filled,
-		 * now explore adjacent pixels in scan line y
-		 */
-		int xs;
-		for( x = x1; x >= 0 && getpixel( x, y ) == ov; --x ) /* nothing */;
-		hline( x + 1, y, x1 - x, color );
-		if( x >= x1 ) goto skip;
-		l = x + 1;
-		if( l < x1 ) FILLPUSH( y, l, x1 - 1, -dy );		/* leak on left? */
-		x = x1 + 1;
-		do {
-			xs = x;
-			for( ; x < internals->draw.width && getpixel( x, y ) == ov; ++x ) /* nothing */;
-			hline( xs, y, x - xs, color );	
-			FILLPUSH( y, l, x - 1, dy);
-			if( x > x2 + 1 ) FILLPUSH( y, x2 + 1, x - 1, -dy);	/* leak on right? */
-		skip:
-			for( x++; x <= x2 && getpixel( x, y ) != ov; ++x );
-			l = x;
-		} while( x <= x2 );
-	}
-
-    #undef FILLMAX
+    struct drawctx_t* ctx = internals_drawctx();
+    internals_flushdraw( ctx );
+    int const width = ctx->draw.width;
+    int const pitch = ctx->draw.pitch;
+    if( x < 0 || x >= width || y < 0 || y >= ctx->draw.height ) return;
+    uint8_t* buffer = ctx->draw.buffer;
+    int const color = (uint8_t) ctx->color;
+    int const value = flood ? buffer[ x + y * pitch ] : (uint8_t) boundary;
+    if( flood ? value == color : internals_fill_stop( buffer[ x + y * pitch ], value, color, false ) ) return;
+    uint64_t const value8 = 0x0101010101010101ull * (uint8_t) value;
+    uint64_t const color8 = 0x0101010101010101ull * (uint8_t) color;
+
+    int count = 0;
+    internals_fill_push( ctx, &count, y, x, x, 1 ); // needed in some cases
+    internals_fill_push( ctx, &count, y + 1, x, x, -1 ); // seed segment (popped 1st)
+
+    int miny = y;
+    int maxy = y;
+    int l, x1, x2, dy, xs;
+    while( count > 0 ) {
+        // pop segment off stack and fill a neighboring scan line
+        struct internals_fill_segment_t* segment = &ctx->fill_stack[ --count ];
+        dy = segment->dy;
+        y = segment->y + dy;
+        x1 = segment->xl;
+        x2 = segment->xr;
+        uint8_t* row = buffer + y * pitch;
+        miny = y < miny ? y : miny;
+        maxy = y > maxy ? y : maxy;
+
+        // segment of scan line y - dy for x1 <= x <= x2 was previously filled, now explore adjacent pixels in scan line y
+        x = x1;
+        while( x >= 7 && !internals_fill_stop8( row + x - 7, value8, color8, flood ) ) x -= 8;
+        while( x >= 0 && !internals_fill_stop( row[ x ], value, color, flood ) ) --x;
+        if( x >= x1 ) goto skip;
+        memset( row + x + 1, color, x1 - x );
+        l = x + 1;
+        if( l < x1 ) internals_fill_push( ctx, &count, y, l, x1 - 1, -dy ); // leak on left?
+        x = x1 + 1;
+        do {
+            xs = x;
+            while( x + 8 <= width && !internals_fill_stop8( row + x, value8, color8, flood ) ) x += 8;
+            while( x < width && !internals_fill_stop( row[ x ], value, color, flood ) ) ++x;
+            memset( row + xs, color, x - xs );
+            internals_fill_push( ctx, &count, y, l, x - 1, dy );
+            if( x > x2 + 1 ) internals_fill_push( ctx, &count, y, x2 + 1, x - 1, -dy ); // leak on right?
+        skip:
+            for( ++x; x <= x2 && internals_fill_stop( row[ x ], value, color, flood ); ++x ) /* nothing */;
+            l = x;
+        } while( x <= x2 );
+    }
+    internals_dirty( buffer, miny, maxy - miny + 1 );
 }
 
 
-void boundaryfill( int x, int y, int boundary ) {
-	#define FILLMAX 10000		/* FILLMAX depth of stack */
-
-	#define FILLPUSH( Y, XL, XR, DY )	/* FILLPUSH new segment on stack */ \
-		if( sp < stack + FILLMAX && Y + ( DY ) >= 0 && Y + ( DY ) < internals->draw.height ) \
-		    { sp->y = Y; sp->xl = XL; sp->xr = XR; sp->dy = DY; ++sp; }
-
-	#define FILLPOP( Y, XL, XR, DY )	/* FILLPOP segment off stack */ \
-		{ --sp; Y = sp->y + ( DY = sp->dy ); XL = sp->xl; XR = sp->xr; }
+void floodfill( int x, int y ) {
+    internals_fill( x, y, 0, true );
+}
 
-    if( internals->screen.font ) return;
-    int color = internals->graphics.color;
-
-    /*
-	 * Filled horizontal segment of scanline y for xl<=x<=xr.
-	 * Parent segment was on line y-dy.  dy=1 or -1
-	 */
-	struct segment_t { int y, xl, xr, dy; };
-
-	int l, x1, x2, dy;
-	int ov;	/* old pixel value */
-	struct segment_t stack[ FILLMAX ], *sp = stack;	/* stack of filled segments */
-
-	ov = boundary;
-	if( x < 0 || x >= internals->draw.width || y < 0 || y >= internals->draw.height ) return;
-	FILLPUSH( y, x, x, 1 );			/* needed in some cases */
-	FILLPUSH( y + 1, x, x, -1 );		/* seed segment (FILLPOPped 1st) */
-
-	while( sp > stack ) {
-		/* FILLPOP segment off stack and fill a neighboring scan line */
-		FILLPOP( y, x1, x2, dy );
-		/*
-		 * segment of scan line y-dy for x1<=x<=x2 was previously filled,
-		 * now explore adjacent pixels in scan line y
-		 */
-		int xs;
-		for( x = x1; x >= 0 && getpixel( x, y ) != ov; --x ) /* nothing */;
-		hline( x + 1, y, x1 - x, color );
-		if( x >= x1 ) goto skip;
-		l = x + 1;
-		if( l < x1 ) FILLPUSH( y, l, x1 - 1, -dy );		/* leak on left? */
-		x = x1 + 1;
-		do {
-			xs = x;
-			for( ; x < internals->draw.width && getpixel( x, y ) != ov; ++x ) /* nothing */;
-			hline( xs, y, x - xs, color );	
-			FILLPUSH( y, l, x - 1, dy);
-			if( x > x2 + 1 ) FILLPUSH( y, x2 + 1, x - 1, -dy);	/* leak on right? */
-		skip:
-			for( x++; x <= x2 && getpixel( x, y ) == ov; ++x );
-			l = x;
-		} while( x <= x2 );
-	}
 
-    #undef FILLMAX
+void boundaryfill( int x, int y, int boundary ) {
+    internals_fill( x, y, boundary, false );
 }
 
 
@@ -1574,7 +5092,10 @@ void cputs( char const* string ) {
         ch |= ( internals->conio.fg & 0xf ) << 8;
         ch |= ( internals->conio.bg & 0xf ) << 12;
 
-        ( (uint16_t*)internals->screen.buffer )[ internals->conio.x + internals->conio.y * internals->screen.width ] = ch;
+        int x = ( internals->screen.view_x + internals->conio.x ) % internals->screen.virtual_width;
+        int y = ( internals->screen.view_y + internals->conio.y ) % internals->screen.virtual_height;
+        ( (uint16_t*)internals->screen.buffer )[ x + y * internals->screen.virtual_width ] = ch;
+        internals_dirty( internals->screen.buffer, y, 1 );
 
         ++internals->conio.x;
         if( internals->conio.x >= internals->screen.width ) {
@@ -1598,63 +5119,252 @@ void curson( void ) {
 }
 
 
-void cursoff( void ) {
-    if( !internals->screen.font ) return;
-    internals->conio.curs = 0;
-}
+void cursoff( void ) {
+    if( !internals->screen.font ) return;
+    internals->conio.curs = 0;
+}
+
+
+void gotoxy( int x, int y ) {
+    if( !internals->screen.font ) return;
+    internals->conio.x = x;
+    internals->conio.y = y;
+}
+
+
+int wherex( void ) {
+    if( !internals->screen.font ) return 0;
+    return internals->conio.x;
+}
+
+
+int wherey( void ) {
+    if( !internals->screen.font ) return 0;
+    return internals->conio.y;
+}
+
+
+void textcolor( int color ) {
+    if( !internals->screen.font ) return;
+    internals->conio.fg = color < 0 ? 0 : color > 15 ? 15 : color;
+}
+
+
+void textbackground( int color ) {
+    if( !internals->screen.font ) return;
+    internals->conio.bg = color < 0 ? 0 : color > 15 ? 15 : color;
+}
+
+
+void clrscr( void ) {
+    if( !internals->screen.font ) return;
+    uint16_t* p = ( (uint16_t*)internals->screen.buffer );
+    uint16_t c = (uint16_t) ' ';
+    c |= ( internals->conio.fg & 0xf ) << 8;
+    c |= ( internals->conio.bg & 0xf ) << 12;
+    for( int y = 0; y < internals->screen.virtual_height; ++y ) {
+        for( int x = 0; x < internals->screen.virtual_width; ++x ) {
+            *p++ = c;
+        }
+    }
+    internals_dirty( internals->screen.buffer, 0, internals->screen.virtual_height );
+}
+
+
+int keystate( enum keycode_t key ) {
+    int index = (int) key;
+    if( index >= 0 && index < KEYCOUNT ) {
+        return internals->input.keystate[ index ];
+    }
+    return false;
+}
+
+
+// Called on the present thread only
+static void internals_write_event( struct inputevent_t const* event ) {
+    unsigned int head = (unsigned int) thread_atomic_int_load( &internals->input.events_head );
+    internals->input.events[ head % INTERNALS_EVENTS_COUNT ] = *event;
+    thread_atomic_int_store( &internals->input.events_head, (int)( head + 1 ) );
+}
+
+
+// Copies events written since the position `cursor`, and advances it. The slot of an event is reused once the writer 
+// is INTERNALS_EVENTS_COUNT events ahead, so events which were (or might have been, while we were copying them) 
+// overwritten are dropped.
+static int internals_read_events( int* cursor, struct inputevent_t* events, int capacity ) {
+    unsigned int head = (unsigned int) thread_atomic_int_load( &internals->input.events_head );
+    unsigned int first = (unsigned int) *cursor;
+    if( head - first > INTERNALS_EVENTS_COUNT ) {
+        first = head - INTERNALS_EVENTS_COUNT;
+    }
+    unsigned int count = head - first;
+    if( count > (unsigned int) capacity ) {
+        count = (unsigned int) capacity;
+    }
+    for( unsigned int i = 0; i < count; ++i ) {
+        events[ i ] = internals->input.events[ ( first + i ) % INTERNALS_EVENTS_COUNT ];
+    }
+    head = (unsigned int) thread_atomic_int_load( &internals->input.events_head );
+    if( head - first >= INTERNALS_EVENTS_COUNT ) {
+        unsigned int lost = head - first - INTERNALS_EVENTS_COUNT + 1;
+        if( lost > count ) {
+            lost = count;
+        }
+        memmove( events, events + lost, ( count - lost ) * sizeof( *events ) );
+        first += lost;
+        count -= lost;
+    }
+    *cursor = (int)( first + count );
+    return (int) count;
+}
+
+
+// Input recording (--record) and replay (--replay). After an eight byte header, the file holds a block for each frame
+// which had any input: the number of vblanks since the previous block, flags (1: mouse position follows, 2: relative
+// mouse movement follows), the number of events, the mouse values and then the events, with their times stored as the
+// difference from the previous event. All values are LEB128 variable length numbers, zigzag encoded if signed.
+#define INTERNALS_INPUTLOG_HEADER "DOSINPT1"
+
+struct internals_inputlog_t {
+    FILE* record;
+    uint8_t* replay;
+    size_t replay_size;
+    size_t replay_pos;
+    int frame; // frame of the previous block
+    uint64_t time; // time of the previous event
+    int mouse_x;
+    int mouse_y;
+};
 
 
-void gotoxy( int x, int y ) {
-    if( !internals->screen.font ) return;
-    internals->conio.x = x;
-    internals->conio.y = y;
+static void internals_inputlog_put( FILE* file, uint64_t value ) {
+    while( value >= 0x80 ) {
+        fputc( (int)( ( value & 0x7f ) | 0x80 ), file );
+        value >>= 7;
+    }
+    fputc( (int) value, file );
 }
 
 
-int wherex( void ) {
-    if( !internals->screen.font ) return 0;
-    return internals->conio.x;
+static void internals_inputlog_put_signed( FILE* file, int value ) {
+    internals_inputlog_put( file, value < 0 ? ( (uint64_t)( -(int64_t) value ) << 1 ) - 1 : (uint64_t) value << 1 );
 }
 
 
-int wherey( void ) {
-    if( !internals->screen.font ) return 0;
-    return internals->conio.y;
+static uint64_t internals_inputlog_get( struct internals_inputlog_t* log ) {
+    uint64_t value = 0;
+    for( int shift = 0; shift < 64 && log->replay_pos < log->replay_size; shift += 7 ) {
+        uint8_t byte = log->replay[ log->replay_pos++ ];
+        value |= (uint64_t)( byte & 0x7f ) << shift;
+        if( !( byte & 0x80 ) ) {
+            break;
+        }
+    }
+    return value;
 }
 
 
-void textcolor( int color ) {
-    if( !internals->screen.font ) return;
-    internals->conio.fg = color < 0 ? 0 : color > 15 ? 15 : color;
+static int internals_inputlog_get_signed( struct internals_inputlog_t* log ) {
+    uint64_t value = internals_inputlog_get( log );
+    return ( value & 1 ) ? -(int)( ( value + 1 ) >> 1 ) : (int)( value >> 1 );
 }
 
 
-void textbackground( int color ) {
-    if( !internals->screen.font ) return;
-    internals->conio.bg = color < 0 ? 0 : color > 15 ? 15 : color;
+// Writes the input of a frame: the events from `first_event` up to `end_event` in the event ring, and the mouse state
+static void internals_inputlog_record( struct internals_inputlog_t* log, int frame, unsigned int first_event, 
+    unsigned int end_event, int mouse_x, int mouse_y, int relx, int rely ) {
+
+    if( end_event - first_event > INTERNALS_EVENTS_COUNT ) {
+        first_event = end_event - INTERNALS_EVENTS_COUNT;
+    }
+    int flags = ( mouse_x != log->mouse_x || mouse_y != log->mouse_y ? 1 : 0 ) | ( relx || rely ? 2 : 0 );
+    if( !flags && first_event == end_event ) {
+        return;
+    }
+    FILE* file = log->record;
+    internals_inputlog_put( file, (uint64_t)( frame - log->frame ) );
+    internals_inputlog_put( file, (uint64_t) flags );
+    internals_inputlog_put( file, end_event - first_event );
+    if( flags & 1 ) {
+        internals_inputlog_put_signed( file, mouse_x );
+        internals_inputlog_put_signed( file, mouse_y );
+    }
+    if( flags & 2 ) {
+        internals_inputlog_put_signed( file, relx );
+        internals_inputlog_put_signed( file, rely );
+    }
+    for( unsigned int i = first_event; i != end_event; ++i ) {
+        struct inputevent_t const* event = &internals->input.events[ i % INTERNALS_EVENTS_COUNT ];
+        internals_inputlog_put( file, (uint64_t) event->type );
+        internals_inputlog_put( file, event->time - log->time );
+        log->time = event->time;
+        if( event->type == inputevent_keydown || event->type == inputevent_keyup ) {
+            internals_inputlog_put( file, (uint64_t) event->key );
+        } else if( event->type == inputevent_char ) {
+            internals_inputlog_put( file, (uint8_t) event->chr );
+        } else {
+            internals_inputlog_put_signed( file, event->x );
+            internals_inputlog_put_signed( file, event->y );
+        }
+    }
+    log->frame = frame;
+    log->mouse_x = mouse_x;
+    log->mouse_y = mouse_y;
 }
 
 
-void clrscr( void ) {
-    if( !internals->screen.font ) return;
-    uint16_t* p = ( (uint16_t*)internals->screen.buffer );
-    uint16_t c = (uint16_t) ' ';
-    c |= ( internals->conio.fg & 0xf ) << 8;
-    c |= ( internals->conio.bg & 0xf ) << 12;
-    for( int y = 0; y < screenheight(); ++y ) {
-        for( int x = 0; x < screenwidth(); ++x ) {
-            *p++ = c;
+// Writes the recorded events of the frame `frame` (and of any earlier ones not yet replayed) to the event ring, and 
+// updates the key states and the relative mouse movement the same way live input would. The mouse position is left
+// in `log` for the caller.
+static void internals_inputlog_replay( struct internals_inputlog_t* log, int frame, bool* keystate, 
+    float* relx, float* rely ) {
+
+    while( log->replay_pos < log->replay_size ) {
+        size_t block_pos = log->replay_pos;
+        int block_frame = log->frame + (int) internals_inputlog_get( log );
+        if( block_frame > frame ) {
+            log->replay_pos = block_pos;
+            break;
+        }
+        log->frame = block_frame;
+        int flags = (int) internals_inputlog_get( log );
+        int count = (int) internals_inputlog_get( log );
+        if( flags & 1 ) {
+            log->mouse_x = internals_inputlog_get_signed( log );
+            log->mouse_y = internals_inputlog_get_signed( log );
+        }
+        if( flags & 2 ) {
+            *relx = (float) internals_inputlog_get_signed( log );
+            *rely = (float) internals_inputlog_get_signed( log );
+        }
+        for( int i = 0; i < count; ++i ) {
+            struct inputevent_t event;
+            memset( &event, 0, sizeof( event ) );
+            event.type = (enum inputevent_type_t) internals_inputlog_get( log );
+            log->time += internals_inputlog_get( log );
+            event.time = log->time;
+            if( event.type == inputevent_keydown || event.type == inputevent_keyup ) {
+                event.key = (enum keycode_t) internals_inputlog_get( log );
+                if( (int) event.key >= 0 && (int) event.key < KEYCOUNT ) {
+                    keystate[ event.key ] = event.type == inputevent_keydown;
+                }
+            } else if( event.type == inputevent_char ) {
+                event.chr = (char)(uint8_t) internals_inputlog_get( log );
+            } else {
+                event.x = internals_inputlog_get_signed( log );
+                event.y = internals_inputlog_get_signed( log );
+            }
+            internals_write_event( &event );
         }
     }
 }
 
 
-int keystate( enum keycode_t key ) {
-    int index = (int) key;
-    if( index >= 0 && index < KEYCOUNT ) {
-        return internals->input.keystate[ index ];
+int readevents( struct inputevent_t* events, int capacity ) {
+    if( !events || capacity <= 0 ) {
+        return 0;
     }
-    return false;
+    return internals_read_events( &internals->input.events_read, events, capacity );
 }
 
 
@@ -1666,15 +5376,27 @@ enum keycode_t* readkeys( void ) {
         waitvbl();
     }
     #endif
-    thread_mutex_lock( &internals->mutex );
-    memset( internals->input.keybuffer, 0, sizeof( internals->input.keybuffer0 ) );
-    if( internals->input.keybuffer == internals->input.keybuffer0 ) {
-        internals->input.keybuffer = internals->input.keybuffer1;
-    } else {
-        internals->input.keybuffer = internals->input.keybuffer0;
+    enum keycode_t* keys = internals->input.keybuffer;
+    int max_count = (int)( sizeof( internals->input.keybuffer ) / sizeof( *internals->input.keybuffer ) ) - 1;
+    int count = 0;
+    struct inputevent_t events[ 64 ];
+    int events_count;
+    while( ( events_count = internals_read_events( &internals->input.keys_read, events, 64 ) ) > 0 ) {
+        for( int i = 0; i < events_count; ++i ) {
+            int index = (int) events[ i ].key;
+            if( ( events[ i ].type == inputevent_keydown && index > 0 && index < KEYCOUNT ) 
+                || ( events[ i ].type == inputevent_keyup && index >= 0 && index < KEYCOUNT ) ) {
+                if( count >= max_count ) {
+                    memmove( keys, keys + 1, ( max_count - 1 ) * sizeof( *keys ) );
+                    --count;
+                }
+                keys[ count++ ] = events[ i ].type == inputevent_keydown ? events[ i ].key :
+                    (enum keycode_t)( ( (uint32_t) events[ i ].key ) | KEY_MODIFIER_RELEASED );
+            }
+        }
     }
-    thread_mutex_unlock( &internals->mutex );
-    return internals->input.keybuffer;
+    keys[ count ] = KEY_INVALID;
+    return keys;
 };
 
 
@@ -1686,15 +5408,24 @@ char const* readchars( void ) {
         waitvbl();
     }
     #endif
-    thread_mutex_lock( &internals->mutex );
-    memset( internals->input.charbuffer, 0, sizeof( internals->input.charbuffer0 ) );
-    if( internals->input.charbuffer == internals->input.charbuffer0 ) {
-        internals->input.charbuffer = internals->input.charbuffer1;
-    } else {
-        internals->input.charbuffer = internals->input.charbuffer0;
+    char* chars = internals->input.charbuffer;
+    int max_count = (int) sizeof( internals->input.charbuffer ) - 1;
+    int count = 0;
+    struct inputevent_t events[ 64 ];
+    int events_count;
+    while( ( events_count = internals_read_events( &internals->input.chars_read, events, 64 ) ) > 0 ) {
+        for( int i = 0; i < events_count; ++i ) {
+            if( events[ i ].type == inputevent_char && events[ i ].chr > 0 ) {
+                if( count >= max_count ) {
+                    memmove( chars, chars + 1, max_count - 1 );
+                    --count;
+                }
+                chars[ count++ ] = events[ i ].chr;
+            }
+        }
     }
-    thread_mutex_unlock( &internals->mutex );
-    return internals->input.charbuffer;
+    chars[ count ] = '\0';
+    return chars;
 }
 
 
@@ -2144,6 +5875,10 @@ void soundvolume( int channel, int left, int right ) {
 struct app_context_t {
     int argc;
     char** argv;
+    bool headless;
+    int headless_frames;
+    char const* record_filename;
+    char const* replay_filename;
 };
 
 
@@ -2168,6 +5903,7 @@ int user_thread_proc( void* user_data ) {
     struct user_thread_context_t* context = (struct user_thread_context_t*) user_data;
         
     internals_create( context->sound_buffer_size );
+    internals->vbl.headless = context->app_context->headless;
 
     thread_signal_raise( &context->user_thread_initialized );
 
@@ -2719,6 +6455,7 @@ struct sound_context_t {
 
 static void app_sound_callback( APP_S16* sample_pairs, int sample_pairs_count, void* user_data ) {
     struct sound_context_t* context = (struct sound_context_t*) user_data;
+    APP_S16* output = sample_pairs;
     static float mixbuffer[ SOUND_BUFFER_SIZE * 10 ];
     static short modbuffer[ SOUND_BUFFER_SIZE * 10 ];
     int in_count = sample_pairs_count;
@@ -2966,6 +6703,8 @@ static void app_sound_callback( APP_S16* sample_pairs, int sample_pairs_count, v
     }
     context->commands_count = 0;
 
+    internals_capture_audio( output, in_count );
+
     thread_mutex_unlock( &context->mutex );
 }
 
@@ -2995,6 +6734,86 @@ static APP_U32* load_crt_frame( void ) {
 }
 
 
+// Frame statistics overlay, toggled with F9. It is drawn on top of the expanded screen just before it is presented, and 
+// what was underneath is put back right after, so neither the screen buffer nor the dirty tracking is affected.
+#define INTERNALS_OVERLAY_WIDTH 168
+#define INTERNALS_OVERLAY_HEIGHT 84
+
+static void internals_overlay_text( APP_U32* pixels, int pitch, int x, int y, char const* text, uint8_t const* glyphs ) {
+    for( ; *text; ++text, x += 8 ) {
+        uint8_t const* glyph = glyphs + (uint8_t)*text * 8 * 8;
+        for( int iy = 0; iy < 8; ++iy ) {
+            for( int ix = 0; ix < 8; ++ix ) {
+                if( glyph[ ix + iy * 8 ] ) {
+                    pixels[ ( x + ix ) + ( y + iy ) * pitch ] = 0xffffff;
+                }
+            }
+        }
+    }
+}
+
+
+static void internals_overlay_draw( APP_U32* pixels, int pitch, struct internals_stats_t const* samples, 
+    uint8_t const* glyphs ) {
+
+    for( int y = 0; y < INTERNALS_OVERLAY_HEIGHT; ++y ) {
+        for( int x = 0; x < INTERNALS_OVERLAY_WIDTH; ++x ) {
+            APP_U32* p = pixels + x + y * pitch;
+            *p = ( *p >> 1 ) & 0x7f7f7f;
+        }
+    }
+
+    struct framestats_t stats = internals_framestats( samples );
+    char line[ 21 ];
+    snprintf( line, sizeof( line ), "user %5.1f p99%5.1f", stats.user.avg, stats.user.p99 );
+    internals_overlay_text( pixels, pitch, 4, 4, line, glyphs );
+    snprintf( line, sizeof( line ), "wait %5.1f p99%5.1f", stats.wait.avg, stats.wait.p99 );
+    internals_overlay_text( pixels, pitch, 4, 12, line, glyphs );
+    snprintf( line, sizeof( line ), "c%4.1f e%4.1f p%4.1f", stats.copy.avg, stats.expand.avg, stats.present.avg );
+    internals_overlay_text( pixels, pitch, 4, 20, line, glyphs );
+    snprintf( line, sizeof( line ), "missed %d/%d", stats.missedvbls, stats.frames );
+    internals_overlay_text( pixels, pitch, 4, 28, line, glyphs );
+
+    // One column per frame with the newest on the right, 40 pixels high for 33.3 ms, and a line marking 16.7 ms. Bars
+    // show the user thread work time (red if it was too long for 60hz), dots the present thread time.
+    int graph_x = 4 + INTERNALS_FRAMESTATS_COUNT - samples->user_count;
+    int graph_y = INTERNALS_OVERLAY_HEIGHT - 5;
+    for( int x = 0; x < INTERNALS_FRAMESTATS_COUNT; ++x ) {
+        pixels[ ( 4 + x ) + ( graph_y - 20 ) * pitch ] = 0x808080;
+    }
+    for( int i = 0; i < samples->user_count; ++i ) {
+        int index = ( samples->user_index - samples->user_count + i + INTERNALS_FRAMESTATS_COUNT ) % INTERNALS_FRAMESTATS_COUNT;
+        float ms = samples->user[ index ];
+        int h = ms * 1.2f < 40.0f ? (int)( ms * 1.2f ) : 40;
+        APP_U32 color = ms > 16.7f ? 0x0000ff : 0x00ff00;
+        for( int y = 0; y < h; ++y ) {
+            pixels[ ( graph_x + i ) + ( graph_y - y ) * pitch ] = color;
+        }
+    }
+    graph_x = 4 + INTERNALS_FRAMESTATS_COUNT - samples->present_count;
+    for( int i = 0; i < samples->present_count; ++i ) {
+        int index = ( samples->present_index - samples->present_count + i + INTERNALS_FRAMESTATS_COUNT ) % INTERNALS_FRAMESTATS_COUNT;
+        float ms = samples->copy[ index ] + samples->expand[ index ] + samples->present[ index ];
+        int h = ms * 1.2f < 39.0f ? (int)( ms * 1.2f ) : 39;
+        pixels[ ( graph_x + i ) + ( graph_y - h ) * pitch ] = 0xffff00;
+    }
+}
+
+
+// Waits for the user thread to call waitvbl, seen as `wait_count` changing, for at most `timeout_ms` and only as long as 
+// the user thread is still running. Returns false if it timed out.
+static bool internals_headless_wait( int wait_count, struct user_thread_context_t* context, int timeout_ms ) {
+    uint64_t timeout_us = internals_time_us() + timeout_ms * 1000ull;
+    while( thread_atomic_int_load( &internals->vbl.wait_count ) == wait_count ) {
+        if( thread_atomic_int_load( &context->user_thread_finished ) || internals_time_us() >= timeout_us ) {
+            return false;
+        }
+        thread_signal_wait( &internals->vbl.wait_signal, 16 );
+    }
+    return true;
+}
+
+
 static int app_proc( app_t* app, void* user_data ) {
     struct app_context_t* app_context = (struct app_context_t*) user_data;
    
@@ -3014,6 +6833,16 @@ static int app_proc( app_t* app, void* user_data ) {
         }
         else if( strcmp( app_context->argv[ i ], "-w" ) == 0 ) {
             fullscreen = false;
+        } else if( strcmp( app_context->argv[ i ], "--headless" ) == 0 ) {
+            app_context->headless = true;
+            fullscreen = false;
+            if( i + 1 < app_context->argc && isdigit( (unsigned char) app_context->argv[ i + 1 ][ 0 ] ) ) {
+                app_context->headless_frames = atoi( app_context->argv[ ++i ] );
+            }
+        } else if( strcmp( app_context->argv[ i ], "--record" ) == 0 && i + 1 < app_context->argc ) {
+            app_context->record_filename = app_context->argv[ ++i ];
+        } else if( strcmp( app_context->argv[ i ], "--replay" ) == 0 && i + 1 < app_context->argc ) {
+            app_context->replay_filename = app_context->argv[ ++i ];
         } else {
             if( modargc >= sizeof( modargv ) / sizeof( *modargv ) ) {
                 break;
@@ -3023,6 +6852,7 @@ static int app_proc( app_t* app, void* user_data ) {
     }
     app_context->argc = modargc;
     app_context->argv = modargv;
+    bool headless = app_context->headless;
 
     int pointer_width = 0;
     int pointer_height = 0;
@@ -3100,21 +6930,26 @@ static int app_proc( app_t* app, void* user_data ) {
     internals->wasm.user_coro = user_coro; // only now internals exists
     #endif
 
-    #ifdef NULL_PLATFORM
-        crtemu_pc_t* crt = NULL;
-    #else
-        crtemu_pc_t* crt = crtemu_pc_create( NULL );
-        #ifndef DISABLE_SCREEN_FRAME
-            APP_U32* frame = load_crt_frame();
-            crtemu_pc_frame( crt, frame, 1024, 1024 );
-            free( frame );
-        #endif
+    crtemu_pc_t* crt = NULL;
+    #ifndef NULL_PLATFORM
+        if( !headless ) {
+            crt = crtemu_pc_create( NULL );
+            #ifndef DISABLE_SCREEN_FRAME
+                APP_U32* frame = load_crt_frame();
+                crtemu_pc_frame( crt, frame, 1024, 1024 );
+                free( frame );
+            #endif
+        }
     #endif
 
     // Create the frametimer instance, and set it to fixed 60hz update. This will ensure we never run faster than that,
-    // even if the user have disabled vsync in their graphics card settings.
+    // even if the user have disabled vsync in their graphics card settings. In headless mode, we run as fast as the
+    // user thread can produce frames.
     frametimer_t* frametimer = frametimer_create( NULL );
-    frametimer_lock_rate( frametimer, 60 );
+    frametimer_lock_rate( frametimer, headless ? 0 : 60 );
+
+    // Pick the fastest palette expansion routine supported by this CPU
+    internals_expand_init();
 
     // Start sound playback
     struct sound_context_t sound_context;
@@ -3126,10 +6961,21 @@ static int app_proc( app_t* app, void* user_data ) {
     sound_context.loop_music = false;
     sound_context.music_volume = 0;
     initsoundmode( internals->audio.soundmode, &sound_context.sound_freq, &sound_context.sound_8bit, &sound_context.sound_mono );
-    app_sound( app, SOUND_BUFFER_SIZE * 2, app_sound_callback, &sound_context );
+    if( !headless ) {
+        app_sound( app, SOUND_BUFFER_SIZE * 2, app_sound_callback, &sound_context );
+    }
     int previous_soundbank = internals->audio.current_soundbank;
 
+    // In headless mode, each vblank is only signalled once the user thread waits for it. Starting out the same way
+    // makes the program see the same frames on every run, so replayed input arrives on the same frames too.
+    if( headless ) {
+        internals_headless_wait( 0, &user_thread_context, 1000 );
+    }
+    int initial_wait_count = thread_atomic_int_load( &internals->vbl.wait_count );
     signalvbl();
+    if( headless ) {
+        internals_headless_wait( initial_wait_count, &user_thread_context, 1000 );
+    }
 
     struct {
         struct sound_t* sound;
@@ -3142,38 +6988,119 @@ static int app_proc( app_t* app, void* user_data ) {
     enum soundmode_t sound_mode = internals->audio.soundmode;
     int music_play_counter = 0;
 
-    // Main loop
-    static APP_U32 screen_xbgr[ sizeof( internals->screen.buffer0 ) ];
+    // Main loop. The present thread's copies of the screen are sized to the mode being displayed.
+    uint8_t* screen = NULL;
+    uint8_t* drawn_screen = NULL;
+    uint8_t* changed_rows = NULL;
+    APP_U32* screen_xbgr = NULL;
+    size_t screen_size = 0;
+    size_t screen_xbgr_size = 0;
+    int changed_rows_size = 0;
     int width = 0;
     int height = 0;
+    int prev_width = 0;
+    int prev_height = 0;
+    uint32_t* prev_font = NULL;
+    uint8_t* prev_screen_source = NULL;
+    int prev_virtual_width = 0;
+    int prev_virtual_height = 0;
+    int prev_view_x = 0;
+    int prev_view_y = 0;
     int curs_vis = 0;
     int curs_x = 0;
     int curs_y = 0;
+    int drawn_curs_x = -1;
+    int drawn_curs_y = -1;
     bool keystate[ KEYCOUNT ] = { 0 };
-    enum keycode_t keys[ 256 ] = { (enum keycode_t)0 };
-    char chars[ 256] = { 0 };
+    int mouse_cellwidth = 1;
+    int mouse_cellheight = 1;
     APP_U64 crt_time_us = 0;
     APP_U64 prev_time = app_time_count( app );       
+    int headless_frame_count = 0;
+    uint64_t headless_start_us = internals_time_us();
+    uint64_t headless_prev_us = headless_start_us;
+    uint64_t headless_min_us = 0;
+    uint64_t headless_max_us = 0;
+    bool headless_free_running = false;
+    bool show_stats = false;
+    bool stats_pending = false;
+    bool stats_missed = false;
+    float stats_copy_ms = 0.0f;
+    float stats_expand_ms = 0.0f;
+    float stats_present_ms = 0.0f;
+    int prev_vbl_wait_count = 0;
+    static struct internals_stats_t stats_snapshot;
+    static struct internals_raster_t raster;
+    static uint32_t raster_palette[ 256 ];
+    static struct internals_overlay_t overlays[ INTERNALS_OVERLAY_LAYERS ]; // with copies of the shown pixels
+    size_t overlay_capacity[ INTERNALS_OVERLAY_LAYERS ] = { 0 };
+    static APP_U32 overlay_saved[ INTERNALS_OVERLAY_WIDTH * INTERNALS_OVERLAY_HEIGHT ];
+    static uint8_t overlay_glyphs[ 256 * 8 * 8 ];
+    internals_build_glyphs( overlay_glyphs, font8x8 );
+
+    // Open the input log to record to, and load the one to replay. Both can be used at once.
+    struct internals_inputlog_t record_log;
+    memset( &record_log, 0, sizeof( record_log ) );
+    struct internals_inputlog_t replay_log;
+    memset( &replay_log, 0, sizeof( replay_log ) );
+    if( app_context->record_filename ) {
+        record_log.record = fopen( app_context->record_filename, "wb" );
+        if( record_log.record ) {
+            fwrite( INTERNALS_INPUTLOG_HEADER, 1, 8, record_log.record );
+        } else {
+            printf( "Could not create input recording %s\n", app_context->record_filename );
+        }
+    }
+    if( app_context->replay_filename ) {
+        FILE* file = fopen( app_context->replay_filename, "rb" );
+        if( file ) {
+            fseek( file, 0, SEEK_END );
+            long size = ftell( file );
+            fseek( file, 0, SEEK_SET );
+            if( size >= 8 ) {
+                replay_log.replay = (uint8_t*) malloc( (size_t) size );
+                replay_log.replay_size = fread( replay_log.replay, 1, (size_t) size, file );
+                replay_log.replay_pos = 8;
+            }
+            fclose( file );
+        }
+        if( !replay_log.replay || replay_log.replay_size < 8 || memcmp( replay_log.replay, INTERNALS_INPUTLOG_HEADER, 8 ) != 0 ) {
+            printf( "Could not load input recording %s\n", app_context->replay_filename );
+            free( replay_log.replay );
+            replay_log.replay = NULL;
+        }
+    }
+
     while( !thread_atomic_int_load( &user_thread_context.user_thread_finished ) ) {
         app_state_t app_state = app_yield( app );        
         frametimer_update( frametimer );
 
-        int keys_index = 0;
-        memset( keys, 0, sizeof( keys ) );
-        int chars_index = 0;
-        memset( chars, 0, sizeof( chars ) );
+        // Input events are passed on to the user thread right away, without waiting for the end of the frame. When 
+        // replaying, the recorded input for this vblank is passed on instead, and live input only toggles the stats
+        // overlay and fullscreen.
         float relx = 0;
         float rely = 0;
+        int input_frame = thread_atomic_int_load( &internals->vbl.count );
+        unsigned int input_first_event = (unsigned int) thread_atomic_int_load( &internals->input.events_head );
         app_input_t input = app_input( app );
+        struct inputevent_t inputevent;
+        memset( &inputevent, 0, sizeof( inputevent ) );
+        inputevent.time = internals_time_us() - internals->input.start_us;
         for( int i = 0; i < input.count; ++i ) {
             app_input_event_t* event = &input.events[ i ];
+            if( replay_log.replay && event->type != APP_INPUT_KEY_DOWN ) {
+                continue;
+            }
             if( event->type  == APP_INPUT_KEY_DOWN ) {
                 int index = (int)event->data.key;
-                if( index > 0 && index < KEYCOUNT ) {
+                if( index > 0 && index < KEYCOUNT && !replay_log.replay ) {
                     keystate[ index ] = true;
-                    if( keys_index < 255 ) {
-                        keys[ keys_index++ ] = (enum keycode_t)event->data.key;
-                    }
+                    inputevent.type = inputevent_keydown;
+                    inputevent.key = (enum keycode_t)event->data.key;
+                    internals_write_event( &inputevent );
+                }
+                if( event->data.key == APP_KEY_F9 ) {
+                    show_stats = !show_stats;
                 }
                 if( event->data.key == APP_KEY_F11 ) {
                     fullscreen = !fullscreen;
@@ -3194,26 +7121,45 @@ static int app_proc( app_t* app, void* user_data ) {
                 int index = (int)event->data.key;
                 if( index >= 0 && index < KEYCOUNT ) {
                     keystate[ index ] = false;
-                    if( keys_index < 255 ) {
-                        keys[ keys_index++ ] = (enum keycode_t)( ( (uint32_t)event->data.key ) | KEY_MODIFIER_RELEASED );
-                    }
+                    inputevent.type = inputevent_keyup;
+                    inputevent.key = (enum keycode_t)event->data.key;
+                    internals_write_event( &inputevent );
                 }
             } else if( event->type  == APP_INPUT_CHAR ) {
-                if( event->data.char_code > 0 ) {
-                    if( chars_index < 255 ) {
-                        chars[ chars_index++ ] = event->data.char_code;
-                    }
+                if( event->data.char_code != '\0' ) {
+                    inputevent.type = inputevent_char;
+                    inputevent.chr = event->data.char_code;
+                    internals_write_event( &inputevent );
+                }
+            } else if( event->type  == APP_INPUT_MOUSE_MOVE ) {
+                int x = event->data.mouse_pos.x;
+                int y = event->data.mouse_pos.y;
+                if( crt && width > 0 && height > 0 ) {
+                    crtemu_pc_coordinates_window_to_bitmap( crt, width, height, &x, &y );
                 }
+                inputevent.type = inputevent_mousemove;
+                inputevent.x = x / mouse_cellwidth;
+                inputevent.y = y / mouse_cellheight;
+                internals_write_event( &inputevent );
             } else if( event->type  == APP_INPUT_MOUSE_DELTA ) {
                 relx += event->data.mouse_delta.x;
                 rely += event->data.mouse_delta.y;
+                inputevent.type = inputevent_mousedelta;
+                inputevent.x = (int)event->data.mouse_delta.x;
+                inputevent.y = (int)event->data.mouse_delta.y;
+                internals_write_event( &inputevent );
             }
         }
+        if( replay_log.replay ) {
+            internals_inputlog_replay( &replay_log, input_frame, keystate, &relx, &rely );
+        }
         internals->input.mouse_relx = (int)relx;
         internals->input.mouse_rely = (int)rely;
 
-        // Check if the close button on the window was clicked (or Alt+F4 was pressed)
-        if( app_state == APP_STATE_EXIT_REQUESTED ) {
+        // Check if the close button on the window was clicked (or Alt+F4 was pressed), or if the requested number of
+        // headless frames have been run
+        if( app_state == APP_STATE_EXIT_REQUESTED || 
+            ( headless && app_context->headless_frames > 0 && headless_frame_count >= app_context->headless_frames ) ) {
             // Signal that we need to force the user thread to exit
             thread_atomic_int_store( &internals->exit_flag, 1 );
             signalvbl();
@@ -3221,28 +7167,133 @@ static int app_proc( app_t* app, void* user_data ) {
         }
 
         // Copy data from user thread
+        uint64_t copy_start_us = internals_time_us();
         thread_mutex_lock( &internals->mutex );
 
+        // Add the timings of the previous frame to the frame statistics
+        if( stats_pending ) {
+            struct internals_stats_t* stats = &internals->stats;
+            stats->copy[ stats->present_index ] = stats_copy_ms;
+            stats->expand[ stats->present_index ] = stats_expand_ms;
+            stats->present[ stats->present_index ] = stats_present_ms;
+            stats->missed[ stats->present_index ] = stats_missed ? 1 : 0;
+            stats->present_index = ( stats->present_index + 1 ) % INTERNALS_FRAMESTATS_COUNT;
+            if( stats->present_count < INTERNALS_FRAMESTATS_COUNT ) {
+                ++stats->present_count;
+            }
+            stats_pending = false;
+        }
+        if( show_stats ) {
+            memcpy( &stats_snapshot, &internals->stats, sizeof( stats_snapshot ) );
+        }
+
+        // When double buffering, pick up the most recently completed frame if there is a new one. It is ours until we
+        // hand it back on the next swap, so it can be read without holding the lock. It is shown with the palette it 
+        // was drawn with, but if the palette is changed without a new frame to go with it (like when fading out a still
+        // image), the change is applied right away. So are the palette animations, as they are not tied to any frame.
+        // The raster tables always go with the frame.
+        // Buffers of an earlier mode can't be in use anymore, as we're done copying the previous frame
+        internals_free_aligned( internals->screen.retired );
+        internals->screen.retired = NULL;
+
+        internals_animate_palette();
+
         width = internals->screen.width;
         height = internals->screen.height;
+        int virtual_width = internals->screen.virtual_width;
+        int virtual_height = internals->screen.virtual_height;
+        int view_x = internals->screen.view_x;
+        int view_y = internals->screen.view_y;
+        uint8_t* dirty = internals->screen.dirty;
         uint8_t* internals_screen = internals->screen.buffer;
         uint32_t* font = internals->screen.font;
+        uint32_t const* internals_palette = internals->screen.palette;
+        struct internals_raster_t const* raster_source = &internals->screen.raster;
         if( internals->screen.doublebuffer ) {
-            if( internals->screen.buffer == internals->screen.buffer0 ) {
-                internals_screen = internals->screen.buffer1;
-            } else {
-                internals_screen = internals->screen.buffer0;
+            bool new_frame = false;
+            if( (uintptr_t) thread_atomic_ptr_load( &internals->screen.latest ) & 1 ) {
+                uintptr_t latest = (uintptr_t) thread_atomic_ptr_swap( &internals->screen.latest, internals->screen.front );
+                internals->screen.front = (struct internals_frame_t*)( latest & ~(uintptr_t) 1 );
+                new_frame = true;
             }
+            width = internals->screen.front->width;
+            height = internals->screen.front->height;
+            font = internals->screen.front->font;
+            virtual_width = internals->screen.front->virtual_width;
+            virtual_height = internals->screen.front->virtual_height;
+            view_x = internals->screen.front->view_x;
+            view_y = internals->screen.front->view_y;
+            internals_screen = internals->screen.front->buffer;
+            if( ( new_frame && internals->screen.front->palette_steps == internals->screen.palette_steps ) 
+                || internals->screen.front->palette_stamp == internals->screen.palette_stamp ) {
+                internals_palette = internals->screen.front->palette;
+            }
+            raster_source = &internals->screen.front->raster;
         }
-        static uint8_t screen[ sizeof( internals->screen.buffer0 ) ];
-        if( font ) {
-            memcpy( screen, internals_screen, width * height * 2 );
-        } else {
-            memcpy( screen, internals_screen, width * height );
+        bool raster_changed = raster_source->stamp != raster.stamp;
+        if( raster_changed ) {
+            internals_copy_raster( &raster, raster_source );
+        }
+
+        // Overlays are not tied to any frame either. The rows a changed overlay covered before and covers now are 
+        // expanded again.
+        int overlay_top = 4096;
+        int overlay_bottom = 0;
+        bool overlays_visible = false;
+        for( int i = 0; i < INTERNALS_OVERLAY_LAYERS; ++i ) {
+            struct internals_overlay_t const* source = &internals->screen.overlays[ i ];
+            struct internals_overlay_t* overlay = &overlays[ i ];
+            if( source->stamp != overlay->stamp ) {
+                if( overlay->visible ) {
+                    overlay_top = overlay->y < overlay_top ? overlay->y : overlay_top;
+                    overlay_bottom = overlay->y + overlay->height > overlay_bottom ? 
+                        overlay->y + overlay->height : overlay_bottom;
+                }
+                size_t size = (size_t) source->width * (size_t) source->height;
+                if( source->visible && size > overlay_capacity[ i ] ) {
+                    free( overlay->pixels );
+                    overlay->pixels = (uint8_t*) malloc( size );
+                    overlay_capacity[ i ] = overlay->pixels ? size : 0;
+                }
+                overlay->stamp = source->stamp;
+                overlay->visible = source->visible && overlay->pixels;
+                overlay->x = source->x;
+                overlay->y = source->y;
+                overlay->width = source->width;
+                overlay->height = source->height;
+                overlay->colorkey = source->colorkey;
+                if( overlay->visible ) {
+                    memcpy( overlay->pixels, source->shown, size );
+                    overlay_top = overlay->y < overlay_top ? overlay->y : overlay_top;
+                    overlay_bottom = overlay->y + overlay->height > overlay_bottom ? 
+                        overlay->y + overlay->height : overlay_bottom;
+                }
+            }
+            overlays_visible = overlays_visible || overlay->visible;
         }
 
+        // Only copy the rows which are marked as dirty, and which actually differ from what we have. A change of mode 
+        // means everything needs to be expanded again, and so does a change of palette in graphics modes (text modes
+        // only redraw the cells using the changed colors). If the program writes to the screen buffer directly without
+        // marking what it changed, or if we are now displaying the other buffer, all rows must be checked.
         static uint32_t palette[ 256 ];
-        memcpy( palette, internals->screen.palette, 1024 );
+        static uint8_t glyphs[ 256 * 9 * 16 ];
+        bool palette_changed = memcmp( palette, internals_palette, sizeof( palette ) ) != 0;
+        uint32_t changed_colors = 0;
+        if( font && palette_changed ) {
+            for( int i = 0; i < 16; ++i ) {
+                if( palette[ i ] != internals_palette[ i ] ) {
+                    changed_colors |= 1u << i;
+                }
+            }
+        }
+        bool mode_changed = width != prev_width || height != prev_height || font != prev_font;
+        bool refresh_all = mode_changed || ( ( palette_changed || raster_changed ) && !font );
+        bool view_changed = virtual_width != prev_virtual_width || virtual_height != prev_virtual_height 
+            || view_x != prev_view_x || view_y != prev_view_y;
+        bool check_all = refresh_all || view_changed || internals_screen != prev_screen_source
+            || ( internals->screen.raw_access && !internals->screen.explicit_dirty );
+        memcpy( palette, internals_palette, 1024 );
 
         bool curs = internals->conio.curs;
         if( internals->conio.x != curs_x || internals->conio.y != curs_y ) {
@@ -3259,50 +7310,14 @@ static int app_proc( app_t* app, void* user_data ) {
         }
         internals->input.mouse_x = mouse_x / internals->screen.cellwidth;
         internals->input.mouse_y = mouse_y / internals->screen.cellheight;
-
-        memcpy( internals->input.keystate, keystate, sizeof( internals->input.keystate ) );
-
-        enum keycode_t* internals_keybuffer;
-        if( internals->input.keybuffer == internals->input.keybuffer0 ) {
-            internals_keybuffer = internals->input.keybuffer1;
-        } else {
-            internals_keybuffer = internals->input.keybuffer0;
-        }
-        enum keycode_t* keyin = keys;
-        enum keycode_t* keyout = internals_keybuffer;
-        enum keycode_t* keyend = internals_keybuffer + sizeof( internals->input.keybuffer0 ) / sizeof( *internals->input.keybuffer0 ) - 1;
-        while( *keyout && keyout < keyend ) {
-            ++keyout;
-        }
-        while( *keyin ) {
-            if( keyout >= keyend ) {
-                memmove( internals_keybuffer + 1, internals_keybuffer, sizeof( internals->input.keybuffer0 ) / sizeof( *internals->input.keybuffer0 ) - 1 );
-                --keyout;
-            }
-            *keyout++ = *keyin++;                        
+        if( replay_log.replay ) {
+            internals->input.mouse_x = replay_log.mouse_x;
+            internals->input.mouse_y = replay_log.mouse_y;
         }
-        *keyout = KEY_INVALID;
+        mouse_cellwidth = internals->screen.cellwidth;
+        mouse_cellheight = internals->screen.cellheight;
 
-        char* internals_charbuffer;
-        if( internals->input.charbuffer == internals->input.charbuffer0 ) {
-            internals_charbuffer = internals->input.charbuffer1;
-        } else {
-            internals_charbuffer = internals->input.charbuffer0;
-        }
-        char* charin = chars;
-        char* charout = internals_charbuffer;
-        char* charend = internals_charbuffer + sizeof( internals->input.charbuffer0 ) / sizeof( *internals->input.charbuffer0 ) - 1;
-        while( *charout && charout < charend ) {
-            ++charout;
-        }
-        while( *charin ) {
-            if( charout >= charend ) {
-                memmove( internals_charbuffer + 1, internals_charbuffer, sizeof( internals->input.charbuffer0 ) / sizeof( *internals->input.charbuffer0 ) - 1 );
-                --charout;
-            }
-            *charout++ = *charin++;                        
-        }
-        *charout = '\0';
+        memcpy( internals->input.keystate, keystate, sizeof( internals->input.keystate ) );
 
         int audio_commands_count = internals->audio.commands_count;
         internals->audio.commands_count = 0;
@@ -3329,7 +7344,80 @@ static int app_proc( app_t* app, void* user_data ) {
 
         thread_mutex_unlock( &internals->mutex );
 
-        // Signal to the game that the frame is completed, and that we are just starting the next one
+        if( record_log.record ) {
+            internals_inputlog_record( &record_log, input_frame, input_first_event, 
+                (unsigned int) thread_atomic_int_load( &internals->input.events_head ), 
+                internals->input.mouse_x, internals->input.mouse_y, (int)relx, (int)rely );
+        }
+
+        // The screen rows are copied outside of the lock: a double buffered frame is owned by this thread by now, and a
+        // single buffered screen is written by the user thread without locking anyway
+        if( font && font != prev_font ) {
+            internals_build_glyphs( glyphs, font );
+        }
+        if( mode_changed ) {
+            size_t size = (size_t) width * (size_t) height * ( font ? 2 : 1 );
+            size_t xbgr_size = (size_t) width * (size_t) height * ( font ? font[ 0 ] * font[ 1 ] : 1 );
+            if( size != screen_size ) {
+                internals_free_aligned( screen );
+                internals_free_aligned( drawn_screen );
+                screen = (uint8_t*) internals_alloc_aligned( size );
+                drawn_screen = (uint8_t*) internals_alloc_aligned( size );
+                screen_size = size;
+            }
+            // Modes of the same size can still differ in height
+            if( height != changed_rows_size ) {
+                internals_free_aligned( changed_rows );
+                changed_rows = (uint8_t*) internals_alloc_aligned( (size_t) height );
+                changed_rows_size = height;
+            }
+            if( xbgr_size != screen_xbgr_size ) {
+                internals_free_aligned( screen_xbgr );
+                screen_xbgr = (APP_U32*) internals_alloc_aligned( xbgr_size * sizeof( APP_U32 ) );
+                screen_xbgr_size = xbgr_size;
+            }
+        }
+        prev_width = width;
+        prev_height = height;
+        prev_font = font;
+        prev_screen_source = internals_screen;
+        prev_virtual_width = virtual_width;
+        prev_virtual_height = virtual_height;
+        prev_view_x = view_x;
+        prev_view_y = view_y;
+
+        // The rows of the viewport are taken from the buffer in two parts, as they may wrap around its right edge
+        int cell_size = font ? 2 : 1;
+        int row_size = width * cell_size;
+        int left_size = ( virtual_width - view_x ) * cell_size;
+        left_size = left_size < row_size ? left_size : row_size;
+        for( int y = 0; y < height; ++y ) {
+            changed_rows[ y ] = 0;
+            int virtual_y = ( view_y + y ) % virtual_height;
+            if( check_all || dirty[ virtual_y ] ) {
+                dirty[ virtual_y ] = 0;
+                uint8_t* src = internals_screen + virtual_y * virtual_width * cell_size;
+                uint8_t* dst = screen + y * row_size;
+                if( refresh_all || memcmp( dst, src + view_x * cell_size, left_size ) != 0 
+                    || memcmp( dst + left_size, src, row_size - left_size ) != 0 ) {
+                    memcpy( dst, src + view_x * cell_size, left_size );
+                    memcpy( dst + left_size, src, row_size - left_size );
+                    changed_rows[ y ] = 1;
+                }
+            }
+        }
+        if( !font ) {
+            for( int y = overlay_top < 0 ? 0 : overlay_top; y < overlay_bottom && y < height; ++y ) {
+                changed_rows[ y ] = 1;
+            }
+        }
+        stats_copy_ms = ( internals_time_us() - copy_start_us ) / 1000.0f;
+
+        // Signal to the game that the frame is completed, and that we are just starting the next one. If the game has
+        // not called waitvbl since the last time, it missed that vblank.
+        int vbl_wait_count = thread_atomic_int_load( &internals->vbl.wait_count );
+        stats_missed = vbl_wait_count == prev_vbl_wait_count;
+        prev_vbl_wait_count = vbl_wait_count;
         signalvbl();
 
         // Process audio commands
@@ -3442,65 +7530,160 @@ static int app_proc( app_t* app, void* user_data ) {
         }
         thread_mutex_unlock( &sound_context.mutex );
 
-        // Render screen buffer
+        if( headless ) {
+            // Pull one frame worth of audio (44100 / 60 sample pairs) through the mixer, as the sound device would have
+            static APP_S16 headless_samples[ 735 * 2 ];
+            app_sound_callback( headless_samples, 735, &sound_context );
+        }
+
+ 
+        // Render the rows of the screen buffer which have changed
+        uint64_t expand_start_us = internals_time_us();
         if( font ) {
-            memset( screen_xbgr, 0, sizeof( screen_xbgr ) );
 	        uint32_t const* data = font; 
             int chr_width = *data++;
             int chr_height = *data++;
-            int chr_baseline = *data++;
-            (void) chr_baseline;
-            int chr_mod = 256 / chr_width;
+
+            // The cells where the cursor was and where it now is need to be rendered again if it moved or blinked (the 
+            // cursor of 8x8 fonts extends one pixel into the cell below). Flipping the bits of what we last drew makes
+            // sure those cells are seen as changed.
+            ++curs_vis;
+            int new_curs_x = -1;
+            int new_curs_y = -1;
+            if( curs && curs_x >= 0 && curs_x < width && curs_y >= 0 && curs_y < height && ( curs_vis % 50 ) < 25 ) {
+                new_curs_x = curs_x;
+                new_curs_y = curs_y;
+            }
+            if( new_curs_x != drawn_curs_x || new_curs_y != drawn_curs_y ) {
+                if( drawn_curs_y >= 0 && drawn_curs_y < height && drawn_curs_x < width ) {
+                    int i = drawn_curs_x + drawn_curs_y * width;
+                    drawn_screen[ i * 2 ] = (uint8_t) ~screen[ i * 2 ];
+                    changed_rows[ drawn_curs_y ] = 1;
+                    if( drawn_curs_y + 1 < height ) {
+                        drawn_screen[ ( i + width ) * 2 ] = (uint8_t) ~screen[ ( i + width ) * 2 ];
+                        changed_rows[ drawn_curs_y + 1 ] = 1;
+                    }
+                }
+                if( new_curs_y >= 0 ) {
+                    int i = new_curs_x + new_curs_y * width;
+                    drawn_screen[ i * 2 ] = (uint8_t) ~screen[ i * 2 ];
+                    changed_rows[ new_curs_y ] = 1;
+                }
+                drawn_curs_x = new_curs_x;
+                drawn_curs_y = new_curs_y;
+            }
+
+            // Redraw only the cells which differ from what was last drawn there, or which use a color that changed
+            int pitch = width * chr_width;
+            int glyph_size = chr_width * chr_height;
 	        for( int y = 0; y < height; ++y ) { 
+                if( !changed_rows[ y ] && !changed_colors ) {
+                    continue;
+                }
 	            for( int x = 0; x < width; ++x ) { 
-		            uint8_t c = screen[ ( x + y * width ) * 2 + 0 ]; 
-                    uint8_t attr = screen[ ( x + y * width ) * 2 + 1 ]; 
+                    int i = ( x + y * width ) * 2;
+		            uint8_t c = screen[ i + 0 ]; 
+                    uint8_t attr = screen[ i + 1 ]; 
                     int fg = ( attr & 0xf );
                     int bg = ( ( attr >> 4 ) & 0xf );
-		            int sx = ( c % chr_mod ) * chr_width; 
-		            int sy = ( c / chr_mod ) * chr_height; 
-		            int dx = x * chr_width; 
-		            int dy = y * chr_height; 
+                    if( !refresh_all && c == drawn_screen[ i + 0 ] && attr == drawn_screen[ i + 1 ] 
+                        && !( changed_colors & ( ( 1u << fg ) | ( 1u << bg ) ) ) ) {
+                        continue;
+                    }
+                    drawn_screen[ i + 0 ] = c;
+                    drawn_screen[ i + 1 ] = attr;
+                    APP_U32 colors[ 2 ] = { palette[ bg ], palette[ fg ] };
+                    uint8_t const* glyph = glyphs + c * glyph_size;
+                    APP_U32* out = screen_xbgr + x * chr_width + y * chr_height * pitch;
 		            for( int iy = 0; iy < chr_height; ++iy ) { 
 			            for( int ix = 0; ix < chr_width; ++ix ) { 
-				            int v = ( sx + ix ) / 32; 
-				            int u = ( sx + ix ) - ( v * 32 ); 
-				            uint32_t b = data[ v + ( sy + iy ) * 8 ]; 
-					        int xp = dx + ix; 
-					        int yp = dy + iy; 
-				            if( b & ( 1 << u ) ) { 
-                                screen_xbgr[ xp + yp * ( width * chr_width ) ] = palette[ fg ]; 
-				            } else {
-                                screen_xbgr[ xp + yp * ( width * chr_width ) ] = palette[ bg ]; 
-                            }
+                            out[ ix ] = colors[ glyph[ ix ] ];
 			            } 
+                        glyph += chr_width;
+                        out += pitch;
 		            } 
 	            }
             }
-            ++curs_vis;
-            if( curs && curs_x >= 0 && curs_x < width && curs_y >= 0 && curs_y < height ) {
-                int vis = ( curs_vis % 50 ) < 25;
-                if( vis ) {
-                    int xp = curs_x * chr_width;
-                    int yp = curs_y * chr_height;
-                    int cs = chr_height == 16 ? 13 : 7;
-                    int ce = chr_height == 16 ? 15 : 9;
-                    APP_U32 col = palette[ 7 ];
-                    for( int y = cs; y < ce; ++y ) {
-                        for( int x = 0; x < chr_width; ++x ) {
-                            screen_xbgr[ ( x + xp ) + ( y + yp ) * width * chr_width ] = col;
-                        }
+            if( drawn_curs_y >= 0 ) {
+                int xp = drawn_curs_x * chr_width;
+                int yp = drawn_curs_y * chr_height;
+                int cs = chr_height == 16 ? 13 : 7;
+                int ce = chr_height == 16 ? 15 : 9;
+                APP_U32 col = palette[ 7 ];
+                for( int y = cs; y < ce && y + yp < height * chr_height; ++y ) {
+                    for( int x = 0; x < chr_width; ++x ) {
+                        screen_xbgr[ ( x + xp ) + ( y + yp ) * width * chr_width ] = col;
                     }
                 }
             }
             width *= chr_width;
             height *= chr_height;
+        } else if( raster.changes_count == 0 && raster.scroll_lines == 0 ) {
+            for( int y = 0; y < height; ++y ) {
+                if( !changed_rows[ y ] ) {
+                    continue;
+                }
+                internals_expand( screen_xbgr + y * width, screen + y * width, width, palette );
+                if( overlays_visible ) {
+                    internals_draw_overlays( screen_xbgr + y * width, y, width, palette, overlays );
+                }
+            }
         } else {
+            // The palette overrides of a line are set in a copy of the palette, and restored again after the line
+            memcpy( raster_palette, palette, 1024 );
+            struct internals_raster_change_t const* change = raster.changes;
+            struct internals_raster_change_t const* changes_end = raster.changes + raster.changes_count;
             for( int y = 0; y < height; ++y ) {
-                for( int x = 0; x < width; ++x ) {
-                    screen_xbgr[ x + y * width ] = palette[ screen[ x + y * width ] ];
+                struct internals_raster_change_t const* line_changes = change;
+                while( change < changes_end && change->line == y ) {
+                    ++change;
                 }
+                if( !changed_rows[ y ] ) {
+                    continue;
+                }
+                for( struct internals_raster_change_t const* c = line_changes; c < change; ++c ) {
+                    raster_palette[ c->index ] = c->color;
+                }
+                int dx = y < raster.scroll_lines ? raster.scroll[ y ] % width : 0;
+                if( dx < 0 ) {
+                    dx += width;
+                }
+                APP_U32* dst = screen_xbgr + y * width;
+                uint8_t const* src = screen + y * width;
+                internals_expand( dst + dx, src, width - dx, raster_palette );
+                internals_expand( dst, src + width - dx, dx, raster_palette );
+                if( overlays_visible ) {
+                    internals_draw_overlays( dst, y, width, raster_palette, overlays );
+                }
+                for( struct internals_raster_change_t const* c = line_changes; c < change; ++c ) {
+                    raster_palette[ c->index ] = palette[ c->index ];
+                }
+            }
+        }
+
+        stats_expand_ms = ( internals_time_us() - expand_start_us ) / 1000.0f;
+
+        internals_capture_frame( screen, prev_width, prev_height, prev_font, palette, drawn_curs_x, drawn_curs_y );
+        stats_present_ms = 0.0f;
+        stats_pending = true;
+
+        if( headless ) {
+            // Instead of waiting for vsync, wait for the user thread to complete its frame and call waitvbl again. A 
+            // program which doesn't call waitvbl or swapbuffers in its loop would hold every frame for the whole 
+            // timeout, so once a wait times out, vblanks run free until the user thread waits again.
+            headless_free_running = !internals_headless_wait( vbl_wait_count, &user_thread_context, 
+                headless_free_running ? 0 : 100 );
+            uint64_t now_us = internals_time_us();
+            uint64_t frame_us = now_us - headless_prev_us;
+            headless_prev_us = now_us;
+            if( headless_frame_count == 0 || frame_us < headless_min_us ) {
+                headless_min_us = frame_us;
             }
+            if( frame_us > headless_max_us ) {
+                headless_max_us = frame_us;
+            }
+            ++headless_frame_count;
+            continue;
         }
 
         if( !app_has_focus( app ) ) {
@@ -3511,6 +7694,15 @@ static int app_proc( app_t* app, void* user_data ) {
         APP_U64 delta_time_us = ( time - prev_time ) / ( ( freq > 1000000 ? freq / 1000000 : 1 ) );
         prev_time = time;
         crt_time_us += delta_time_us;
+        bool overlay = show_stats && width >= INTERNALS_OVERLAY_WIDTH && height >= INTERNALS_OVERLAY_HEIGHT;
+        if( overlay ) {
+            for( int y = 0; y < INTERNALS_OVERLAY_HEIGHT; ++y ) {
+                memcpy( overlay_saved + y * INTERNALS_OVERLAY_WIDTH, screen_xbgr + y * width, 
+                    INTERNALS_OVERLAY_WIDTH * sizeof( APP_U32 ) );
+            }
+            internals_overlay_draw( screen_xbgr, width, &stats_snapshot, overlay_glyphs );
+        }
+        uint64_t present_start_us = internals_time_us();
         if( crt ) {
             #ifndef DISABLE_SCREEN_FRAME
                 crtemu_pc_present( crt, crt_time_us, screen_xbgr, width, height, 0xffffff, 0xff1a1a1a );
@@ -3518,18 +7710,37 @@ static int app_proc( app_t* app, void* user_data ) {
                 crtemu_pc_present( crt, crt_time_us, screen_xbgr, width, height, 0xffffff, 0xff000000 );
             #endif
         }
+        stats_present_ms = ( internals_time_us() - present_start_us ) / 1000.0f;
+        if( overlay ) {
+            for( int y = 0; y < INTERNALS_OVERLAY_HEIGHT; ++y ) {
+                memcpy( screen_xbgr + y * width, overlay_saved + y * INTERNALS_OVERLAY_WIDTH, 
+                    INTERNALS_OVERLAY_WIDTH * sizeof( APP_U32 ) );
+            }
+        }
         app_present( app, NULL, 1, 1, 0xffffff, 0xff1a1a1a );
     }
 
     app_sound( app, 0, NULL, NULL );
 
+    if( record_log.record ) {
+        fclose( record_log.record );
+    }
+    free( replay_log.replay );
+
+    if( headless && headless_frame_count > 0 ) {
+        double total_ms = ( headless_prev_us - headless_start_us ) / 1000.0;
+        printf( "%d frames in %.1f ms: %.3f ms/frame avg, %.3f ms min, %.3f ms max, %.1f fps\n", headless_frame_count, 
+            total_ms, total_ms / headless_frame_count, headless_min_us / 1000.0, headless_max_us / 1000.0, 
+            total_ms > 0.0 ? ( headless_frame_count * 1000.0 ) / total_ms : 0.0 );
+    }
+
     thread_signal_raise( &user_thread_context.app_loop_finished );   
-    int user_exit = thread_signal_wait( &user_thread_context.user_thread_terminated, 170 );
+    int user_exit = thread_signal_wait( &user_thread_context.user_thread_terminated, headless ? 5000 : 170 );
     #ifdef __wasm__
     WaCoroSwitch(user_coro);
     user_exit = 0; // always show fade out animation
     #endif
-    if( !user_exit ) {
+    if( !user_exit && !headless ) {
         for( int i = 0; i < 60; ++i ) {
             APP_U64 time = app_time_count( app );
             APP_U64 delta_time_us = ( time - prev_time ) / ( app_time_freq( app ) / 1000000 );
@@ -3537,21 +7748,29 @@ static int app_proc( app_t* app, void* user_data ) {
             crt_time_us += delta_time_us;
             int v = ( ( 60 - i ) * 255 ) / 60;
             uint32_t fade = ( v << 16 ) | v << 8 | v;
-            if( crt ) {
+            if( crt && screen_xbgr ) {
                 crtemu_pc_present( crt, crt_time_us, screen_xbgr, width, height, fade, 0xff1a1a1a );
             }
             app_present( app, NULL, 1, 1, 0xffffff, 0xff1a1a1a );
             frametimer_update( frametimer );
         }
         user_exit = thread_signal_wait( &user_thread_context.user_thread_terminated, 30 );
-        if( !user_exit ) {
-            exit( EXIT_FAILURE );
-        }
+    }
+    if( !user_exit ) {
+        exit( EXIT_FAILURE );
     }
     thread_signal_term( &user_thread_context.user_thread_initialized );
     thread_signal_term( &user_thread_context.app_loop_finished );
     thread_signal_term( &user_thread_context.user_thread_terminated );
     frametimer_destroy( frametimer );
+    internals_free_aligned( screen );
+    internals_free_aligned( drawn_screen );
+    internals_free_aligned( changed_rows );
+    internals_free_aligned( screen_xbgr );
+    for( int i = 0; i < INTERNALS_OVERLAY_LAYERS; ++i ) {
+        free( overlays[ i ].pixels );
+        overlays[ i ].pixels = NULL;
+    }
     opl_destroy( sound_context.opl );
     thread_mutex_term( &sound_context.mutex );
     if( crt ) {
@@ -3651,6 +7870,163 @@ static int app_proc( app_t* app, void* user_data ) {
 #endif
 
 
+// Palette expansion of 8bpp pixels to XBGR, used for presenting graphics modes. Picks an AVX2 gather loop at
+// runtime when the CPU supports it, and falls back to an unrolled scalar loop otherwise. SSE2 has neither gathers nor
+// byte shuffles, and assembling vectors from scalar loads is no faster than the scalar loop, so there is no SSE2 path.
+// There is a NEON table lookup loop for 64-bit ARM, but it has not been run on ARM hardware yet, only checked against
+// a C emulation of the intrinsics, so it is only used when building with DOS_EXPAND_NEON defined.
+
+#if !defined( __TINYC__ ) && !defined( __wasm__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) || defined( _M_X64 ) || defined( _M_IX86 ) )
+    #define INTERNALS_EXPAND_AVX2
+    #include <immintrin.h>
+    #if defined( __GNUC__ ) || defined( __clang__ )
+        #define INTERNALS_TARGET_AVX2 __attribute__(( target( "avx2" ) ))
+    #else
+        #include <intrin.h>
+        #define INTERNALS_TARGET_AVX2
+    #endif
+#elif defined( DOS_EXPAND_NEON ) && !defined( __TINYC__ ) && defined( __aarch64__ ) && defined( __ARM_NEON )
+    #define INTERNALS_EXPAND_NEON
+    #include <arm_neon.h>
+#endif
+
+
+static bool internals_expand_use_avx2 = false;
+
+
+static void internals_expand_init( void ) {
+    #ifdef INTERNALS_EXPAND_AVX2
+        #if defined( __GNUC__ ) || defined( __clang__ )
+            __builtin_cpu_init();
+            internals_expand_use_avx2 = __builtin_cpu_supports( "avx2" ) != 0;
+        #else
+            int info[ 4 ];
+            __cpuid( info, 0 );
+            if( info[ 0 ] >= 7 ) {
+                __cpuid( info, 1 );
+                bool osxsave_avx = ( info[ 2 ] & ( 1 << 27 ) ) && ( info[ 2 ] & ( 1 << 28 ) );
+                if( osxsave_avx && ( _xgetbv( 0 ) & 6 ) == 6 ) {
+                    __cpuidex( info, 7, 0 );
+                    internals_expand_use_avx2 = ( info[ 1 ] & ( 1 << 5 ) ) != 0;
+                }
+            }
+        #endif
+    #endif
+}
+
+
+#ifdef INTERNALS_EXPAND_AVX2
+    INTERNALS_TARGET_AVX2 static void internals_expand_avx2( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette ) {
+        int i = 0;
+        for( ; i + 16 <= count; i += 16 ) {
+            __m128i indices = _mm_loadu_si128( (__m128i const*)( src + i ) );
+            __m256i lo = _mm256_cvtepu8_epi32( indices );
+            __m256i hi = _mm256_cvtepu8_epi32( _mm_srli_si128( indices, 8 ) );
+            _mm256_storeu_si256( (__m256i*)( dst + i ), _mm256_i32gather_epi32( (int const*) palette, lo, 4 ) );
+            _mm256_storeu_si256( (__m256i*)( dst + i + 8 ), _mm256_i32gather_epi32( (int const*) palette, hi, 4 ) );
+        }
+        for( ; i < count; ++i ) {
+            dst[ i ] = palette[ src[ i ] ];
+        }
+    }
+#endif
+
+
+#ifdef INTERNALS_EXPAND_NEON
+    static void internals_expand_neon( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette ) {
+        // Split the palette into one 256 entry table per byte of the color, each held as four 64 entry quarters, which 
+        // is the most a single table lookup can index
+        uint8x16x4_t tables[ 4 ][ 4 ];
+        for( int quarter = 0; quarter < 4; ++quarter ) {
+            for( int i = 0; i < 4; ++i ) {
+                uint8x16x4_t colors = vld4q_u8( (uint8_t const*)( palette + quarter * 64 + i * 16 ) );
+                for( int channel = 0; channel < 4; ++channel ) {
+                    tables[ channel ][ quarter ].val[ i ] = colors.val[ channel ];
+                }
+            }
+        }
+        uint8x16_t quarter_size = vdupq_n_u8( 64 );
+        int i = 0;
+        for( ; i + 16 <= count; i += 16 ) {
+            // Each lookup only fills in the lanes whose index falls within its quarter, and leaves the others as they are
+            uint8x16_t index0 = vld1q_u8( src + i );
+            uint8x16_t index1 = vsubq_u8( index0, quarter_size );
+            uint8x16_t index2 = vsubq_u8( index1, quarter_size );
+            uint8x16_t index3 = vsubq_u8( index2, quarter_size );
+            uint8x16x4_t pixels;
+            for( int channel = 0; channel < 4; ++channel ) {
+                uint8x16_t value = vqtbl4q_u8( tables[ channel ][ 0 ], index0 );
+                value = vqtbx4q_u8( value, tables[ channel ][ 1 ], index1 );
+                value = vqtbx4q_u8( value, tables[ channel ][ 2 ], index2 );
+                pixels.val[ channel ] = vqtbx4q_u8( value, tables[ channel ][ 3 ], index3 );
+            }
+            vst4q_u8( (uint8_t*)( dst + i ), pixels );
+        }
+        for( ; i < count; ++i ) {
+            dst[ i ] = palette[ src[ i ] ];
+        }
+    }
+#endif
+
+
+static void internals_expand_scalar( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette ) {
+    int i = 0;
+    for( ; i + 8 <= count; i += 8 ) {
+        APP_U32 c0 = palette[ src[ i + 0 ] ];
+        APP_U32 c1 = palette[ src[ i + 1 ] ];
+        APP_U32 c2 = palette[ src[ i + 2 ] ];
+        APP_U32 c3 = palette[ src[ i + 3 ] ];
+        APP_U32 c4 = palette[ src[ i + 4 ] ];
+        APP_U32 c5 = palette[ src[ i + 5 ] ];
+        APP_U32 c6 = palette[ src[ i + 6 ] ];
+        APP_U32 c7 = palette[ src[ i + 7 ] ];
+        dst[ i + 0 ] = c0;
+        dst[ i + 1 ] = c1;
+        dst[ i + 2 ] = c2;
+        dst[ i + 3 ] = c3;
+        dst[ i + 4 ] = c4;
+        dst[ i + 5 ] = c5;
+        dst[ i + 6 ] = c6;
+        dst[ i + 7 ] = c7;
+    }
+    for( ; i < count; ++i ) {
+        dst[ i ] = palette[ src[ i ] ];
+    }
+}
+
+
+static void internals_expand( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette ) {
+    #ifdef INTERNALS_EXPAND_AVX2
+        if( internals_expand_use_avx2 ) {
+            internals_expand_avx2( dst, src, count, palette );
+            return;
+        }
+    #endif
+    #ifdef INTERNALS_EXPAND_NEON
+        internals_expand_neon( dst, src, count, palette );
+        return;
+    #endif
+    internals_expand_scalar( dst, src, count, palette );
+}
+
+
+static uint64_t internals_time_us( void ) {
+    #ifdef _WIN32
+        LARGE_INTEGER count, freq;
+        QueryPerformanceCounter( &count );
+        QueryPerformanceFrequency( &freq );
+        return (uint64_t)( ( count.QuadPart / freq.QuadPart ) * 1000000ull + 
+            ( ( count.QuadPart % freq.QuadPart ) * 1000000ull ) / freq.QuadPart );
+    #elif defined( __APPLE__ )
+        return clock_gettime_nsec_np( CLOCK_UPTIME_RAW ) / 1000ull;
+    #else
+        struct timespec t;
+        clock_gettime( CLOCK_MONOTONIC, &t );
+        return (uint64_t)t.tv_sec * 1000000ull + (uint64_t)t.tv_nsec / 1000ull;
+    #endif
+}
+
+
 bool app_has_focus( app_t* app ) {
     #ifdef ALWAYS_UPDATE
         return true;
@@ -3702,6 +8078,10 @@ int main( int argc, char** argv ) {
     struct app_context_t app_context;
     app_context.argc = argc;
     app_context.argv = argv;
+    app_context.headless = false;
+    app_context.headless_frames = 0;
+    app_context.record_filename = NULL;
+    app_context.replay_filename = NULL;
     return app_run( app_proc, &app_context, NULL, NULL, NULL );
 }
 
@@ -0,0 +1,112 @@
+// Benchmark of the palette expansion the present thread does to turn the 8-bit screen into 32-bit pixels. For the
+// screen size of each graphics mode, it expands the same noise with the plain loop the present thread used to run,
+// with the unrolled scalar loop, and with the SIMD loop picked for this CPU, and prints their times side by side. It
+// includes the implementation of dos.h itself to get at the loops, so it is built without dos.c. Meant to be run with
+// --headless, and built with -DNULL_PLATFORM to run without a display.
+// The code is public domain.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DOS_IMPLEMENTATION
+#include "dos.h"
+
+typedef void (*expand_func_t)( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette );
+
+
+static void expand_plain( APP_U32* dst, uint8_t const* src, int count, uint32_t const* palette ) {
+    for( int i = 0; i < count; ++i ) {
+        dst[ i ] = palette[ src[ i ] ];
+    }
+}
+
+
+// Best average ms per frame over a few batches, expanding row by row like the present thread does
+static double time_expand( expand_func_t expand, APP_U32* dst, uint8_t const* src, int width, int height,
+    uint32_t const* palette ) {
+
+    int frames = 100;
+    double best = 0.0;
+    for( int batch = 0; batch < 5; ++batch ) {
+        uint64_t start = internals_time_us();
+        for( int frame = 0; frame < frames; ++frame ) {
+            for( int y = 0; y < height; ++y ) {
+                expand( dst + y * width, src + y * width, width, palette );
+            }
+        }
+        double ms = ( internals_time_us() - start ) / 1000.0 / frames;
+        best = batch == 0 || ms < best ? ms : best;
+    }
+    return best;
+}
+
+
+int main( int argc, char* argv[] ) {
+    (void) argc, (void) argv;
+    enum videomode_t modes[] = { videomode_320x200, videomode_320x240, videomode_320x400, videomode_640x200,
+        videomode_640x350, videomode_640x400, videomode_640x480 };
+    int count = sizeof( modes ) / sizeof( *modes );
+
+    internals_expand_init();
+    char const* simd_name = "none";
+    expand_func_t simd = NULL;
+    #ifdef INTERNALS_EXPAND_AVX2
+        if( internals_expand_use_avx2 ) {
+            simd_name = "avx2";
+            simd = internals_expand_avx2;
+        }
+    #endif
+    #ifdef INTERNALS_EXPAND_NEON
+        simd_name = "neon";
+        simd = internals_expand_neon;
+    #endif
+
+    unsigned int seed = 1;
+    uint32_t palette[ 256 ];
+    for( int i = 0; i < 256; ++i ) {
+        seed = seed * 1103515245u + 12345u;
+        palette[ i ] = seed;
+    }
+
+    printf( "mode       plain ms  scalar ms  %4s ms\n", simd_name );
+    for( int i = 0; i <= count && !shuttingdown(); ++i ) {
+        // after the standard modes, one larger custom mode
+        if( i < count ) {
+            setvideomode( modes[ i ] );
+        } else {
+            setcustomvideomode( 1024, 768 );
+        }
+        int width = screenwidth();
+        int height = screenheight();
+        size_t size = (size_t) width * height;
+        uint8_t* src = (uint8_t*) malloc( size );
+        APP_U32* expected = (APP_U32*) malloc( size * sizeof( APP_U32 ) );
+        APP_U32* dst = (APP_U32*) malloc( size * sizeof( APP_U32 ) );
+        for( size_t j = 0; j < size; ++j ) {
+            seed = seed * 1103515245u + 12345u;
+            src[ j ] = (uint8_t)( seed >> 24 );
+        }
+        expand_plain( expected, src, (int) size, palette );
+
+        double plain = time_expand( expand_plain, dst, src, width, height, palette );
+        double scalar = time_expand( internals_expand_scalar, dst, src, width, height, palette );
+        bool scalar_ok = memcmp( dst, expected, size * sizeof( APP_U32 ) ) == 0;
+        printf( "%4dx%-4d  %8.3f  %9.3f", width, height, plain, scalar );
+        bool simd_ok = true;
+        if( simd ) {
+            memset( dst, 0, size * sizeof( APP_U32 ) );
+            printf( "  %7.3f", time_expand( simd, dst, src, width, height, palette ) );
+            simd_ok = memcmp( dst, expected, size * sizeof( APP_U32 ) ) == 0;
+        } else {
+            printf( "        -" );
+        }
+        printf( "%s\n", scalar_ok && simd_ok ? "" : "  MISMATCH" );
+
+        free( dst );
+        free( expected );
+        free( src );
+    }
+
+    return 0;
+}
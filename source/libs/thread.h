@@ -1060,8 +1060,8 @@ int thread_atomic_int_load( thread_atomic_int_t* atomic )
         return ret;
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        return atomic->i;
     #else
         #error Unknown platform.
     #endif
@@ -1079,7 +1079,8 @@ void thread_atomic_int_store( thread_atomic_int_t* atomic, int desired )
         __atomic_store( &atomic->i, &desired, __ATOMIC_SEQ_CST );
 
     #elif defined( __wasm__ )
-        // wasm has no threads
+        // wasm has no threads, so plain memory access is atomic
+        atomic->i = desired;
     #else
         #error Unknown platform.
     #endif
@@ -1097,8 +1098,8 @@ int thread_atomic_int_inc( thread_atomic_int_t* atomic )
         return (int)__atomic_fetch_add( &atomic->i, 1, __ATOMIC_SEQ_CST );
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        return atomic->i++;
     #else
         #error Unknown platform.
     #endif
@@ -1116,8 +1117,8 @@ int thread_atomic_int_dec( thread_atomic_int_t* atomic )
         return (int)__atomic_fetch_sub( &atomic->i, 1, __ATOMIC_SEQ_CST );
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        return atomic->i--;
     #else
         #error Unknown platform.
     #endif
@@ -1136,8 +1137,10 @@ int thread_atomic_int_add( thread_atomic_int_t* atomic, int value )
         return (int)__atomic_fetch_add( &atomic->i, value, __ATOMIC_SEQ_CST );
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        int old = atomic->i;
+        atomic->i += value;
+        return old;
     #else
         #error Unknown platform.
     #endif
@@ -1155,8 +1158,10 @@ int thread_atomic_int_sub( thread_atomic_int_t* atomic, int value )
         return (int)__atomic_fetch_sub( &atomic->i, value, __ATOMIC_SEQ_CST );
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        int old = atomic->i;
+        atomic->i -= value;
+        return old;
     #else
         #error Unknown platform.
     #endif
@@ -1177,8 +1182,10 @@ int thread_atomic_int_swap( thread_atomic_int_t* atomic, int desired )
         return old;
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        int old = atomic->i;
+        atomic->i = desired;
+        return old;
     #else
         #error Unknown platform.
     #endif
@@ -1197,8 +1204,10 @@ int thread_atomic_int_compare_and_swap( thread_atomic_int_t* atomic, int expecte
         return expected;
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return 0;
+        // wasm has no threads, so plain memory access is atomic
+        int old = atomic->i;
+        if( old == expected ) atomic->i = desired;
+        return old;
     #else
         #error Unknown platform.
     #endif
@@ -1218,8 +1227,8 @@ void* thread_atomic_ptr_load( thread_atomic_ptr_t* atomic )
         return ret;
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return NULL;
+        // wasm has no threads, so plain memory access is atomic
+        return atomic->ptr;
     #else
         #error Unknown platform.
     #endif
@@ -1243,7 +1252,8 @@ void thread_atomic_ptr_store( thread_atomic_ptr_t* atomic, void* desired )
         __atomic_store( &atomic->ptr, &desired, 0 );
 
     #elif defined( __wasm__ )
-        // wasm has no threads
+        // wasm has no threads, so plain memory access is atomic
+        atomic->ptr = desired;
     #else
         #error Unknown platform.
     #endif
@@ -1268,8 +1278,10 @@ void* thread_atomic_ptr_swap( thread_atomic_ptr_t* atomic, void* desired )
         return old;
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return NULL;
+        // wasm has no threads, so plain memory access is atomic
+        void* old = atomic->ptr;
+        atomic->ptr = desired;
+        return old;
     #else
         #error Unknown platform.
     #endif
@@ -1288,8 +1300,10 @@ void* thread_atomic_ptr_compare_and_swap( thread_atomic_ptr_t* atomic, void* exp
         return expected;
 
     #elif defined( __wasm__ )
-        // wasm has no threads
-        return NULL;
+        // wasm has no threads, so plain memory access is atomic
+        void* old = atomic->ptr;
+        if( old == expected ) atomic->ptr = desired;
+        return old;
     #else
         #error Unknown platform.
     #endif
@@ -116,6 +116,7 @@ void initState() {
 }
 
 int framesSinceStart = 0;
+char shownUi[96] = ""; // the UI text last drawn to the overlay
 typedef struct Sprite
 {
   double x;
@@ -528,6 +529,9 @@ int main(int argc, char *argv[])
     setpal(i, palette[3 * i + 0], palette[3 * i + 1], palette[3 * i + 2]);
   }
 
+  // Three light levels: level 1 is half as bright, used for darkening the y-sides of walls
+  buildshadetable(3);
+
   // Load music and sfx
   struct music_t *music[numTracks];
   load_music(music);
@@ -762,9 +766,9 @@ int main(int argc, char *argv[])
             color = (uint8_t)color;
           }
 
-          // make color darker for y-sides: R, G and B byte each divided through two with a "shift" and an "and"
+          // make color darker for y-sides, with the nearest color of half the brightness
           if (side == 1)
-            color = (color >> 1) & 8355711;
+            color = shadetable(1)[color];
           buffer[x + w * y] = (uint8_t)color;
         }
 
@@ -1023,17 +1027,30 @@ int main(int argc, char *argv[])
         else
           strcat(uiString, "-");
       }
-      centertextxy(0, 24, uiString, 240);
 
       static char scoreString[32];
       snprintf(scoreString, 12, "SCORE: %d", state.score);
-      centertextxy(12, 36, scoreString, 100);
 
-      if (framesSinceStart < 360) {
-        centertextxy(0, 48, "Use arrow keys to move", screenWidth);
-        centertextxy(0, 60, "Press space to attack", screenWidth);
-        centertextxy(0, 72, "Press shift to block", screenWidth);
-        centertextxy(0, 84, "Find the Crystallium Gems", screenWidth);
+      // The UI is drawn to an overlay, which is put on top of every frame when it is displayed, so it only needs to be
+      // drawn again when it changes
+      char ui[96];
+      snprintf(ui, sizeof(ui), "%s|%s|%d", uiString, scoreString, framesSinceStart < 360);
+      if (strcmp(ui, shownUi) != 0)
+      {
+        strcpy(shownUi, ui);
+        unsigned char *overlay = setoverlay(0, 0, 0, screenWidth, 96, 0);
+        memset(overlay, 0, screenWidth * 96);
+        setdrawtarget(overlay, screenWidth, 96);
+        centertextxy(0, 24, uiString, 240);
+        centertextxy(12, 36, scoreString, 100);
+        if (framesSinceStart < 360) {
+          centertextxy(0, 48, "Use arrow keys to move", screenWidth);
+          centertextxy(0, 60, "Press space to attack", screenWidth);
+          centertextxy(0, 72, "Press shift to block", screenWidth);
+          centertextxy(0, 84, "Find the Crystallium Gems", screenWidth);
+        }
+        resetdrawtarget();
+        updateoverlay(0);
       }
 
       buffer = swapbuffers();
@@ -1274,6 +1291,8 @@ int main(int argc, char *argv[])
     }
     else if (state.state == GAMEOVER)
     {
+      removeoverlay(0);
+      shownUi[0] = '\0';
       clearscreen();
       // Print score
       static char scoreString[32];
@@ -1290,6 +1309,8 @@ int main(int argc, char *argv[])
     }
     else if (state.state == WIN)
     {
+      removeoverlay(0);
+      shownUi[0] = '\0';
       clearscreen();
       play_track(music, 2);
 
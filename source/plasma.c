@@ -6,26 +6,28 @@
 #include <math.h>
 #include "dos.h"
 
-// Y-coordinate first because we use horizontal scanlines
-unsigned int plasma[200][320];
-
 int main(int argc, char *argv[])
 {
   setvideomode( videomode_320x200 );
-  setdoublebuffer(1);
   int w = 320;
   int h = 200;
 
   //generate the palette
+  unsigned char palette[256 * 3];
   for(int x = 0; x < 256; x++)
   {
     int r = (int)(128.0 + 128 * sin(3.1415 * x / 32.0));
     int g = (int)(128.0 + 128 * sin(3.1415 * x / 64.0));
     int b = (int)(128.0 + 128 * sin(3.1415 * x / 128.0));
-    setpal( x, r >> 2, g >> 2, b >> 2 );
+    palette[x * 3 + 0] = (unsigned char)(r >> 2);
+    palette[x * 3 + 1] = (unsigned char)(g >> 2);
+    palette[x * 3 + 2] = (unsigned char)(b >> 2);
   } 
+  setpalette( 0, 256, palette );
   
-  //generate the plasma once
+  unsigned char* buffer = screenbuffer();
+
+  //draw the plasma once
   for(int y = 0; y < h; y++)
   for(int x = 0; x < w; x++)
   {
@@ -37,31 +39,17 @@ int main(int argc, char *argv[])
       + 128.0 + (128.0 * sin((x + y) / 32.0))
       + 128.0 + (128.0 * sin(sqrt((double)(x * x + y * y)) / 16.0))
     ) / 4;
-    plasma[y][x] = color;
+    buffer[x + y * 320] = (unsigned char)color;
   }
   
-  int paletteShift = 0;
-
-  unsigned char* buffer = screenbuffer();
+  //the animation is done by rotating the palette one step every frame, which shifts the color of every pixel without 
+  //touching the pixels themselves
+  palettecycle( 0, 256, 60 );
 
-  //start the animation loop, it rotates the palette
   while(!shuttingdown())
   {
     waitvbl();
 
-    //the parameter to shift the palette varies with time
-    paletteShift++;
-
-    //draw every pixel again, with the shifted palette color
-    for(int y = 0; y < h; y++)
-    for(int x = 0; x < w; x++)
-    {
-      buffer[x + y * 320 ] = (plasma[y][x] + paletteShift) % 256;
-    }
-
-    //make everything visible
-    buffer = swapbuffers();
-
     if( keystate( KEY_ESCAPE ) ) {
         break;
     }
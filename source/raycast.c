@@ -134,7 +134,6 @@ int main(int argc, char* argv[])
   double posZ = 0; // vertical camera strafing up/down, for jumping/crouching. 0 means standard height. Expressed in screen pixels a wall at distance 1 shifts
 
   uint8_t* texture[11];
-  uint8_t* darktexture[11];
 
   setvideomode( videomode_320x200 ); 
   int w = 320;
@@ -153,15 +152,6 @@ int main(int argc, char* argv[])
   texture[6] = loadgif( "files/raycast/wood.gif", &tw, &th, &palcount, palette );    
   texture[7] = loadgif( "files/raycast/colorstone.gif", &tw, &th, &palcount, palette );    
 
-  darktexture[0] = loadgif( "files/raycast/deagle.gif", &tw, &th, &palcount, palette );    
-  darktexture[1] = loadgif( "files/raycast/dredbrick.gif", &tw, &th, &palcount, palette );    
-  darktexture[2] = loadgif( "files/raycast/dpurplestone.gif", &tw, &th, &palcount, palette );    
-  darktexture[3] = loadgif( "files/raycast/dgreystone.gif", &tw, &th, &palcount, palette );    
-  darktexture[4] = loadgif( "files/raycast/dbluestone.gif", &tw, &th, &palcount, palette );    
-  darktexture[5] = loadgif( "files/raycast/dmossy.gif", &tw, &th, &palcount, palette );    
-  darktexture[6] = loadgif( "files/raycast/dwood.gif", &tw, &th, &palcount, palette );    
-  darktexture[7] = loadgif( "files/raycast/dcolorstone.gif", &tw, &th, &palcount, palette );    
-
   //load some sprite textures
   texture[8] = loadgif( "files/raycast/barrel.gif", &tw, &th, &palcount, palette );    
   texture[9] = loadgif( "files/raycast/pillar.gif", &tw, &th, &palcount, palette );    
@@ -171,6 +161,10 @@ int main(int argc, char* argv[])
       setpal(i, palette[ 3 * i + 0 ],palette[ 3 * i + 1 ], palette[ 3 * i + 2 ] );
   }
 
+  //light levels for darkening with distance, and for the darker y-sides and floor, instead of darker copies of every 
+  //texture. Level 16 is half as bright, and each step of one square further away is one level darker.
+  buildshadetable( 32 );
+
    uint8_t* buffer = screenbuffer();
 
   //start the main loop
@@ -225,6 +219,8 @@ int main(int argc, char* argv[])
       float floorX = (float)( posX + rowDistance * rayDirX0 );
       float floorY = (float)( posY + rowDistance * rayDirY0 );
 
+      uint8_t const* shade = shadetable( 16 + (int)dmin( rowDistance, 16 ) );
+
       for(int x = 0; x < screenWidth; ++x)
       {
         // the cell coord is simply got from the integer parts of floorX and floorY
@@ -249,14 +245,12 @@ int main(int argc, char* argv[])
 
         if(is_floor) {
           // floor
-          color = darktexture[floorTexture][texWidth * ty + tx];
-          //color = (color >> 1) & 8355711; // make a bit darker
-          buffer[ x + w * y ] = (uint8_t)color;
+          color = texture[floorTexture][texWidth * ty + tx];
+          buffer[ x + w * y ] = shade[color];
         } else {
           //ceiling
-          color = darktexture[ceilingTexture][texWidth * ty + tx];
-          //color = (color >> 1) & 8355711; // make a bit darker
-          buffer[ x + w * y ] = (uint8_t)color;
+          color = texture[ceilingTexture][texWidth * ty + tx];
+          buffer[ x + w * y ] = shade[color];
         }
       }
     }
@@ -362,16 +356,11 @@ int main(int argc, char* argv[])
       double step = 1.0 * texHeight / lineHeight;
       // Starting texture coordinate
       double texPos = (drawStart - pitch - (posZ / perpWallDist) - h / 2 + lineHeight / 2) * step;
-      for(int y = drawStart; y < drawEnd; y++)
-      {
-        // Cast the texture coordinate to integer, and mask with (texHeight - 1) in case of overflow
-        int texY = (int)texPos & (texHeight - 1);
-        texPos += step;
-        uint32_t color = (side == 1 ? darktexture : texture )[texNum][texHeight * texY + texX];
-        //make color darker for y-sides: R, G and B byte each divided through two with a "shift" and an "and"
-        //if(side == 1) color = (color >> 1) & 8355711;
-        buffer[ x + w * y ] = (uint8_t)color;
-      }
+      //draw the textured column, darker for y-sides and further away. The texture coordinate wraps around in case of
+      //overflow
+      int level = (side == 1 ? 16 : 0) + (int)dmin( perpWallDist, 32 );
+      shadecolumn( x, drawStart, drawEnd - drawStart, texture[texNum], texWidth, texHeight, texX, (float)texPos, 
+        (float)step, -1, level );
 
       //SET THE ZBUFFER FOR THE SPRITE CASTING
       ZBuffer[x] = perpWallDist; //perpendicular distance is used
@@ -424,7 +413,7 @@ int main(int argc, char* argv[])
         floorTexX = (int)(currentFloorX * texWidth) & (texWidth - 1);
         floorTexY = (int)(currentFloorY * texHeight) & (texHeight - 1);
 
-        buffer[ x + w * y ] = darktexture[6][texWidth * floorTexY + floorTexX];
+        buffer[ x + w * y ] = shadetable( 16 + (int)dmin( currentDist, 16 ) )[texture[6][texWidth * floorTexY + floorTexX]];
       }
 
       //draw the floor from drawEnd to the bottom of the screen
@@ -446,7 +435,7 @@ int main(int argc, char* argv[])
         if(checkerBoardPattern == 0) floorTexture = 3;
         else floorTexture = 4;
 
-        buffer[ x + w * y ] = (darktexture[floorTexture][texWidth * floorTexY + floorTexX] >> 1) & 8355711;
+        buffer[ x + w * y ] = shadetable( 16 + (int)dmin( currentDist, 16 ) )[texture[floorTexture][texWidth * floorTexY + floorTexX]];
       }
 #endif // !FLOOR_HORIZONTAL
     }
@@ -500,6 +489,8 @@ int main(int argc, char* argv[])
       int drawEndX = spriteWidth / 2 + spriteScreenX;
       if(drawEndX >= w) drawEndX = w - 1;
 
+      uint8_t const* shade = shadetable( (int)dmax( dmin( transformY, 32 ), 0 ) );
+
       //loop through every vertical stripe of the sprite on screen
       for(int stripe = drawStartX; stripe < drawEndX; stripe++)
       {
@@ -515,7 +506,7 @@ int main(int argc, char* argv[])
           int d = (y-vMoveScreen) * 256 - h * 128 + spriteHeight * 128; //256 and 128 factors to avoid floats
           int texY = ((d * texHeight) / spriteHeight) / 256;
           uint32_t color = texture[sprite[spriteOrder[i]].texture][texWidth * texY + texX]; //get current color from the texture
-          if((color & 0x00FFFFFF) != 0) buffer[ stripe + w * y ] = (uint8_t)color; //paint pixel if it isn't black, black is the invisible color
+          if((color & 0x00FFFFFF) != 0) buffer[ stripe + w * y ] = shade[color]; //paint pixel if it isn't black, black is the invisible color
         }
       }
     }
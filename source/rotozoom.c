@@ -20,25 +20,19 @@ int main( int argc, char *argv[] ) {
         setpal(i, palette[ 3 * i + 0 ],palette[ 3 * i + 1 ], palette[ 3 * i + 2 ] );
     }
 
-    unsigned char* buffer = screenbuffer();
-    int angle = 0.0f;
+    int angle = 0;
     while( !shuttingdown() ) {
         waitvbl();
         float s = (float)sin( angle * PI / 180.0f );
         float c = (float)cos( angle * PI / 180.0f );
         angle = ( angle + 1 ) % 360;
-        int destOfs = 0;
-        for( int y = 0; y < 200; ++y ) {
-            for( int x = 0; x < 320; ++x ) {
-                int u = (int)( ( x * c - y * s ) * ( s + 1 ) + 64 ) % gifWidth;
-                int v = (int)( ( x * s + y * c ) * ( s + 1 ) + 64 ) % gifHeight;
-                if( u < 0 ) u += gifWidth;
-                if( v < 0 ) v += gifHeight;                
-                int srcOfs = ( u + v * gifWidth );
-                buffer[destOfs++] = gif[ srcOfs ];
-            }
-        }
-        buffer = swapbuffers();
+        // Screen position x, y shows texture position ( x * c - y * s, x * s + y * c ) * ( s + 1 ) + 64, so find where
+        // the center of the screen lands, and let rotoblit step from there
+        float scale = s + 1.0f < 0.01f ? 0.01f : s + 1.0f;
+        float u = ( 160.0f * c - 100.0f * s ) * scale + 64.0f;
+        float v = ( 160.0f * s + 100.0f * c ) * scale + 64.0f;
+        rotoblit( 0, 0, 320, 200, gif, gifWidth, gifHeight, u, v, -angle * PI / 180.0f, 1.0f / scale, -1, BLIT_WRAP );
+        swapbuffers();
 
         if( keystate( KEY_ESCAPE ) ) break;     
     }
@@ -8,7 +8,7 @@
 #include <math.h>
 #include "dos.h"
 
-enum bitmap_t {
+enum bitmap_id_t {
     INVALID,
     BACKGROUND,
     TREELINE,
@@ -44,12 +44,12 @@ enum bitmap_t {
 };
 
 struct {
-    enum bitmap_t id;
+    enum bitmap_id_t id;
     char const* filename;
     int w;
     int h;
     int cels;
-    unsigned char* pixels[ 20 ];
+    struct sprite_t* sprites[ 20 ];
 } bitmaps[] = {
     { INVALID, NULL },
     { BACKGROUND, "files/stranded/background.gif" },
@@ -100,18 +100,22 @@ void loadbitmaps( void ) {
                 sprintf( temp, filename, j + 1 );
                 int w = 0;
                 int h = 0;
-                bitmaps[ i ].pixels[ j ] = loadgif( temp, &w, &h, &palcount, palette );            
-                if( !bitmaps[ i ].pixels[ j ] ) {
+                unsigned char* pixels = loadgif( temp, &w, &h, &palcount, palette );            
+                if( !pixels ) {
                     bitmaps[ i ].cels = j;
                     break;
                 } else {
                     bitmaps[ i ].w = w; 
                     bitmaps[ i ].h = h;
+                    bitmaps[ i ].sprites[ j ] = makesprite( pixels, w, h, 255 );
+                    free( pixels );
                 }
             }
         } else {
-            bitmaps[ i ].pixels[ 0 ] = loadgif( filename, &bitmaps[ i ].w, &bitmaps[ i ].h, &palcount, palette );            
+            unsigned char* pixels = loadgif( filename, &bitmaps[ i ].w, &bitmaps[ i ].h, &palcount, palette );            
+            bitmaps[ i ].sprites[ 0 ] = makesprite( pixels, bitmaps[ i ].w, bitmaps[ i ].h, 255 );
             bitmaps[ i ].cels = 1;
+            free( pixels );
         }
     } 
 }
@@ -124,7 +128,7 @@ struct {
     int origin_y;
     int visible;
     int cel;
-    enum bitmap_t bitmap;
+    enum bitmap_id_t bitmap;
     char const* label_text;
     int label_color;
     int label_wrap;
@@ -132,7 +136,7 @@ struct {
 
 int spr_index = 0;
 
-int sprite( int spr, int x, int y, enum bitmap_t bitmap ) {
+int sprite( int spr, int x, int y, enum bitmap_id_t bitmap ) {
     sprites[ spr ].x = x;
     sprites[ spr ].y = y;
     sprites[ spr ].visible = 1;
@@ -184,7 +188,7 @@ void sprite_origin( int spr, int x, int y ) {
     sprites[ spr ].origin_y = y;
 }
 
-void sprite_bitmap( int spr, enum bitmap_t bitmap ) {
+void sprite_bitmap( int spr, enum bitmap_id_t bitmap ) {
     sprites[ spr ].bitmap = bitmap;
 }
 
@@ -204,31 +208,22 @@ void label_text( int spr, char const* text ) {
 void drawsprites( void ) {
     for( int i = 0; i < spr_index; ++i ) {
         if( !sprites[ i ].visible ) continue;
-        enum bitmap_t bitmap = sprites[ i ].bitmap;
+        enum bitmap_id_t bitmap = sprites[ i ].bitmap;
         char const* label = sprites[ i ].label_text;
         int xp = sprites[ i ].x - sprites[ i ].origin_x;
         int yp = sprites[ i ].y - sprites[ i ].origin_y;
         if( bitmap != INVALID ) {
-            int width = bitmaps[ bitmap ].w;
-            int height = bitmaps[ bitmap ].h;
-            unsigned char* pixels = bitmaps[ bitmap ].pixels[ sprites[ i ].cel % bitmaps[ bitmap ].cels ];
-            maskblit( xp, yp, pixels, width, height, 0, 0, width, height, 255 );
+            drawsprite( xp, yp, bitmaps[ bitmap ].sprites[ sprites[ i ].cel % bitmaps[ bitmap ].cels ] );
         } else if( label ) {
             setcolor( 254 );
             yp += 30;
-			for( int y = -1; y <= 1; ++y ) {
-                for( int x = -1; x <= 1; ++x ) {
-				    if( x == 0 && y == 0 ) continue;
-                    centertextxy( xp + x, yp + y, label, sprites[ i ].label_wrap );
-                }
-            }
             centertextxy( xp + 2, yp, label, sprites[ i ].label_wrap );
             centertextxy( xp + 2, yp + 1, label, sprites[ i ].label_wrap );
             centertextxy( xp - 1, yp + 2, label, sprites[ i ].label_wrap );
             centertextxy( xp    , yp + 2, label, sprites[ i ].label_wrap );
             centertextxy( xp + 1, yp + 2, label, sprites[ i ].label_wrap );
             setcolor( sprites[ i ].label_color );
-            centertextxy( xp, yp, label, sprites[ i ].label_wrap );
+            outlinetextxy( xp, yp, label, 254, sprites[ i ].label_wrap, 1 );
         }
     }
 }